@@ -0,0 +1,550 @@
+/*  admin.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Local admin control API.
+ *
+ * Requests are single lines of text, using the same syntax as commands sent over Tox. Each request is answered
+ * with zero or more reply lines followed by a line containing a single ".". Reply lines that begin with "."
+ * have it doubled. Requests may be pipelined; replies are sent in order.
+ *
+ * In addition to the regular command set, the following bulk requests are supported:
+ *   masters <id> [<id> ...]                 Adds Tox IDs to the masterkeys file
+ *   invitemany <n> <friend> [<friend> ...]  Invites friend numbers to groupchat n
+ *                                           (runs as a background task; later requests wait for it)
+ *   friends                                 Lists all friends
+ */
+
+#define _GNU_SOURCE    /* struct ucred */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "commands.h"
+#include "groupchats.h"
+#include "misc.h"
+#include "log.h"
+#include "admin.h"
+#include "mem.h"
+#include "tasks.h"
+#include "timers.h"
+
+extern char *MASTERLIST_FILE;
+extern struct Tox_Bot Tox_Bot;
+
+struct Admin_Client {
+    int fd;
+    char in[ADMIN_BUF_SIZE];
+    size_t in_len;
+    char out[ADMIN_BUF_SIZE];
+    size_t out_len;
+    bool overflow;    /* the current reply didn't fit in out */
+    struct Invite_Task *task;    /* request still running as a task; no further requests run until it finishes */
+};
+
+#define INVITE_STEP 32    /* invites sent per task step */
+
+struct Invite_Task {
+    struct Admin_Client *client;    /* NULL if the client disconnected */
+    int groupnum;
+    uint32_t num_friends;
+    uint32_t cursor;
+    int sent, skipped, failed;
+    uint32_t friends[];
+};
+
+static int listen_fd = -1;
+static char socket_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static struct Admin_Client clients[ADMIN_MAX_CLIENTS];
+static struct Admin_Client *cur_client;
+
+static void client_close(struct Admin_Client *c)
+{
+    if (c->task) {
+        c->task->client = NULL;
+        c->task = NULL;
+    }
+
+    close(c->fd);
+    c->fd = -1;
+    c->in_len = 0;
+    c->out_len = 0;
+}
+
+int admin_init(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    int i;
+
+    for (i = 0; i < ADMIN_MAX_CLIENTS; ++i)
+        clients[i].fd = -1;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (listen_fd == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || chmod(path, S_IRUSR | S_IWUSR) == -1
+            || listen(listen_fd, ADMIN_MAX_CLIENTS) == -1) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    snprintf(socket_path, sizeof(socket_path), "%s", path);
+    return 0;
+}
+
+void admin_close(void)
+{
+    if (listen_fd == -1)
+        return;
+
+    int i;
+
+    for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+        if (clients[i].fd != -1)
+            client_close(&clients[i]);
+    }
+
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+}
+
+static bool peer_allowed(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return false;
+
+    return cred.uid == 0 || cred.uid == geteuid();
+}
+
+static void accept_clients(void)
+{
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd == -1)
+            return;
+
+        if (!peer_allowed(fd)) {
+            close(fd);
+            continue;
+        }
+
+        int i;
+
+        for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+            if (clients[i].fd == -1)
+                break;
+        }
+
+        if (i == ADMIN_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+
+        clients[i].fd = fd;
+        clients[i].in_len = 0;
+        clients[i].out_len = 0;
+    }
+}
+
+static void append_out(struct Admin_Client *c, const char *data, size_t len)
+{
+    if (len > sizeof(c->out) - c->out_len) {
+        c->overflow = true;
+        return;
+    }
+
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+void admin_reply(const char *msg)
+{
+    if (cur_client == NULL)
+        return;
+
+    /* dot-stuff every line so a reply can't be mistaken for the terminator */
+    while (*msg) {
+        size_t len = strcspn(msg, "\n");
+
+        if (msg[0] == '.')
+            append_out(cur_client, ".", 1);
+
+        append_out(cur_client, msg, len);
+        append_out(cur_client, "\n", 1);
+
+        msg += len;
+
+        if (*msg == '\n')
+            ++msg;
+    }
+}
+
+static void bulk_masters(Tox *m, char *args)
+{
+    FILE *fp = fopen(MASTERLIST_FILE, "a");
+
+    if (fp == NULL) {
+        admin_reply("Error: could not open masterkeys file");
+        return;
+    }
+
+    char *saveptr;
+    char *id;
+    int added = 0;
+
+    for (id = strtok_r(args, " ", &saveptr); id; id = strtok_r(NULL, " ", &saveptr)) {
+        if (strlen(id) != TOX_ADDRESS_SIZE * 2) {
+            char msg[TOX_ADDRESS_SIZE * 2 + 64];
+            snprintf(msg, sizeof(msg), "Error: Invalid Tox ID %.*s", TOX_ADDRESS_SIZE * 2, id);
+            admin_reply(msg);
+            continue;
+        }
+
+        fprintf(fp, "%s\n", id);
+        friend_master_added(m, id);
+        log_event(LOG_INFO, EV_MASTER_ADDED, ADMIN_FRIENDNUM, -1, 0, id);
+        ++added;
+    }
+
+    fclose(fp);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%d IDs added to masterkeys list", added);
+    admin_reply(msg);
+}
+
+static void finish_reply(struct Admin_Client *c)
+{
+    if (c->overflow) {
+        c->overflow = false;
+        append_out(c, "Error: reply truncated\n", 23);
+    }
+
+    append_out(c, ".\n", 2);
+}
+
+static bool invite_step(Tox *m, void *state)
+{
+    struct Invite_Task *t = state;
+    int idx = group_index(t->groupnum);
+    uint64_t now = timer_now();
+    uint32_t end = MIN(t->cursor + INVITE_STEP, t->num_friends);
+
+    for (; idx != -1 && t->cursor < end; ++t->cursor) {
+        uint32_t friendnum = t->friends[t->cursor];
+
+        if (group_invite_check(idx, friendnum, now) != INVITE_SEND) {
+            ++t->skipped;
+            continue;
+        }
+
+        if (tox_invite_friend(m, friendnum, t->groupnum) == -1) {
+            ++t->failed;
+            continue;
+        }
+
+        group_invite_sent(idx, friendnum, now);
+        log_event(LOG_INFO, EV_INVITE_SENT, friendnum, t->groupnum, 0, NULL);
+        ++t->sent;
+    }
+
+    if (idx != -1 && t->cursor < t->num_friends)
+        return false;
+
+    if (t->client) {
+        char msg[160];
+        snprintf(msg, sizeof(msg), "%s%d invites sent, %d already present or recently invited, %d failed",
+                 idx == -1 ? "Error: Group was left; " : "", t->sent, t->skipped, t->failed);
+
+        cur_client = t->client;
+        admin_reply(msg);
+        finish_reply(t->client);
+        cur_client = NULL;
+        t->client->task = NULL;
+    }
+
+    mem_free(t);
+    return true;
+}
+
+/* Parses the friend list and schedules the invites as a task. Returns true if the reply was deferred. */
+static bool bulk_invite(Tox *m, struct Admin_Client *c, char *args)
+{
+    /* every friend number takes at least two characters including its separator */
+    size_t max_friends = strlen(args) / 2 + 1;
+    char *saveptr;
+    char *tok = strtok_r(args, " ", &saveptr);
+
+    if (tok == NULL) {
+        admin_reply("Error: Group number required");
+        return false;
+    }
+
+    int groupnum = atoi(tok);
+
+    if (group_index(groupnum) == -1 || (groupnum == 0 && strcmp(tok, "0"))) {
+        admin_reply("Error: Invalid group number");
+        return false;
+    }
+
+    struct Invite_Task *t = mem_alloc(MEM_COMMANDS, sizeof(struct Invite_Task) + max_friends * sizeof(uint32_t));
+
+    if (t == NULL) {
+        admin_reply("Error: Out of memory");
+        return false;
+    }
+
+    memset(t, 0, sizeof(struct Invite_Task));
+    t->client = c;
+    t->groupnum = groupnum;
+
+    while ((tok = strtok_r(NULL, " ", &saveptr))) {
+        char *end;
+        unsigned long friendnum = strtoul(tok, &end, 10);
+
+        if (end == tok || *end != '\0' || friendnum > UINT32_MAX || !tox_friend_exists(m, friendnum)) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Error: Invalid friend number %.32s", tok);
+            admin_reply(msg);
+            mem_free(t);
+            return false;
+        }
+
+        t->friends[t->num_friends++] = friendnum;
+    }
+
+    if (task_start("invitemany", invite_step, t) == -1) {
+        mem_free(t);
+        admin_reply("Error: Too many tasks running; try again later");
+        return false;
+    }
+
+    c->task = t;
+    return true;
+}
+
+static void bulk_friends(Tox *m)
+{
+    size_t i, numfriends = tox_self_get_friend_list_size(m);
+
+    if (numfriends == 0)
+        return;
+
+    uint32_t friend_list[numfriends];
+    tox_self_get_friend_list(m, friend_list);
+
+    for (i = 0; i < numfriends; ++i) {
+        uint32_t friendnum = friend_list[i];
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+        char name[TOX_MAX_NAME_LENGTH + 1];
+        char line[TOX_PUBLIC_KEY_SIZE * 2 + TOX_MAX_NAME_LENGTH + 64];
+
+        if (!tox_friend_get_public_key(m, friendnum, key, NULL))
+            continue;
+
+        size_t len = tox_friend_get_name_size(m, friendnum, NULL);
+        tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
+        name[MIN(len, TOX_MAX_NAME_LENGTH)] = '\0';
+
+        int pos = snprintf(line, sizeof(line), "%u ", friendnum);
+        int j;
+
+        for (j = 0; j < TOX_PUBLIC_KEY_SIZE; ++j)
+            pos += snprintf(line + pos, sizeof(line) - pos, "%02X", key[j]);
+
+        bool online = tox_friend_get_connection_status(m, friendnum, NULL) != TOX_CONNECTION_NONE;
+        snprintf(line + pos, sizeof(line) - pos, " %s %s", online ? "online" : "offline", name);
+        admin_reply(line);
+    }
+}
+
+static void handle_request(Tox *m, struct Admin_Client *c, char *line, size_t length)
+{
+    cur_client = c;
+    c->overflow = false;
+
+    if (strncmp(line, "masters ", 8) == 0) {
+        bulk_masters(m, line + 8);
+    } else if (strncmp(line, "invitemany ", 11) == 0) {
+        if (bulk_invite(m, c, line + 11)) {
+            cur_client = NULL;
+            return;
+        }
+    } else if (strcmp(line, "friends") == 0) {
+        bulk_friends(m);
+    } else if (length && execute(m, ADMIN_FRIENDNUM, line, length) == -1) {
+        admin_reply("Invalid command");
+    }
+
+    finish_reply(c);
+    cur_client = NULL;
+}
+
+/* Flushes as much pending output as the socket accepts. Returns -1 if the connection should be closed. */
+static int flush_out(struct Admin_Client *c)
+{
+    if (c->out_len == 0)
+        return 0;
+
+    ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+
+    if (n == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+    return 0;
+}
+
+/* Requests aren't read or executed until the client drains its replies */
+static bool output_paused(const struct Admin_Client *c)
+{
+    return c->out_len > sizeof(c->out) / 2;
+}
+
+static void process_client(Tox *m, struct Admin_Client *c)
+{
+    if (flush_out(c) == -1) {
+        client_close(c);
+        return;
+    }
+
+    /* leave further requests in the socket until the running one finishes */
+    if (c->task)
+        return;
+
+    if (!output_paused(c) && c->in_len < sizeof(c->in)) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            client_close(c);
+            return;
+        }
+
+        if (n > 0)
+            c->in_len += n;
+    }
+
+    size_t start = 0;
+
+    while (start < c->in_len && c->task == NULL && !output_paused(c)) {
+
+        char *nl = memchr(c->in + start, '\n', c->in_len - start);
+
+        if (nl == NULL)
+            break;
+
+        size_t len = nl - (c->in + start);
+        *nl = '\0';
+
+        if (len && c->in[start + len - 1] == '\r')
+            c->in[start + --len] = '\0';
+
+        handle_request(m, c, c->in + start, len);
+        start += (nl - (c->in + start)) + 1;
+    }
+
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+
+    /* a line longer than our buffer can never be completed */
+    if (c->in_len == sizeof(c->in) && memchr(c->in, '\n', c->in_len) == NULL) {
+        client_close(c);
+        return;
+    }
+
+    if (flush_out(c) == -1)
+        client_close(c);
+}
+
+void admin_do(Tox *m)
+{
+    if (listen_fd == -1)
+        return;
+
+    struct pollfd fds[ADMIN_MAX_CLIENTS + 1];
+    int i, nfds = 0;
+
+    fds[nfds].fd = listen_fd;
+    fds[nfds++].events = POLLIN;
+
+    for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+        if (clients[i].fd == -1)
+            continue;
+
+        fds[nfds].fd = clients[i].fd;
+        fds[nfds++].events = POLLIN | (clients[i].out_len ? POLLOUT : 0);
+    }
+
+    if (poll(fds, nfds, 0) == -1)
+        return;
+
+    if (fds[0].revents & POLLIN)
+        accept_clients();
+
+    for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+        if (clients[i].fd == -1)
+            continue;
+
+        /* clients with buffered requests are processed even without new activity */
+        bool ready = clients[i].in_len > 0;
+        int j;
+
+        for (j = 1; j < nfds && !ready; ++j) {
+            if (fds[j].fd == clients[i].fd && fds[j].revents)
+                ready = true;
+        }
+
+        if (ready)
+            process_client(m, &clients[i]);
+    }
+}
@@ -0,0 +1,46 @@
+/*  admin.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <tox/tox.h>
+
+#define ADMIN_SOCKET_PATH "toxbot.sock"
+#define ADMIN_MAX_CLIENTS 8
+#define ADMIN_BUF_SIZE 65536    /* per-client input and output buffer size; also the max request line length */
+
+/* Creates the admin socket at path. Only processes running as our user (or root) may use it.
+   Returns 0 on success, -1 on failure. */
+int admin_init(const char *path);
+
+/* Accepts new admin connections and executes all complete requests that have arrived.
+   Should be called once per main loop iteration; never blocks. */
+void admin_do(Tox *m);
+
+/* Appends msg to the reply for the request currently being executed */
+void admin_reply(const char *msg);
+
+/* Closes all admin connections and removes the socket */
+void admin_close(void);
+
+#endif /* ADMIN_H */
@@ -0,0 +1,949 @@
+/*  archive.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime, nanosleep, localtime_r, ftruncate */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+
+#include "log.h"
+#include "archive.h"
+#include "mem.h"
+#include "events.h"
+
+#define SEGMENT_MAGIC "TBARCH01"
+#define SEGMENT_DATA_START 64         /* records start after the header, cache line aligned */
+#define ARCHIVE_MSG_TERMS 256         /* most distinct terms indexed per message */
+#define ARCHIVE_MIN_TERM_LEN 2
+#define RECORD_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+/*
+ * Each group's messages are appended to a series of fixed size segment files which stay mapped while the
+ * bot is in the group, keeping the message text off the heap; the indexes are only kept in memory.
+ * Toxcore groups don't survive a restart and their numbers are reused, so an archive lives exactly as long
+ * as the bot's membership: the segments are deleted when the group is left or its number is joined again,
+ * and leftovers of an earlier run are deleted at startup.
+ */
+struct Segment_Header {
+    char magic[8];
+    uint64_t used;    /* bytes of the segment in use, including the header */
+};
+
+struct Record_Header {
+    uint32_t len;    /* of the whole record including padding */
+    uint32_t id;
+    uint64_t time;
+    uint16_t name_len;
+    uint16_t msg_len;
+    uint32_t reserved;
+    /* followed by the name and the message */
+};
+
+struct Segment {
+    int fd;
+    char *map;
+};
+
+/* Location of every ARCHIVE_INDEX_STRIDE'th message */
+struct Sparse_Entry {
+    uint64_t time;
+    uint32_t seg;
+    uint32_t offset;
+};
+
+/* Posting list of the ids of the messages containing a term, in ascending order */
+struct Posting {
+    uint64_t hash;    /* of the term; 0 if the slot is unused */
+    uint32_t *ids;
+    uint32_t len;
+    uint32_t cap;
+};
+
+struct Archive_Group {
+    int groupnum;
+    struct Segment *segs;
+    uint32_t num_segs;
+    uint32_t num_msgs;
+    struct Sparse_Entry *sparse;
+    uint32_t sparse_cap;
+    struct Posting *terms;    /* open addressing hash table */
+    uint32_t terms_cap;       /* power of 2 */
+    uint32_t num_terms;
+    bool dirty;               /* appended to since the last msync */
+};
+
+typedef enum {
+    ENTRY_MESSAGE,
+    ENTRY_OPEN,
+    ENTRY_CLOSE,
+} ENTRY_TYPE;
+
+struct Archive_Entry {
+    uint8_t type;
+    int groupnum;
+    uint64_t time;
+    uint16_t name_len;
+    uint16_t msg_len;
+    char name[TOX_MAX_NAME_LENGTH];
+    char msg[TOX_MAX_MESSAGE_LENGTH];
+};
+
+static struct {
+    /* single producer single consumer queue: the main thread advances head, the writer thread tail */
+    struct Archive_Entry queue[ARCHIVE_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+
+    pthread_t thread;
+    bool running;
+    bool quit;    /* accessed atomically */
+
+    /* the list of loaded groups and their contents may only be changed by the writer thread while
+       holding lock, and may only be read by other threads while holding it */
+    pthread_mutex_t lock;
+    struct Archive_Group **groups;
+    int num_groups;
+
+    /* updated by the main thread */
+    uint64_t messages_queued;
+    uint64_t messages_dropped;
+    uint64_t queries;
+    uint64_t query_ns;
+
+    /* updated by the writer thread */
+    uint64_t messages_written;
+    uint64_t write_failures;
+    uint64_t batches;
+} Archive = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void segment_path(char *buf, size_t size, int groupnum, uint32_t seg)
+{
+    snprintf(buf, size, "%s/g%d-%06u.seg", ARCHIVE_DIR, groupnum, seg);
+}
+
+static struct Segment_Header *segment_header(const struct Segment *s)
+{
+    return (struct Segment_Header *) s->map;
+}
+
+static struct Record_Header *record_at(const struct Archive_Group *g, uint32_t seg, uint32_t offset)
+{
+    return (struct Record_Header *) (g->segs[seg].map + offset);
+}
+
+/* Moves seg and offset on to the record following the one they point to */
+static void next_record(const struct Archive_Group *g, uint32_t *seg, uint32_t *offset)
+{
+    *offset += record_at(g, *seg, *offset)->len;
+
+    if (*offset >= segment_header(&g->segs[*seg])->used) {
+        ++*seg;
+        *offset = SEGMENT_DATA_START;
+    }
+}
+
+/* Finds the record of message id, which must exist */
+static void locate(const struct Archive_Group *g, uint32_t id, uint32_t *seg, uint32_t *offset)
+{
+    const struct Sparse_Entry *e = &g->sparse[id / ARCHIVE_INDEX_STRIDE];
+    uint32_t i;
+
+    *seg = e->seg;
+    *offset = e->offset;
+
+    for (i = 0; i < id % ARCHIVE_INDEX_STRIDE; ++i)
+        next_record(g, seg, offset);
+}
+
+static uint64_t term_hash(const char *s, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (uint8_t) s[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h ? h : 1;
+}
+
+static bool is_term_char(char c)
+{
+    /* treat all multibyte UTF-8 sequences as word characters */
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c & 0x80);
+}
+
+/* Puts the hashes of the distinct lowercased terms in s into hashes. Returns the number of terms. */
+static int tokenize(const char *s, size_t len, uint64_t *hashes, int max)
+{
+    char term[64];
+    int num = 0;
+    size_t i = 0;
+
+    while (i < len && num < max) {
+        while (i < len && !is_term_char(s[i]))
+            ++i;
+
+        size_t term_len = 0;
+
+        for (; i < len && is_term_char(s[i]); ++i) {
+            if (term_len < sizeof(term))
+                term[term_len++] = (s[i] >= 'A' && s[i] <= 'Z') ? s[i] + ('a' - 'A') : s[i];
+        }
+
+        if (term_len < ARCHIVE_MIN_TERM_LEN)
+            continue;
+
+        uint64_t h = term_hash(term, term_len);
+        int j;
+
+        for (j = 0; j < num && hashes[j] != h; ++j)
+            ;
+
+        if (j == num)
+            hashes[num++] = h;
+    }
+
+    return num;
+}
+
+static struct Posting *find_posting(const struct Archive_Group *g, uint64_t hash)
+{
+    if (g->terms_cap == 0)
+        return NULL;
+
+    uint32_t i = hash & (g->terms_cap - 1);
+
+    while (g->terms[i].hash) {
+        if (g->terms[i].hash == hash)
+            return &g->terms[i];
+
+        i = (i + 1) & (g->terms_cap - 1);
+    }
+
+    return NULL;
+}
+
+static int grow_terms(struct Archive_Group *g)
+{
+    uint32_t cap = g->terms_cap ? g->terms_cap * 2 : 1024;
+    struct Posting *terms = mem_calloc(MEM_CACHES, cap, sizeof(struct Posting));
+
+    if (terms == NULL)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < g->terms_cap; ++i) {
+        if (g->terms[i].hash == 0)
+            continue;
+
+        uint32_t j = g->terms[i].hash & (cap - 1);
+
+        while (terms[j].hash)
+            j = (j + 1) & (cap - 1);
+
+        terms[j] = g->terms[i];
+    }
+
+    mem_free(g->terms);
+    g->terms = terms;
+    g->terms_cap = cap;
+    return 0;
+}
+
+static void add_posting(struct Archive_Group *g, uint64_t hash, uint32_t id)
+{
+    struct Posting *p = find_posting(g, hash);
+
+    if (p == NULL) {
+        if ((g->num_terms + 1) * 10 >= g->terms_cap * 7 && grow_terms(g) == -1)
+            return;
+
+        uint32_t i = hash & (g->terms_cap - 1);
+
+        while (g->terms[i].hash)
+            i = (i + 1) & (g->terms_cap - 1);
+
+        p = &g->terms[i];
+        p->hash = hash;
+        ++g->num_terms;
+    }
+
+    if (p->len == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 4;
+        uint32_t *ids = mem_realloc(MEM_CACHES, p->ids, cap * sizeof(uint32_t));
+
+        if (ids == NULL)
+            return;
+
+        p->ids = ids;
+        p->cap = cap;
+    }
+
+    p->ids[p->len++] = id;
+}
+
+/* Adds the record at seg and offset to the indexes as the next message */
+static int index_record(struct Archive_Group *g, uint32_t seg, uint32_t offset)
+{
+    struct Record_Header *rec = record_at(g, seg, offset);
+    uint32_t id = g->num_msgs;
+
+    if (id % ARCHIVE_INDEX_STRIDE == 0) {
+        uint32_t n = id / ARCHIVE_INDEX_STRIDE;
+
+        if (n == g->sparse_cap) {
+            uint32_t cap = g->sparse_cap ? g->sparse_cap * 2 : 64;
+            struct Sparse_Entry *sparse = mem_realloc(MEM_CACHES, g->sparse, cap * sizeof(struct Sparse_Entry));
+
+            if (sparse == NULL)
+                return -1;
+
+            g->sparse = sparse;
+            g->sparse_cap = cap;
+        }
+
+        g->sparse[n] = (struct Sparse_Entry) { rec->time, seg, offset };
+    }
+
+    uint64_t hashes[ARCHIVE_MSG_TERMS];
+    const char *msg = (const char *) (rec + 1) + rec->name_len;
+    int num = tokenize(msg, rec->msg_len, hashes, ARCHIVE_MSG_TERMS);
+    int i;
+
+    for (i = 0; i < num; ++i)
+        add_posting(g, hashes[i], id);
+
+    ++g->num_msgs;
+    return 0;
+}
+
+static int map_segment(struct Segment *s, int fd)
+{
+    if (ftruncate(fd, ARCHIVE_SEGMENT_SIZE) == -1)
+        return -1;
+
+    s->map = mmap(NULL, ARCHIVE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (s->map == MAP_FAILED)
+        return -1;
+
+    s->fd = fd;
+    struct Segment_Header *hdr = segment_header(s);
+    memcpy(hdr->magic, SEGMENT_MAGIC, sizeof(hdr->magic));
+    hdr->used = SEGMENT_DATA_START;
+
+    mem_mapped(MEM_ARCHIVE, ARCHIVE_SEGMENT_SIZE);
+    return 0;
+}
+
+static int add_segment(struct Archive_Group *g)
+{
+    char path[256];
+    segment_path(path, sizeof(path), g->groupnum, g->num_segs);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if (fd == -1)
+        return -1;
+
+    struct Segment *segs = mem_realloc(MEM_ARCHIVE, g->segs, (g->num_segs + 1) * sizeof(struct Segment));
+
+    if (segs == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    g->segs = segs;
+
+    if (map_segment(&g->segs[g->num_segs], fd) == -1) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    ++g->num_segs;
+    return 0;
+}
+
+/* Unmaps the segments of g and frees it. Its segment files are deleted if unlink_segs is set. */
+static void free_group(struct Archive_Group *g, bool unlink_segs)
+{
+    uint32_t i;
+
+    for (i = 0; i < g->num_segs; ++i) {
+        munmap(g->segs[i].map, ARCHIVE_SEGMENT_SIZE);
+        mem_mapped(MEM_ARCHIVE, -ARCHIVE_SEGMENT_SIZE);
+        close(g->segs[i].fd);
+
+        if (unlink_segs) {
+            char path[256];
+            segment_path(path, sizeof(path), g->groupnum, i);
+            unlink(path);
+        }
+    }
+
+    for (i = 0; i < g->terms_cap; ++i)
+        mem_free(g->terms[i].ids);
+
+    mem_free(g->segs);
+    mem_free(g->sparse);
+    mem_free(g->terms);
+    mem_free(g);
+}
+
+static struct Archive_Group *new_group(int groupnum)
+{
+    struct Archive_Group *g = mem_calloc(MEM_ARCHIVE, 1, sizeof(struct Archive_Group));
+
+    if (g)
+        g->groupnum = groupnum;
+
+    return g;
+}
+
+/* Returns the loaded group. The caller must hold the lock or be the writer thread. */
+static struct Archive_Group *find_group(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < Archive.num_groups; ++i) {
+        if (Archive.groups[i]->groupnum == groupnum)
+            return Archive.groups[i];
+    }
+
+    return NULL;
+}
+
+/* Must be called by the writer thread while holding the lock. Frees g and returns -1 on failure. */
+static int insert_group(struct Archive_Group *g)
+{
+    struct Archive_Group **groups = mem_realloc(MEM_ARCHIVE, Archive.groups,
+                                                (Archive.num_groups + 1) * sizeof(*groups));
+
+    if (groups == NULL) {
+        free_group(g, true);
+        return -1;
+    }
+
+    Archive.groups = groups;
+    Archive.groups[Archive.num_groups++] = g;
+    return 0;
+}
+
+/* Must be called by the writer thread while holding the lock */
+static struct Archive_Group *remove_group(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < Archive.num_groups; ++i) {
+        struct Archive_Group *g = Archive.groups[i];
+
+        if (g->groupnum == groupnum) {
+            Archive.groups[i] = Archive.groups[--Archive.num_groups];
+            return g;
+        }
+    }
+
+    return NULL;
+}
+
+/* Must be called by the writer thread while holding the lock */
+static int append(struct Archive_Group *g, const struct Archive_Entry *e)
+{
+    size_t len = RECORD_ALIGN(sizeof(struct Record_Header) + e->name_len + e->msg_len);
+
+    if (g->num_segs == 0 || segment_header(&g->segs[g->num_segs - 1])->used + len > ARCHIVE_SEGMENT_SIZE) {
+        if (add_segment(g) == -1)
+            return -1;
+    }
+
+    uint32_t seg = g->num_segs - 1;
+    struct Segment_Header *hdr = segment_header(&g->segs[seg]);
+    uint32_t offset = hdr->used;
+    struct Record_Header *rec = record_at(g, seg, offset);
+
+    rec->len = len;
+    rec->id = g->num_msgs;
+    rec->time = e->time;
+    rec->name_len = e->name_len;
+    rec->msg_len = e->msg_len;
+    rec->reserved = 0;
+    memcpy(rec + 1, e->name, e->name_len);
+    memcpy((char *) (rec + 1) + e->name_len, e->msg, e->msg_len);
+
+    /* if the record can't be indexed it's left unpublished so ids and records stay in step */
+    if (index_record(g, seg, offset) == -1)
+        return -1;
+
+    /* only publish the record once it's complete */
+    __atomic_store_n(&hdr->used, offset + len, __ATOMIC_RELEASE);
+    g->dirty = true;
+
+    return 0;
+}
+
+static void process_queue(void)
+{
+    uint32_t head = __atomic_load_n(&Archive.head, __ATOMIC_ACQUIRE);
+
+    if (Archive.tail == head)
+        return;
+
+    pthread_mutex_lock(&Archive.lock);
+
+    while (Archive.tail != head) {
+        struct Archive_Entry *e = &Archive.queue[Archive.tail % ARCHIVE_QUEUE_SIZE];
+        struct Archive_Group *g = find_group(e->groupnum);
+
+        /* a new join replaces the archive of an earlier group with the same number */
+        if (e->type == ENTRY_CLOSE || (e->type == ENTRY_OPEN && g)) {
+            g = remove_group(e->groupnum);
+
+            if (g) {
+                pthread_mutex_unlock(&Archive.lock);
+                free_group(g, true);
+                pthread_mutex_lock(&Archive.lock);
+                g = NULL;
+            }
+        }
+
+        /* the open entry may have been dropped from a full queue; start the archive with the first message then */
+        if (e->type != ENTRY_CLOSE && g == NULL) {
+            g = new_group(e->groupnum);
+
+            if (g && insert_group(g) == -1)
+                g = NULL;
+        }
+
+        if (e->type == ENTRY_MESSAGE) {
+            if (g && append(g, e) == 0) {
+                __atomic_fetch_add(&Archive.messages_written, 1, __ATOMIC_RELAXED);
+            } else {
+                __atomic_fetch_add(&Archive.write_failures, 1, __ATOMIC_RELAXED);
+                log_event(LOG_ERROR, EV_ARCHIVE_WRITE_FAILED, -1, e->groupnum, 0, NULL);
+            }
+        }
+
+        __atomic_store_n(&Archive.tail, Archive.tail + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&Archive.lock);
+
+    /* the group list only changes on this thread, so it's safe to walk without the lock */
+    int i;
+
+    for (i = 0; i < Archive.num_groups; ++i) {
+        struct Archive_Group *g = Archive.groups[i];
+
+        if (g->dirty && g->num_segs) {
+            msync(g->segs[g->num_segs - 1].map, ARCHIVE_SEGMENT_SIZE, MS_ASYNC);
+            g->dirty = false;
+        }
+    }
+
+    __atomic_fetch_add(&Archive.batches, 1, __ATOMIC_RELAXED);
+}
+
+static void *writer_thread(void *arg)
+{
+    while (!__atomic_load_n(&Archive.quit, __ATOMIC_ACQUIRE)) {
+        struct timespec ts = { 0, ARCHIVE_FLUSH_INTERVAL * 1000000L };
+        nanosleep(&ts, NULL);
+        process_queue();
+    }
+
+    process_queue();
+    return NULL;
+}
+
+static void on_group_message(Tox *m, const struct Event *ev)
+{
+    archive_add(ev->group_message.groupnum, ev->group_message.name, ev->group_message.name_len,
+                ev->group_message.text, ev->group_message.length, ev->time);
+}
+
+/* Deletes the segments left behind by an earlier run that didn't shut down cleanly */
+static void prune_segments(void)
+{
+    DIR *dir = opendir(ARCHIVE_DIR);
+
+    if (dir == NULL)
+        return;
+
+    struct dirent *d;
+
+    while ((d = readdir(dir))) {
+        size_t len = strlen(d->d_name);
+
+        if (len > 4 && strcmp(d->d_name + len - 4, ".seg") == 0)
+            unlinkat(dirfd(dir), d->d_name, 0);
+    }
+
+    closedir(dir);
+}
+
+int archive_init(void)
+{
+    if (mkdir(ARCHIVE_DIR, S_IRWXU) == -1 && errno != EEXIST)
+        return -1;
+
+    prune_segments();
+
+    if (pthread_create(&Archive.thread, NULL, writer_thread, NULL) != 0)
+        return -1;
+
+    Archive.running = true;
+    event_subscribe(EVENT_GROUP_MESSAGE, "archive", on_group_message);
+    return 0;
+}
+
+void archive_close(void)
+{
+    if (!Archive.running)
+        return;
+
+    __atomic_store_n(&Archive.quit, true, __ATOMIC_RELEASE);
+    pthread_join(Archive.thread, NULL);
+    Archive.running = false;
+
+    int i;
+
+    for (i = 0; i < Archive.num_groups; ++i)
+        free_group(Archive.groups[i], true);
+
+    mem_free(Archive.groups);
+    Archive.groups = NULL;
+    Archive.num_groups = 0;
+}
+
+/* Returns the next free queue entry, or NULL if the queue is full */
+static struct Archive_Entry *queue_entry(void)
+{
+    if (!Archive.running)
+        return NULL;
+
+    if (Archive.head - __atomic_load_n(&Archive.tail, __ATOMIC_ACQUIRE) >= ARCHIVE_QUEUE_SIZE) {
+        ++Archive.messages_dropped;
+        return NULL;
+    }
+
+    return &Archive.queue[Archive.head % ARCHIVE_QUEUE_SIZE];
+}
+
+static void queue_push(void)
+{
+    __atomic_store_n(&Archive.head, Archive.head + 1, __ATOMIC_RELEASE);
+}
+
+void archive_open_group(int groupnum)
+{
+    struct Archive_Entry *e = queue_entry();
+
+    if (e == NULL)
+        return;
+
+    e->type = ENTRY_OPEN;
+    e->groupnum = groupnum;
+    queue_push();
+}
+
+void archive_close_group(int groupnum)
+{
+    struct Archive_Entry *e = queue_entry();
+
+    if (e == NULL)
+        return;
+
+    e->type = ENTRY_CLOSE;
+    e->groupnum = groupnum;
+    queue_push();
+}
+
+void archive_add(int groupnum, const char *name, size_t name_len, const char *msg, size_t msg_len, uint64_t time)
+{
+    struct Archive_Entry *e = queue_entry();
+
+    if (e == NULL)
+        return;
+
+    if (name_len > sizeof(e->name))
+        name_len = sizeof(e->name);
+
+    if (msg_len > sizeof(e->msg))
+        msg_len = sizeof(e->msg);
+
+    e->type = ENTRY_MESSAGE;
+    e->groupnum = groupnum;
+    e->time = time;
+    e->name_len = name_len;
+    e->msg_len = msg_len;
+    memcpy(e->name, name, name_len);
+    memcpy(e->msg, msg, msg_len);
+    queue_push();
+
+    ++Archive.messages_queued;
+}
+
+/* Formats the record of message id as a single line and passes it to cb */
+static void emit(const struct Archive_Group *g, uint32_t id, archive_line_cb *cb, void *data)
+{
+    uint32_t seg, offset;
+    locate(g, id, &seg, &offset);
+
+    const struct Record_Header *rec = record_at(g, seg, offset);
+    const char *name = (const char *) (rec + 1);
+    char stamp[32];
+    char line[TOX_MAX_MESSAGE_LENGTH];
+    time_t t = rec->time;
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &tm);
+    int len = snprintf(line, sizeof(line), "[%s] %.*s: %.*s", stamp, rec->name_len, name, rec->msg_len,
+                       name + rec->name_len);
+
+    if (len >= (int) sizeof(line))
+        len = sizeof(line) - 1;
+
+    /* keep one message per line */
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        if (line[i] == '\n' || line[i] == '\r')
+            line[i] = ' ';
+    }
+
+    cb(line, data);
+}
+
+static void query_done(uint64_t start)
+{
+    ++Archive.queries;
+    Archive.query_ns += clock_ns() - start;
+}
+
+/* Returns the id of the first message sent at or after t */
+static uint32_t find_time(const struct Archive_Group *g, uint64_t t)
+{
+    uint32_t num_sparse = (g->num_msgs + ARCHIVE_INDEX_STRIDE - 1) / ARCHIVE_INDEX_STRIDE;
+    uint32_t lo = 0, hi = num_sparse;
+
+    /* find the last sparse entry before t, then scan forward from it */
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (g->sparse[mid].time < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return 0;
+
+    uint32_t id = (lo - 1) * ARCHIVE_INDEX_STRIDE;
+    uint32_t seg = g->sparse[lo - 1].seg;
+    uint32_t offset = g->sparse[lo - 1].offset;
+
+    while (id < g->num_msgs && record_at(g, seg, offset)->time < t) {
+        if (++id < g->num_msgs)
+            next_record(g, &seg, &offset);
+    }
+
+    return id;
+}
+
+int archive_history(int groupnum, uint32_t count, uint64_t since, archive_line_cb *cb, void *data)
+{
+    uint64_t start = clock_ns();
+    pthread_mutex_lock(&Archive.lock);
+
+    struct Archive_Group *g = find_group(groupnum);
+
+    if (g == NULL) {
+        pthread_mutex_unlock(&Archive.lock);
+        return -1;
+    }
+
+    uint32_t first;
+
+    if (since) {
+        first = find_time(g, since);
+    } else {
+        first = count < g->num_msgs ? g->num_msgs - count : 0;
+    }
+
+    uint32_t n = 0;
+    uint32_t id;
+
+    for (id = first; id < g->num_msgs && n < count; ++id, ++n)
+        emit(g, id, cb, data);
+
+    pthread_mutex_unlock(&Archive.lock);
+    query_done(start);
+    return n;
+}
+
+/* Returns the index of the last element of ids[0..len) that is <= id, or -1 if there is none */
+static int64_t search_ids(const uint32_t *ids, uint32_t len, uint32_t id)
+{
+    uint32_t lo = 0, hi = len;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (ids[mid] <= id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (int64_t) lo - 1;
+}
+
+int archive_search(int groupnum, const char *terms, archive_line_cb *cb, void *data)
+{
+    uint64_t start = clock_ns();
+    uint64_t hashes[ARCHIVE_MAX_TERMS];
+    int num_terms = tokenize(terms, strlen(terms), hashes, ARCHIVE_MAX_TERMS);
+
+    pthread_mutex_lock(&Archive.lock);
+
+    struct Archive_Group *g = find_group(groupnum);
+
+    if (g == NULL) {
+        pthread_mutex_unlock(&Archive.lock);
+        return -1;
+    }
+
+    const struct Posting *lists[ARCHIVE_MAX_TERMS];
+    int i, j;
+
+    for (i = 0; i < num_terms; ++i) {
+        lists[i] = find_posting(g, hashes[i]);
+
+        if (lists[i] == NULL) {
+            pthread_mutex_unlock(&Archive.lock);
+            query_done(start);
+            return 0;
+        }
+
+        /* keep the shortest list first; it drives the intersection */
+        if (lists[i]->len < lists[0]->len) {
+            const struct Posting *tmp = lists[0];
+            lists[0] = lists[i];
+            lists[i] = tmp;
+        }
+    }
+
+    /* walk the shortest list from the newest message back, checking the others with binary searches over
+       a shrinking range */
+    uint32_t results[ARCHIVE_MAX_RESULTS];
+    uint32_t bounds[ARCHIVE_MAX_TERMS];
+    int num_results = 0;
+    int64_t k;
+
+    for (i = 1; i < num_terms; ++i)
+        bounds[i] = lists[i]->len;
+
+    for (k = (int64_t) (num_terms ? lists[0]->len : 0) - 1; k >= 0 && num_results < ARCHIVE_MAX_RESULTS; --k) {
+        uint32_t id = lists[0]->ids[k];
+
+        for (j = 1; j < num_terms; ++j) {
+            int64_t pos = search_ids(lists[j]->ids, bounds[j], id);
+
+            if (pos < 0) {
+                k = 0;    /* no older match is possible */
+                break;
+            }
+
+            bounds[j] = pos + 1;
+
+            if (lists[j]->ids[pos] != id)
+                break;
+        }
+
+        if (j == num_terms)
+            results[num_results++] = id;
+    }
+
+    for (i = num_results - 1; i >= 0; --i)
+        emit(g, results[i], cb, data);
+
+    pthread_mutex_unlock(&Archive.lock);
+    query_done(start);
+    return num_results;
+}
+
+void archive_print_metrics(FILE *fp)
+{
+    uint64_t messages = 0, terms = 0;
+    int groups, i;
+
+    pthread_mutex_lock(&Archive.lock);
+    groups = Archive.num_groups;
+
+    for (i = 0; i < Archive.num_groups; ++i) {
+        messages += Archive.groups[i]->num_msgs;
+        terms += Archive.groups[i]->num_terms;
+    }
+
+    pthread_mutex_unlock(&Archive.lock);
+
+    fprintf(fp, "archive_groups %d\n", groups);
+    fprintf(fp, "archive_messages %" PRIu64 "\n", messages);
+    fprintf(fp, "archive_terms %" PRIu64 "\n", terms);
+    fprintf(fp, "archive_messages_queued %" PRIu64 "\n", Archive.messages_queued);
+    fprintf(fp, "archive_messages_dropped %" PRIu64 "\n", Archive.messages_dropped);
+    fprintf(fp, "archive_messages_written %" PRIu64 "\n",
+            __atomic_load_n(&Archive.messages_written, __ATOMIC_RELAXED));
+    fprintf(fp, "archive_write_failures %" PRIu64 "\n", __atomic_load_n(&Archive.write_failures, __ATOMIC_RELAXED));
+    fprintf(fp, "archive_batches %" PRIu64 "\n", __atomic_load_n(&Archive.batches, __ATOMIC_RELAXED));
+    fprintf(fp, "archive_queries %" PRIu64 "\n", Archive.queries);
+    fprintf(fp, "archive_query_seconds %.6f\n", Archive.query_ns / 1e9);
+}
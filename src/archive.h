@@ -0,0 +1,68 @@
+/*  archive.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARCHIVE_DIR "archive"
+#define ARCHIVE_SEGMENT_SIZE (16 * 1024 * 1024)    /* size of each mapped segment file */
+#define ARCHIVE_INDEX_STRIDE 64                    /* messages between entries of the sparse index */
+#define ARCHIVE_QUEUE_SIZE 1024                    /* messages waiting for the writer; must be a power of 2 */
+#define ARCHIVE_FLUSH_INTERVAL 200                 /* ms between writer batches */
+#define ARCHIVE_MAX_RESULTS 20                     /* most lines a query returns */
+#define ARCHIVE_MAX_TERMS 8                        /* most terms in a search */
+
+typedef void archive_line_cb(const char *line, void *data);
+
+/* Starts the writer thread and subscribes to group messages. Returns 0 on success, -1 on failure. */
+int archive_init(void);
+
+/* Writes out queued messages, stops the writer thread and deletes the archives. */
+void archive_close(void);
+
+/* Starts a new archive for groupnum in the background so it can be appended to and queried. Call when a
+   group is joined; the archive of an earlier group with the same number is deleted. */
+void archive_open_group(int groupnum);
+
+/* Deletes the archive of groupnum once queued messages have been written. */
+void archive_close_group(int groupnum);
+
+/* Queues a message for archiving. Never blocks; the message is dropped if the queue is full. */
+void archive_add(int groupnum, const char *name, size_t name_len, const char *msg, size_t msg_len, uint64_t time);
+
+/* Calls cb with the last count messages of groupnum, oldest first. If since is non-zero, calls it with
+   up to count messages starting at that time instead. Returns the number of messages, or -1 if the archive
+   of groupnum isn't loaded. */
+int archive_history(int groupnum, uint32_t count, uint64_t since, archive_line_cb *cb, void *data);
+
+/* Calls cb with the most recent messages of groupnum containing all of the space separated words in terms,
+   oldest first. Returns the number of messages, or -1 if the archive of groupnum isn't loaded. */
+int archive_search(int groupnum, const char *terms, archive_line_cb *cb, void *data);
+
+/* Writes archive metrics to fp */
+void archive_print_metrics(FILE *fp);
+
+#endif /* ARCHIVE_H */
@@ -0,0 +1,95 @@
+/*  arena.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "arena.h"
+#include "mem.h"
+
+#define ARENA_ALIGN 16
+
+struct Arena_Overflow {
+    struct Arena_Overflow *next;
+    char data[];
+};
+
+static struct {
+    char block[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+    size_t used;
+    size_t high_water;
+    struct Arena_Overflow *overflow;
+    uint64_t num_allocs;
+    uint64_t heap_allocs;
+} Arena;
+
+void *arena_alloc(size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    ++Arena.num_allocs;
+
+    if (size <= ARENA_SIZE - Arena.used) {
+        void *p = Arena.block + Arena.used;
+        Arena.used += size;
+
+        if (Arena.used > Arena.high_water)
+            Arena.high_water = Arena.used;
+
+        return p;
+    }
+
+    struct Arena_Overflow *o = mem_alloc(MEM_COMMANDS, sizeof(struct Arena_Overflow) + size);
+
+    if (o == NULL)
+        exit(EXIT_FAILURE);
+
+    o->next = Arena.overflow;
+    Arena.overflow = o;
+    ++Arena.heap_allocs;
+
+    return o->data;
+}
+
+void arena_reset(void)
+{
+    while (Arena.overflow) {
+        struct Arena_Overflow *next = Arena.overflow->next;
+        mem_free(Arena.overflow);
+        Arena.overflow = next;
+    }
+
+    Arena.used = 0;
+}
+
+uint64_t arena_heap_allocs(void)
+{
+    return Arena.heap_allocs;
+}
+
+void arena_print_metrics(FILE *fp)
+{
+    fprintf(fp, "arena_allocs %"PRIu64"\n", Arena.num_allocs);
+    fprintf(fp, "arena_heap_allocs %"PRIu64"\n", Arena.heap_allocs);
+    fprintf(fp, "arena_high_water_bytes %zu\n", Arena.high_water);
+}
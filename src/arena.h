@@ -0,0 +1,46 @@
+/*  arena.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_SIZE (64 * 1024)
+
+/* Returns a pointer to size bytes of scratch memory that stays valid until the next call to arena_reset().
+   Allocations are served from a static block; if the block is exhausted we fall back to the heap.
+   Never returns NULL. */
+void *arena_alloc(size_t size);
+
+/* Releases all memory handed out by arena_alloc(). */
+void arena_reset(void);
+
+/* Returns the number of allocations that could not be served from the static block. */
+uint64_t arena_heap_allocs(void);
+
+/* Writes arena metrics to fp */
+void arena_print_metrics(FILE *fp);
+
+#endif /* ARENA_H */
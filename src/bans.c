@@ -0,0 +1,378 @@
+/*  bans.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+
+#include "misc.h"
+#include "log.h"
+#include "friends.h"
+#include "timers.h"
+#include "mem.h"
+#include "bans.h"
+
+struct Ban_List {
+    uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE];    /* sorted */
+    uint32_t num_keys;
+    uint32_t cap;
+    uint64_t *bloom;
+    uint32_t bloom_mask;                     /* number of bits - 1 */
+};
+
+static struct {
+    const char *path;
+    struct Ban_List *list;
+    time_t mtime;
+    off_t size;
+    uint32_t generation;    /* bumped on every reload so cached per-friend answers go stale; never 0 */
+    struct Timer reload_timer;
+
+    uint64_t reloads;
+    uint64_t checks;
+    uint64_t bloom_passes;          /* checks that needed the exact lookup */
+    uint64_t requests_rejected;
+    uint64_t messages_dropped;
+} Bans = {
+    .generation = 1,
+};
+
+/* Public keys are uniformly random, so their own bytes serve as the Bloom filter hashes. A key crafted to
+   collide only costs an exact lookup. */
+static uint32_t bloom_hash(const uint8_t *key, int i)
+{
+    uint32_t h;
+    memcpy(&h, key + i * sizeof(h), sizeof(h));
+    return h;
+}
+
+static void bloom_add(struct Ban_List *l, const uint8_t *key)
+{
+    int i;
+
+    for (i = 0; i < BANS_BLOOM_HASHES; ++i) {
+        uint32_t bit = bloom_hash(key, i) & l->bloom_mask;
+        l->bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static bool bloom_test(const struct Ban_List *l, const uint8_t *key)
+{
+    int i;
+
+    for (i = 0; i < BANS_BLOOM_HASHES; ++i) {
+        uint32_t bit = bloom_hash(key, i) & l->bloom_mask;
+
+        if (!(l->bloom[bit / 64] & (1ULL << (bit % 64))))
+            return false;
+    }
+
+    return true;
+}
+
+static int key_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, TOX_PUBLIC_KEY_SIZE);
+}
+
+static void free_list(struct Ban_List *l)
+{
+    if (l == NULL)
+        return;
+
+    mem_free(l->keys);
+    mem_free(l->bloom);
+    mem_free(l);
+}
+
+int ban_parse_key(const char *s, uint8_t *key)
+{
+    size_t len = 0;
+
+    while (isxdigit((unsigned char) s[len]))
+        ++len;
+
+    if (len != TOX_PUBLIC_KEY_SIZE * 2 && len != TOX_ADDRESS_SIZE * 2)
+        return -1;
+
+    return hex_string_to_bin(s, TOX_PUBLIC_KEY_SIZE * 2, (char *) key, TOX_PUBLIC_KEY_SIZE);
+}
+
+static int add_key(struct Ban_List *l, const uint8_t *key)
+{
+    if (l->num_keys == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 64;
+        uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE] = mem_realloc(MEM_BANS, l->keys, (size_t) cap * TOX_PUBLIC_KEY_SIZE);
+
+        if (keys == NULL)
+            return -1;
+
+        l->keys = keys;
+        l->cap = cap;
+    }
+
+    memcpy(l->keys[l->num_keys++], key, TOX_PUBLIC_KEY_SIZE);
+    return 0;
+}
+
+/* Reads the ban list at path, sorts it and builds its Bloom filter */
+static struct Ban_List *read_list(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return NULL;
+
+    struct Ban_List *l = mem_calloc(MEM_BANS, 1, sizeof(struct Ban_List));
+
+    if (l == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    char line[256];
+
+    while (fgets(line, sizeof(line), fp)) {
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+        if (line[0] == '#' || ban_parse_key(line, key) == -1)
+            continue;
+
+        if (add_key(l, key) == -1) {
+            free_list(l);
+            fclose(fp);
+            return NULL;
+        }
+    }
+
+    fclose(fp);
+
+    if (l->num_keys)
+        qsort(l->keys, l->num_keys, TOX_PUBLIC_KEY_SIZE, key_cmp);
+
+    uint64_t bits = BANS_BLOOM_MIN_BITS;
+
+    while (bits < (uint64_t) l->num_keys * BANS_BLOOM_BITS_PER_KEY && bits < 1ULL << 31)
+        bits *= 2;
+
+    l->bloom = mem_calloc(MEM_BANS, bits / 64, sizeof(uint64_t));
+
+    if (l->bloom == NULL) {
+        free_list(l);
+        return NULL;
+    }
+
+    l->bloom_mask = bits - 1;
+    uint32_t i;
+
+    for (i = 0; i < l->num_keys; ++i)
+        bloom_add(l, l->keys[i]);
+
+    return l;
+}
+
+static void load(bool force)
+{
+    struct stat st;
+
+    if (stat(Bans.path, &st) == -1) {
+        /* no ban list, nobody banned */
+        if (Bans.list) {
+            free_list(Bans.list);
+            Bans.list = NULL;
+            ++Bans.generation;
+            log_event(LOG_INFO, EV_BANLIST_LOADED, -1, -1, 0, Bans.path);
+        }
+
+        Bans.mtime = 0;
+        return;
+    }
+
+    if (!force && st.st_mtime == Bans.mtime && st.st_size == Bans.size)
+        return;
+
+    Bans.mtime = st.st_mtime;
+    Bans.size = st.st_size;
+
+    struct Ban_List *l = read_list(Bans.path);
+
+    if (l == NULL) {
+        log_event(LOG_ERROR, EV_BANLIST_FAILED, -1, -1, 0, Bans.path);
+        return;
+    }
+
+    free_list(Bans.list);
+    Bans.list = l;
+    ++Bans.reloads;
+
+    if (++Bans.generation == 0)
+        Bans.generation = 1;
+
+    log_event(LOG_INFO, EV_BANLIST_LOADED, -1, -1, l->num_keys, Bans.path);
+}
+
+static void reload(Tox *m, void *data)
+{
+    load(false);
+    timer_set(&Bans.reload_timer, BANS_RELOAD_INTERVAL * 1000);
+}
+
+void bans_init(const char *path)
+{
+    Bans.path = path;
+    load(true);
+    timer_init(&Bans.reload_timer, "banlist_reload", reload, NULL);
+    timer_set(&Bans.reload_timer, BANS_RELOAD_INTERVAL * 1000);
+}
+
+static bool is_banned(const uint8_t *public_key)
+{
+    const struct Ban_List *l = Bans.list;
+
+    ++Bans.checks;
+
+    if (l == NULL || l->num_keys == 0 || !bloom_test(l, public_key))
+        return false;
+
+    ++Bans.bloom_passes;
+    return bsearch(public_key, l->keys, l->num_keys, TOX_PUBLIC_KEY_SIZE, key_cmp) != NULL;
+}
+
+bool ban_check(const uint8_t *public_key)
+{
+    if (!is_banned(public_key))
+        return false;
+
+    ++Bans.requests_rejected;
+    return true;
+}
+
+bool ban_check_friend(Tox *m, uint32_t friendnum)
+{
+    struct Friend_Info *f = friend_info(friendnum);
+
+    if (f == NULL)
+        return false;
+
+    if (f->ban_generation != Bans.generation) {
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+        if (!tox_friend_get_public_key(m, friendnum, key, NULL))
+            return false;
+
+        f->banned = is_banned(key);
+        f->ban_generation = Bans.generation;
+    }
+
+    if (f->banned)
+        ++Bans.messages_dropped;
+
+    return f->banned;
+}
+
+int ban_add(const uint8_t *public_key)
+{
+    if (is_banned(public_key))
+        return 1;
+
+    FILE *fp = fopen(Bans.path, "a");
+
+    if (fp == NULL)
+        return -1;
+
+    int i;
+
+    for (i = 0; i < TOX_PUBLIC_KEY_SIZE; ++i)
+        fprintf(fp, "%02X", public_key[i]);
+
+    fputc('\n', fp);
+
+    if (fclose(fp) != 0)
+        return -1;
+
+    load(true);
+    return 0;
+}
+
+int ban_remove(const uint8_t *public_key)
+{
+    if (!is_banned(public_key))
+        return 1;
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", Bans.path);
+
+    FILE *in = fopen(Bans.path, "r");
+
+    if (in == NULL)
+        return -1;
+
+    FILE *out = fopen(tmp_path, "w");
+
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    char line[256];
+
+    /* copy everything but the lines naming the key, keeping comments */
+    while (fgets(line, sizeof(line), in)) {
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+        if (line[0] != '#' && ban_parse_key(line, key) == 0 && memcmp(key, public_key, TOX_PUBLIC_KEY_SIZE) == 0)
+            continue;
+
+        fputs(line, out);
+    }
+
+    fclose(in);
+
+    if (fclose(out) != 0 || rename(tmp_path, Bans.path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    load(true);
+    return 0;
+}
+
+void bans_print_metrics(FILE *fp)
+{
+    const struct Ban_List *l = Bans.list;
+
+    fprintf(fp, "bans_keys %u\n", l ? l->num_keys : 0);
+    fprintf(fp, "bans_bloom_bits %u\n", l ? l->bloom_mask + 1 : 0);
+    fprintf(fp, "bans_reloads %"PRIu64"\n", Bans.reloads);
+    fprintf(fp, "bans_checks %"PRIu64"\n", Bans.checks);
+    fprintf(fp, "bans_bloom_passes %"PRIu64"\n", Bans.bloom_passes);
+    fprintf(fp, "bans_requests_rejected %"PRIu64"\n", Bans.requests_rejected);
+    fprintf(fp, "bans_messages_dropped %"PRIu64"\n", Bans.messages_dropped);
+}
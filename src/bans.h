@@ -0,0 +1,62 @@
+/*  bans.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BANS_H
+#define BANS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define BANS_RELOAD_INTERVAL 5       /* seconds between checks for a changed ban list */
+#define BANS_BLOOM_BITS_PER_KEY 16   /* about 0.24% false positives with 4 hashes */
+#define BANS_BLOOM_HASHES 4
+#define BANS_BLOOM_MIN_BITS 4096
+
+/* Loads the ban list at path. Each line holds a public key or Tox ID in hex, optionally followed by a
+   comment; lines starting with # are ignored. The file is reloaded within BANS_RELOAD_INTERVAL seconds
+   whenever it changes. */
+void bans_init(const char *path);
+
+/* Returns true if public_key is banned. Unbanned keys are almost always answered by the Bloom filter alone. */
+bool ban_check(const uint8_t *public_key);
+
+/* Returns true if friendnum's key is banned. The answer is cached per friend until the ban list changes,
+   so this is a single comparison for most calls. */
+bool ban_check_friend(Tox *m, uint32_t friendnum);
+
+/* Parses a public key or Tox ID in hex into key. Returns 0 on success, -1 if s is neither. */
+int ban_parse_key(const char *s, uint8_t *key);
+
+/* Adds public_key to the ban list file and reloads it. Returns 0 on success, 1 if the key was already
+   banned, -1 if the file couldn't be written. */
+int ban_add(const uint8_t *public_key);
+
+/* Removes public_key from the ban list file and reloads it. Returns 0 on success, 1 if the key wasn't
+   banned, -1 if the file couldn't be rewritten. */
+int ban_remove(const uint8_t *public_key);
+
+/* Writes ban list metrics to fp */
+void bans_print_metrics(FILE *fp);
+
+#endif /* BANS_H */
@@ -0,0 +1,340 @@
+/*  bridges.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "misc.h"
+#include "events.h"
+#include "timers.h"
+#include "bridges.h"
+#include "spam.h"
+
+struct Bridge {
+    bool active;
+    uint32_t generation;    /* bumped whenever the slot is reused so queued messages of an old bridge are dropped */
+    int groups[2];
+    uint32_t tokens;      /* in thousandths of a message */
+    uint64_t refilled;    /* timer_now() when tokens were last topped up */
+
+    uint64_t mirrored;
+    uint64_t bytes;
+    uint64_t dropped_rate;
+    uint64_t dropped_queue;
+    uint64_t dropped_send;
+    uint64_t dropped_spam;
+    uint64_t echoes;
+};
+
+struct Bridge_Send {
+    int bridge;
+    uint32_t generation;    /* of the bridge when the message was queued */
+    int groupnum;
+    uint16_t length;
+    char text[TOX_MAX_MESSAGE_LENGTH];
+};
+
+static struct {
+    struct Bridge bridges[BRIDGE_MAX];
+
+    struct Bridge_Send queue[BRIDGE_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t count;
+
+    uint32_t recent_sent[BRIDGE_RECENT_SENT];    /* hashes of the messages we mirrored most recently */
+    uint32_t recent_pos;
+
+    uint64_t batches;
+} Bridges;
+
+/* FNV-1a */
+static uint32_t hash_text(const char *text, size_t length)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; ++i) {
+        h ^= (uint8_t) text[i];
+        h *= 16777619;
+    }
+
+    return h;
+}
+
+static bool recently_sent(uint32_t hash)
+{
+    int i;
+
+    for (i = 0; i < BRIDGE_RECENT_SENT; ++i) {
+        if (Bridges.recent_sent[i] == hash)
+            return true;
+    }
+
+    return false;
+}
+
+static int find(int a, int b)
+{
+    int i;
+
+    for (i = 0; i < BRIDGE_MAX; ++i) {
+        const struct Bridge *br = &Bridges.bridges[i];
+
+        if (br->active && ((br->groups[0] == a && br->groups[1] == b) || (br->groups[0] == b && br->groups[1] == a)))
+            return i;
+    }
+
+    return -1;
+}
+
+/* Takes a token from br if it has one */
+static bool take_token(struct Bridge *br, uint64_t now)
+{
+    uint64_t refill = (now - br->refilled) * BRIDGE_RATE;
+
+    br->tokens = MIN(br->tokens + refill, BRIDGE_BURST * 1000);
+    br->refilled = now;
+
+    if (br->tokens < 1000)
+        return false;
+
+    br->tokens -= 1000;
+    return true;
+}
+
+static void mirror(int bridge, int groupnum, const struct Event *ev, uint64_t now)
+{
+    struct Bridge *br = &Bridges.bridges[bridge];
+
+    /* a message that can't be queued mustn't use up the bridge's allowance */
+    if (Bridges.count == BRIDGE_QUEUE_SIZE) {
+        ++br->dropped_queue;
+        return;
+    }
+
+    if (!take_token(br, now)) {
+        ++br->dropped_rate;
+        return;
+    }
+
+    struct Bridge_Send *s = &Bridges.queue[(Bridges.head + Bridges.count) % BRIDGE_QUEUE_SIZE];
+    int name_len = ev->group_message.name_len;
+    const char *name = ev->group_message.name;
+
+    if (name_len == 0) {
+        name = "Unknown";
+        name_len = strlen(name);
+    }
+
+    int len = snprintf(s->text, sizeof(s->text), "<%.*s> %.*s", name_len, name, (int) ev->group_message.length,
+                       ev->group_message.text);
+
+    s->bridge = bridge;
+    s->generation = br->generation;
+    s->groupnum = groupnum;
+    s->length = MIN(len, (int) sizeof(s->text) - 1);
+    ++Bridges.count;
+}
+
+static void on_group_message(Tox *m, const struct Event *ev)
+{
+    int groupnum = ev->group_message.groupnum;
+
+    /* our own messages include the ones we mirrored into this group */
+    if (tox_group_peernumber_is_ours(m, groupnum, ev->group_message.peernum))
+        return;
+
+    int i;
+    bool echo = recently_sent(hash_text(ev->group_message.text, ev->group_message.length));
+    bool spam = spam_verdict() >= SPAM_WARN;
+    uint64_t now = timer_now();
+
+    for (i = 0; i < BRIDGE_MAX; ++i) {
+        struct Bridge *br = &Bridges.bridges[i];
+
+        if (!br->active || (br->groups[0] != groupnum && br->groups[1] != groupnum))
+            continue;
+
+        /* another relay sent one of our mirrored messages back verbatim */
+        if (echo) {
+            ++br->echoes;
+            continue;
+        }
+
+        /* a blocklisted message shouldn't be multiplied into every linked group */
+        if (spam) {
+            ++br->dropped_spam;
+            continue;
+        }
+
+        mirror(i, br->groups[br->groups[0] == groupnum ? 1 : 0], ev, now);
+    }
+}
+
+void bridges_init(void)
+{
+    /* subscribed after the spam filter so its verdict on each message is known */
+    event_subscribe(EVENT_GROUP_MESSAGE, "bridges", on_group_message);
+}
+
+int bridge_add(int a, int b)
+{
+    if (a == b || group_index(a) == -1 || group_index(b) == -1)
+        return -1;
+
+    if (find(a, b) != -1)
+        return -2;
+
+    int i;
+
+    for (i = 0; i < BRIDGE_MAX; ++i) {
+        struct Bridge *br = &Bridges.bridges[i];
+
+        if (br->active)
+            continue;
+
+        uint32_t generation = br->generation + 1;
+
+        memset(br, 0, sizeof(struct Bridge));
+        br->active = true;
+        br->generation = generation;
+        br->groups[0] = a;
+        br->groups[1] = b;
+        br->tokens = BRIDGE_BURST * 1000;
+        br->refilled = timer_now();
+        return 0;
+    }
+
+    return -3;
+}
+
+int bridge_remove(int a, int b)
+{
+    int i = find(a, b);
+
+    if (i == -1)
+        return -1;
+
+    /* queued messages of a removed bridge are discarded when their turn comes */
+    Bridges.bridges[i].active = false;
+    return 0;
+}
+
+void bridges_remove_group(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < BRIDGE_MAX; ++i) {
+        struct Bridge *br = &Bridges.bridges[i];
+
+        if (br->groups[0] == groupnum || br->groups[1] == groupnum)
+            br->active = false;
+    }
+}
+
+int bridges_format(char *buf, size_t size)
+{
+    int i, num = 0;
+    size_t len = 0;
+
+    buf[0] = '\0';
+
+    for (i = 0; i < BRIDGE_MAX && len < size; ++i) {
+        const struct Bridge *br = &Bridges.bridges[i];
+
+        if (!br->active)
+            continue;
+
+        len += snprintf(buf + len, size - len, "%sGroups %d <-> %d: %"PRIu64" mirrored, %"PRIu64" dropped",
+                        num ? "\n" : "", br->groups[0], br->groups[1], br->mirrored,
+                        br->dropped_rate + br->dropped_queue + br->dropped_send + br->dropped_spam);
+        ++num;
+    }
+
+    return num;
+}
+
+void bridges_do(Tox *m)
+{
+    if (Bridges.count == 0)
+        return;
+
+    int sent = 0;
+
+    while (Bridges.count && sent < BRIDGE_BATCH_SIZE) {
+        struct Bridge_Send *s = &Bridges.queue[Bridges.head];
+        struct Bridge *br = &Bridges.bridges[s->bridge];
+
+        Bridges.head = (Bridges.head + 1) % BRIDGE_QUEUE_SIZE;
+        --Bridges.count;
+
+        if (!br->active || br->generation != s->generation)
+            continue;
+
+        if (tox_group_message_send(m, s->groupnum, (uint8_t *) s->text, s->length) == -1) {
+            ++br->dropped_send;
+            continue;
+        }
+
+        Bridges.recent_sent[Bridges.recent_pos] = hash_text(s->text, s->length);
+        Bridges.recent_pos = (Bridges.recent_pos + 1) % BRIDGE_RECENT_SENT;
+
+        ++br->mirrored;
+        br->bytes += s->length;
+        ++sent;
+    }
+
+    ++Bridges.batches;
+}
+
+void bridges_print_metrics(FILE *fp)
+{
+    int i;
+
+    for (i = 0; i < BRIDGE_MAX; ++i) {
+        const struct Bridge *br = &Bridges.bridges[i];
+
+        if (!br->active)
+            continue;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%d-%d", br->groups[0], br->groups[1]);
+
+        fprintf(fp, "bridge_mirrored{bridge=\"%s\"} %"PRIu64"\n", name, br->mirrored);
+        fprintf(fp, "bridge_bytes{bridge=\"%s\"} %"PRIu64"\n", name, br->bytes);
+        fprintf(fp, "bridge_dropped{bridge=\"%s\",reason=\"rate\"} %"PRIu64"\n", name, br->dropped_rate);
+        fprintf(fp, "bridge_dropped{bridge=\"%s\",reason=\"queue\"} %"PRIu64"\n", name, br->dropped_queue);
+        fprintf(fp, "bridge_dropped{bridge=\"%s\",reason=\"send\"} %"PRIu64"\n", name, br->dropped_send);
+        fprintf(fp, "bridge_dropped{bridge=\"%s\",reason=\"spam\"} %"PRIu64"\n", name, br->dropped_spam);
+        fprintf(fp, "bridge_echoes{bridge=\"%s\"} %"PRIu64"\n", name, br->echoes);
+    }
+
+    fprintf(fp, "bridge_queue_pending %u\n", Bridges.count);
+    fprintf(fp, "bridge_batches %"PRIu64"\n", Bridges.batches);
+}
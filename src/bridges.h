@@ -0,0 +1,65 @@
+/*  bridges.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BRIDGES_H
+#define BRIDGES_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+/* A bridge links two groups: messages sent by peers in either group are mirrored into the other, prefixed
+   with the sender's name. Mirrored messages are queued and sent in batches from the main loop. Messages we
+   sent ourselves are never mirrored, so chains and cycles of bridges can't loop. */
+
+#define BRIDGE_MAX 16
+#define BRIDGE_QUEUE_SIZE 128     /* mirrored messages waiting to be sent, over all bridges */
+#define BRIDGE_BATCH_SIZE 16      /* max number of messages sent per main loop iteration */
+#define BRIDGE_RATE 5             /* messages per second a bridge mirrors in the long run */
+#define BRIDGE_BURST 20           /* messages a bridge may mirror at once after being idle */
+#define BRIDGE_RECENT_SENT 64     /* mirrored messages remembered to detect echoes by other relays */
+
+/* Subscribes to group messages. Call after spam_init() so messages the blocklist warns about or reports
+   aren't mirrored. */
+void bridges_init(void);
+
+/* Links groups a and b. Returns 0 on success, -1 if either group doesn't exist or a == b, -2 if they are
+   already linked, -3 if there are already BRIDGE_MAX bridges. */
+int bridge_add(int a, int b);
+
+/* Unlinks groups a and b. Returns 0 on success, -1 if they aren't linked. */
+int bridge_remove(int a, int b);
+
+/* Removes every bridge to groupnum. Call when leaving a group. */
+void bridges_remove_group(int groupnum);
+
+/* Writes a one line summary of each bridge into buf, separated by newlines. Returns the number of bridges. */
+int bridges_format(char *buf, size_t size);
+
+/* Sends up to BRIDGE_BATCH_SIZE queued messages. Should be called once per main loop iteration. */
+void bridges_do(Tox *m);
+
+/* Writes per-bridge throughput and drop counts to fp */
+void bridges_print_metrics(FILE *fp);
+
+#endif /* BRIDGES_H */
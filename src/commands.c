@@ -28,6 +28,7 @@
 #include <stdbool.h>
 #include <time.h>
 #include <inttypes.h>
+#include <assert.h>
 
 #include <tox/tox.h>
 #include <tox/toxav.h>
@@ -35,6 +36,20 @@
 #include "toxbot.h"
 #include "misc.h"
 #include "groupchats.h"
+#include "arena.h"
+#include "log.h"
+#include "commands.h"
+#include "admin.h"
+#include "watchdog.h"
+#include "playback.h"
+#include "recorder.h"
+#include "archive.h"
+#include "friends.h"
+#include "mem.h"
+#include "timers.h"
+#include "bans.h"
+#include "pools.h"
+#include "bridges.h"
 
 #define MAX_COMMAND_LENGTH TOX_MAX_MESSAGE_LENGTH
 #define MAX_NUM_ARGS 4
@@ -43,8 +58,92 @@ extern char *DATA_FILE;
 extern char *MASTERLIST_FILE;
 extern struct Tox_Bot Tox_Bot;
 
+#define MAX_BATCH_COMMANDS 16
+#define REPLY_BUF_SIZE (MAX_BATCH_COMMANDS * MAX_COMMAND_LENGTH)
+
+/* State of the batch of commands currently being executed. Replies are collected and sent together
+   once the whole batch has run, and the sender's master status is looked up at most once. */
+static struct {
+    bool active;
+    int friendnum;
+    int is_master;    /* -1 if not looked up yet */
+    const char *cmd;  /* text of the command being executed */
+    char reply[REPLY_BUF_SIZE];
+    size_t reply_len;
+} Batch;
+
+static void deliver_msg(Tox *m, int friendnum, const char *msg, size_t len)
+{
+    if (friendnum == ADMIN_FRIENDNUM) {
+        admin_reply(msg);
+        return;
+    }
+
+    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, len, NULL);
+}
+
+/* Sends the collected replies, split into as few messages as possible at line boundaries */
+static void flush_reply(Tox *m)
+{
+    size_t pos = 0;
+
+    while (pos < Batch.reply_len) {
+        size_t len = Batch.reply_len - pos;
+
+        if (len > TOX_MAX_MESSAGE_LENGTH) {
+            len = TOX_MAX_MESSAGE_LENGTH;
+
+            while (len > 0 && Batch.reply[pos + len - 1] != '\n')
+                --len;
+
+            if (len == 0)
+                len = TOX_MAX_MESSAGE_LENGTH;
+        }
+
+        char chunk[TOX_MAX_MESSAGE_LENGTH + 1];
+        size_t chunk_len = len;
+
+        /* don't send the newline that separated this chunk from the next */
+        if (chunk_len > 1 && Batch.reply[pos + chunk_len - 1] == '\n')
+            --chunk_len;
+
+        memcpy(chunk, Batch.reply + pos, chunk_len);
+        chunk[chunk_len] = '\0';
+        deliver_msg(m, Batch.friendnum, chunk, chunk_len);
+        pos += len;
+    }
+
+    Batch.reply_len = 0;
+}
+
 void send_msg(Tox *m, int friendnum, char *msg) {
-    tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) msg, strlen(msg), NULL);
+    size_t len = strlen(msg);
+
+    if (!Batch.active || friendnum != Batch.friendnum) {
+        deliver_msg(m, friendnum, msg, len);
+        return;
+    }
+
+    if (Batch.reply_len + len + 1 > sizeof(Batch.reply))
+        flush_reply(m);
+
+    if (Batch.reply_len)
+        Batch.reply[Batch.reply_len++] = '\n';
+
+    memcpy(Batch.reply + Batch.reply_len, msg, len);
+    Batch.reply_len += len;
+}
+
+/* Like friend_is_master(), but only checks once per batch */
+static bool is_master(Tox *m, int friendnum)
+{
+    if (!Batch.active || friendnum != Batch.friendnum)
+        return friend_is_master(m, friendnum);
+
+    if (Batch.is_master == -1)
+        Batch.is_master = friend_is_master(m, friendnum);
+
+    return Batch.is_master;
 }
 
 static void authent_failed(Tox *m, int friendnum)
@@ -52,9 +151,189 @@ static void authent_failed(Tox *m, int friendnum)
     send_msg(m, friendnum, "Invalid command.");
 }
 
+static void cmd_admit(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        send_msg(m, friendnum, "Error: number > 0 required");
+        return;
+    }
+
+    int limit = atoi(argv[1]);
+
+    if (limit <= 0) {
+        send_msg(m, friendnum, "Error: number > 0 required");
+        return;
+    }
+
+    Tox_Bot.admit_limit = limit;
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Friend request limit set to %d per minute", limit);
+    send_msg(m, friendnum, msg);
+
+    log_event(LOG_INFO, EV_ADMIT_LIMIT_SET, friendnum, -1, limit, NULL);
+}
+
+/* Resolves a ban command argument, either a public key, a Tox ID or a friend number, into key.
+   Returns the friend number with that key, or -1 if it isn't a friend. Returns -2 if arg is invalid. */
+static int64_t ban_target(Tox *m, const char *arg, uint8_t *key)
+{
+    if (ban_parse_key(arg, key) == 0) {
+        TOX_ERR_FRIEND_BY_PUBLIC_KEY err;
+        uint32_t friendnum = tox_friend_by_public_key(m, key, &err);
+        return err == TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK ? friendnum : -1;
+    }
+
+    char *end;
+    unsigned long friendnum = strtoul(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || !tox_friend_get_public_key(m, friendnum, key, NULL))
+        return -2;
+
+    return friendnum;
+}
+
+static void cmd_ban(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        send_msg(m, friendnum, "Error: Tox ID, public key or friend number required");
+        return;
+    }
+
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+    int64_t target = ban_target(m, argv[1], key);
+
+    if (target == -2) {
+        send_msg(m, friendnum, "Error: Invalid Tox ID, public key or friend number");
+        return;
+    }
+
+    if (target >= 0 && friend_is_master(m, target)) {
+        send_msg(m, friendnum, "Error: Masters can't be banned");
+        return;
+    }
+
+    switch (ban_add(key)) {
+        case 0:
+            log_event(LOG_INFO, EV_BAN_ADDED, friendnum, -1, 0, argv[1]);
+            send_msg(m, friendnum, "Key banned");
+            break;
+
+        case 1:
+            send_msg(m, friendnum, "Key is already banned");
+            break;
+
+        default:
+            send_msg(m, friendnum, "Error: could not write banlist file");
+            break;
+    }
+}
+
+/* Parses the two group numbers of a bridge command. Returns 0 on success, -1 on failure. */
+static int bridge_groups(int argc, char (*argv)[MAX_COMMAND_LENGTH], int *a, int *b)
+{
+    if (argc < 2)
+        return -1;
+
+    *a = atoi(argv[1]);
+    *b = atoi(argv[2]);
+
+    if ((*a == 0 && strcmp(argv[1], "0")) || (*b == 0 && strcmp(argv[2], "0")))
+        return -1;
+
+    return 0;
+}
+
+static void cmd_bridge(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char msg[MAX_COMMAND_LENGTH];
+
+    if (argc < 1) {
+        if (bridges_format(msg, sizeof(msg)) == 0)
+            send_msg(m, friendnum, "No bridges");
+        else
+            send_msg(m, friendnum, msg);
+
+        return;
+    }
+
+    int a, b;
+
+    if (bridge_groups(argc, argv, &a, &b) == -1) {
+        send_msg(m, friendnum, "Error: Two group numbers required");
+        return;
+    }
+
+    switch (bridge_add(a, b)) {
+        case -1:
+            send_msg(m, friendnum, "Error: Invalid group number");
+            return;
+
+        case -2:
+            send_msg(m, friendnum, "Error: Groups are already bridged");
+            return;
+
+        case -3:
+            send_msg(m, friendnum, "Error: Too many bridges");
+            return;
+    }
+
+    log_event(LOG_INFO, EV_BRIDGE_ADDED, friendnum, a, b, NULL);
+    snprintf(msg, sizeof(msg), "Groups %d and %d bridged", a, b);
+    send_msg(m, friendnum, msg);
+}
+
+static void cmd_capacity(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        send_msg(m, friendnum, "Error: number >= 0 required");
+        return;
+    }
+
+    int capacity = atoi(argv[1]);
+
+    if (capacity < 0 || (capacity == 0 && strcmp(argv[1], "0"))) {
+        send_msg(m, friendnum, "Error: number >= 0 required");
+        return;
+    }
+
+    Tox_Bot.friend_capacity = capacity;
+
+    char msg[MAX_COMMAND_LENGTH];
+
+    if (capacity == 0)
+        snprintf(msg, sizeof(msg), "Friend capacity removed");
+    else
+        snprintf(msg, sizeof(msg), "Friend capacity set to %d (currently %zu friends)", capacity,
+                 tox_self_get_friend_list_size(m));
+
+    send_msg(m, friendnum, msg);
+    log_event(LOG_INFO, EV_FRIEND_CAPACITY_SET, friendnum, -1, capacity, NULL);
+}
+
 static void cmd_default(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
@@ -77,17 +356,12 @@ static void cmd_default(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAN
     snprintf(msg, sizeof(msg), "Default room number set to %d", groupnum);
     send_msg(m, friendnum, msg);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
-
-    printf("Default room number set to %d by %s", groupnum, name);
+    log_event(LOG_INFO, EV_DEFAULT_GROUP_SET, friendnum, groupnum, 0, NULL);
 }
 
 static void cmd_gmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
@@ -130,13 +404,8 @@ static void cmd_gmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMA
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
-
     send_msg(m, friendnum, "Message sent");
-    printf("<%s> message to group %d: %s\n", name, groupnum, msg);
+    log_event(LOG_INFO, EV_GROUP_MESSAGE_SENT, friendnum, groupnum, 0, msg);
 }
 
 static void cmd_group(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -148,20 +417,15 @@ static void cmd_group(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_
 
     uint8_t type = TOX_GROUPCHAT_TYPE_AV ? !strcasecmp(argv[1], "audio") : TOX_GROUPCHAT_TYPE_TEXT;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
-
     int groupnum = -1;
 
     if (type == TOX_GROUPCHAT_TYPE_TEXT)
         groupnum = tox_add_groupchat(m);
     else if (type == TOX_GROUPCHAT_TYPE_AV)
-        groupnum = toxav_add_av_groupchat(m, NULL, NULL);
+        groupnum = toxav_add_av_groupchat(m, recorder_audio_cb, NULL);
 
     if (groupnum == -1) {
-        printf("Group chat creation by %s failed to initialize\n", name);
+        log_event(LOG_WARNING, EV_GROUP_CREATE_FAILED, friendnum, -1, 0, "failed to initialize");
         send_msg(m, friendnum, "Group chat instance failed to initialize");
         return;
     }
@@ -169,50 +433,153 @@ static void cmd_group(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_
     const char *password = argc >= 2 ? argv[2] : NULL;
 
     if (password && strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
-        printf("Group chat creation by %s failed: Password too long\n", name);
+        log_event(LOG_WARNING, EV_GROUP_CREATE_FAILED, friendnum, groupnum, 0, "password too long");
         send_msg(m, friendnum, "Group chat instance failed to initialize: Password too long");
         return;
     }
 
     if (group_add(groupnum, type, password) == -1) {
-        printf("Group chat creation by %s failed\n", name);
+        log_event(LOG_WARNING, EV_GROUP_CREATE_FAILED, friendnum, groupnum, 0, "group_add failed");
         send_msg(m, friendnum, "Group chat creation failed");
         tox_del_groupchat(m, groupnum);
         return;
     }
 
     const char *pw = password ? " (Password protected)" : "";
-    printf("Group chat %d created by %s%s\n", groupnum, name, pw);
+    log_event(LOG_INFO, EV_GROUP_CREATED, friendnum, groupnum, password != NULL, NULL);
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Group chat %d created%s", groupnum, pw);
 	send_msg(m, friendnum, msg);
 }
 
+static const char help_msg[] =
+    " × info\t\t: Print my current status and list active group chats\n"
+    " × id\t\t: Print my Tox ID\n"
+    " × invite\t\t: Request invite to default group chat\n"
+    " × invite <n> <p>\t: Request invite to group chat n (with Password if protected)\n"
+    " × invite <pool>\t: Request invite to the least busy group of a pool\n"
+    " × group <t> <p>\t: Creates a new groupchat with Type: text | audio (optional Password)";
+
+/* Split in two to stay under TOX_MAX_MESSAGE_LENGTH */
+static const char help_master_msg1[] =
+    "ToxBot Master Commands:\n"
+    " × admit <n>\t\t: Sets the max number of friend requests accepted per minute\n"
+    " × ban <id>\t\t: Bans a Tox ID, public key or friend number\n"
+    " × bridge <a> <b>\t: Mirrors messages between groupchats a and b (no arguments to list bridges)\n"
+    " × capacity <n>\t\t: Sets the max number of friends, evicting the least recently active (0 for no limit)\n"
+    " × default <n>\t\t: Sets default groupchat room to n\n"
+    " × gmessage <n> <msg>\t: Sends msg to groupchat n\n"
+    " × history <n> <k>\t\t: Shows the last k messages of groupchat n, or those since k ago (e.g. 30m, 2h, 1d)\n"
+    " × leave <n>\t\t: Leaves groupchat n\n"
+    " × loglevel <l>\t\t: Sets the log level (debug, info, warning or error)\n"
+    " × master <id>\t\t: Adds Tox ID to the masterkeys file\n"
+    " × mem\t\t\t: Shows memory usage per subsystem";
+
+static const char help_master_msg2[] =
+    " × name <name>\t\t: Sets name\n"
+    " × passwd <n> <pass>\t\t: Sets password for groupchat n (leave pass blank for no password)\n"
+    " × play <n> <file> <vol>\t: Streams a WAV file or .m3u playlist into audio groupchat n\n"
+    " × pool <name> <max>\t: Creates a pool of groups with max peers each (see README)\n"
+    " × purge <n>\t\t: Sets the number of days before an inactive friend is deleted\n"
+    " × record <n> <on|off>\t: Starts or stops recording audio groupchat n\n"
+    " × search <n> <words>\t: Finds messages of groupchat n containing all words\n"
+    " × status <s>\t\t: Sets status (online, busy or away)\n"
+    " × statusmessage <msg>\t: Sets status message\n"
+    " × stop <n>\t\t: Stops playback in groupchat n\n"
+    " × title <n> <msg>\t\t: Sets title for groupchat n\n"
+    " × unban <id>\t\t: Lifts a ban\n"
+    " × unbridge <a> <b>\t: Removes the bridge between groupchats a and b";
+
+_Static_assert(sizeof(help_master_msg1) <= TOX_MAX_MESSAGE_LENGTH, "master help message is too long");
+_Static_assert(sizeof(help_master_msg2) <= TOX_MAX_MESSAGE_LENGTH, "master help message is too long");
+
 static void cmd_help(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    char msg[MAX_COMMAND_LENGTH];
-    strcpy(msg, " × info\t\t: Print my current status and list active group chats\n");
-    strcat(msg, " × id\t\t: Print my Tox ID\n");
-    strcat(msg, " × invite\t\t: Request invite to default group chat\n");
-    strcat(msg, " × invite <n> <p>\t: Request invite to group chat n (with Password if protected)\n");
-    strcat(msg, " × group <t> <p>\t: Creates a new groupchat with Type: text | audio (optional Password)");
-    send_msg(m, friendnum, msg);
+    send_msg(m, friendnum, (char *) help_msg);
 
-    if (friend_is_master(m, friendnum)) {
-        strcpy(msg, "ToxBot Master Commands:\n");
-        strcat(msg, " × default <n>\t\t: Sets default groupchat room to n\n");
-        strcat(msg, " × gmessage <n> <msg>\t: Sends msg to groupchat n\n");
-        strcat(msg, " × leave <n>\t\t: Leaves groupchat n\n");
-        strcat(msg, " × master <id>\t\t: Adds Tox ID to the masterkeys file\n");
-        strcat(msg, " × name <name>\t\t: Sets name\n");
-        strcat(msg, " × passwd <n> <pass>\t\t: Sets password for groupchat n (leave pass blank for no password)\n");
-        strcat(msg, " × purge <n>\t\t: Sets the number of days before an inactive friend is deleted\n");
-        strcat(msg, " × status <s>\t\t: Sets status (online, busy or away)\n");
-        strcat(msg, " × statusmessage <msg>\t: Sets status message\n");
-        strcat(msg, " × title <n> <msg>\t\t: Sets title for groupchat n");
-        send_msg(m, friendnum, msg);
+    if (is_master(m, friendnum)) {
+        send_msg(m, friendnum, (char *) help_master_msg1);
+        send_msg(m, friendnum, (char *) help_master_msg2);
+    }
+}
+
+struct Reply_Dest {
+    Tox *m;
+    int friendnum;
+};
+
+static void archive_reply(const char *line, void *data)
+{
+    struct Reply_Dest *dest = data;
+    send_msg(dest->m, dest->friendnum, (char *) line);
+}
+
+/* Parses a duration such as 30m, 2h or 1d into seconds. Returns 0 if s isn't a duration. */
+static uint64_t parse_duration(const char *s)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+
+    if (end == s || end[0] == '\0' || end[1] != '\0')
+        return 0;
+
+    switch (end[0]) {
+        case 'm':
+            return n * 60;
+
+        case 'h':
+            return n * 3600;
+
+        case 'd':
+            return n * SECONDS_IN_DAY;
+
+        default:
+            return 0;
+    }
+}
+
+static void cmd_history(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 2) {
+        send_msg(m, friendnum, "Error: Two arguments are required");
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+
+    if (groupnum == 0 && strcmp(argv[1], "0")) {
+        send_msg(m, friendnum, "Error: Invalid group number");
+        return;
+    }
+
+    uint32_t count = ARCHIVE_MAX_RESULTS;
+    uint64_t since = 0;
+    uint64_t duration = parse_duration(argv[2]);
+
+    if (duration) {
+        since = (uint64_t) time(NULL) - duration;
+    } else {
+        count = atoi(argv[2]);
+
+        if (count == 0 || count > ARCHIVE_MAX_RESULTS) {
+            send_msg(m, friendnum, "Error: k must be a count between 1 and 20 or a duration such as 30m, 2h or 1d");
+            return;
+        }
     }
+
+    struct Reply_Dest dest = { m, friendnum };
+    int ret = archive_history(groupnum, count, since, archive_reply, &dest);
+
+    if (ret == -1)
+        send_msg(m, friendnum, "Error: No archive is loaded for that group");
+    else if (ret == 0)
+        send_msg(m, friendnum, "No messages");
 }
 
 static void cmd_id(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -232,75 +599,178 @@ static void cmd_id(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LEN
     send_msg(m, friendnum, outmsg);
 }
 
+#define INFO_MAX_CHUNKS 16
+#define INFO_BUSIEST_FRIENDS 5
+
+/* The info reply is rebuilt only when something it shows changes; see info_cache_invalidate().
+   The uptime and friend count lines change too often to be worth caching and are generated per request. */
+static struct {
+    bool valid;
+    char status[MAX_COMMAND_LENGTH];    /* everything in the first message after the friend count line */
+    int status_len;
+    char chunks[INFO_MAX_CHUNKS][MAX_COMMAND_LENGTH];    /* group list, split into messages */
+    int num_chunks;
+    int num_omitted;    /* groups that didn't fit in chunks */
+} Info_Cache;
+
+void info_cache_invalidate(void)
+{
+    Info_Cache.valid = false;
+}
+
+static void info_cache_add_group_line(const char *line, int len)
+{
+    if (Info_Cache.num_chunks == 0)
+        Info_Cache.num_chunks = 1;
+
+    char *chunk = Info_Cache.chunks[Info_Cache.num_chunks - 1];
+    int chunk_len = strlen(chunk);
+
+    if (chunk_len + len >= MAX_COMMAND_LENGTH) {
+        if (Info_Cache.num_chunks == INFO_MAX_CHUNKS) {
+            ++Info_Cache.num_omitted;
+            return;
+        }
+
+        chunk = Info_Cache.chunks[Info_Cache.num_chunks++];
+        chunk_len = 0;
+    }
+
+    memcpy(chunk + chunk_len, line, len + 1);
+}
+
+static void info_cache_rebuild(Tox *m)
+{
+    Info_Cache.status_len = snprintf(Info_Cache.status, sizeof(Info_Cache.status),
+                                     "Inactive friends are purged after %"PRIu64" days\n"
+                                     "Tox ID of admin of this bot is: 06F0A900ECAD7402F60E8F17D04AFE0778E1AD4AD254A7DC9E5425123A31686BA9C6F868789A",
+                                     Tox_Bot.inactive_limit / SECONDS_IN_DAY);
+
+    memset(Info_Cache.chunks, 0, sizeof(Info_Cache.chunks));
+    Info_Cache.num_chunks = 0;
+    Info_Cache.num_omitted = 0;
+    Info_Cache.valid = true;
+
+    /* List active group chats and number of peers in each */
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!g->active)
+            continue;
+
+        char line[MAX_COMMAND_LENGTH];
+        const char *title = g->title_len ? g->title : "None";
+        const char *type = g->type == TOX_GROUPCHAT_TYPE_TEXT ? "Text" : "Audio";
+        int len = snprintf(line, sizeof(line), "Group %d | %s | peers: %d | Title: %s\n", g->num, type, g->num_peers,
+                           title);
+        info_cache_add_group_line(line, MIN(len, sizeof(line) - 1));
+    }
+
+    if (Info_Cache.num_chunks == 0)
+        info_cache_add_group_line("No active groupchats", strlen("No active groupchats"));
+}
+
+/* Writes the 1m/5m/1h counts of c to buf and returns the length written */
+static int format_rates(char *buf, size_t size, const struct Rate_Counter *c, uint64_t cur_time)
+{
+    return snprintf(buf, size, "%u/%u/%u", rate_sum(c, cur_time, RATE_1M), rate_sum(c, cur_time, RATE_5M),
+                    rate_sum(c, cur_time, RATE_1H));
+}
+
 static void cmd_info(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    if (!Info_Cache.valid)
+        info_cache_rebuild(m);
+
     char outmsg[MAX_COMMAND_LENGTH];
     char timestr[64];
-    char msg[MAX_COMMAND_LENGTH];
 
     uint64_t curtime = (uint64_t) time(NULL);
     get_elapsed_time_str(timestr, sizeof(timestr), curtime - Tox_Bot.start_time);
-    snprintf(msg, sizeof(msg), "Uptime: %s\n", timestr);
-    strcpy(outmsg, msg);
-    // send_msg(m, friendnum, outmsg);
-
-    uint32_t numfriends = tox_self_get_friend_list_size(m);
-    snprintf(msg, sizeof(msg), "Friends: %d (%d online)\n", numfriends, Tox_Bot.num_online_friends);
-    strcat(outmsg, msg);
-    // send_msg(m, friendnum, outmsg);
+    int len = snprintf(outmsg, sizeof(outmsg), "Uptime: %s\nFriends: %zu (%d online)\n", timestr,
+                       tox_self_get_friend_list_size(m), Tox_Bot.num_online_friends);
+    int status_len = MIN(Info_Cache.status_len, sizeof(outmsg) - len - 1);
 
-    snprintf(msg, sizeof(msg), "Inactive friends are purged after %"PRIu64" days\n",
-                                      Tox_Bot.inactive_limit / SECONDS_IN_DAY);
-    strcat(outmsg, msg);
-    // send_msg(m, friendnum, outmsg);
-
-    strcat(outmsg, "Tox ID of admin of this bot is: 06F0A900ECAD7402F60E8F17D04AFE0778E1AD4AD254A7DC9E5425123A31686BA9C6F868789A");
+    memcpy(outmsg + len, Info_Cache.status, status_len);
+    outmsg[len + status_len] = '\0';
     send_msg(m, friendnum, outmsg);
 
-    /* List active group chats and number of peers in each */
-    uint32_t numchats = tox_count_chatlist(m);
+    int i;
 
-    if (numchats == 0) {
-		send_msg(m, friendnum, "No active groupchats");
-        return;
+    for (i = 0; i < Info_Cache.num_chunks; ++i)
+        send_msg(m, friendnum, Info_Cache.chunks[i]);
+
+    if (Info_Cache.num_omitted) {
+        snprintf(outmsg, sizeof(outmsg), "... and %d more groups", Info_Cache.num_omitted);
+        send_msg(m, friendnum, outmsg);
     }
 
-    int32_t *groupchat_list = malloc(numchats * sizeof(int32_t));
+    /* activity changes with every message, so it's not part of the cache */
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        const struct Group_Chat *g = &Tox_Bot.g_chats[i];
 
-    if (groupchat_list == NULL)
-        exit(EXIT_FAILURE);
+        if (!g->active)
+            continue;
 
-    if (tox_get_chatlist(m, groupchat_list, numchats) == 0) {
-        free(groupchat_list);
-        return;
+        len = snprintf(outmsg, sizeof(outmsg), "Group %d activity (1m/5m/1h)", g->num);
+        int r;
+
+        for (r = 0; r < NUM_GROUP_RATES; ++r) {
+            len += snprintf(outmsg + len, sizeof(outmsg) - len, " | %s: ", group_rate_names[r]);
+            len += format_rates(outmsg + len, sizeof(outmsg) - len, &g->rates[r], curtime);
+        }
+
+        send_msg(m, friendnum, outmsg);
     }
 
-    uint32_t i;
+    if (!is_master(m, friendnum))
+        return;
+
+    uint32_t busiest[INFO_BUSIEST_FRIENDS];
+    int num = friends_busiest(busiest, INFO_BUSIEST_FRIENDS, RATE_1H, curtime);
 
-    strcpy(outmsg, "");
-    for (i = 0; i < numchats; ++i) {
-        uint32_t groupnum = groupchat_list[i];
-        int num_peers = tox_group_number_peers(m, groupnum);
+    len = snprintf(outmsg, sizeof(outmsg), "Busiest friends (commands 1m/5m/1h):");
 
-        if (num_peers != -1) {
-            int idx = group_index(groupnum);
-            const char *title = Tox_Bot.g_chats[idx].title_len
-                              ? Tox_Bot.g_chats[idx].title : "None";
-            const char *type = tox_group_get_type(m, groupnum) == TOX_GROUPCHAT_TYPE_TEXT ? "Text" : "Audio";
-            snprintf(msg, sizeof(msg), "Group %d | %s | peers: %d | Title: %s\n", groupnum, type, num_peers, title);
-            strcat(outmsg, msg);
-        }
+    for (i = 0; i < num; ++i) {
+        len += snprintf(outmsg + len, sizeof(outmsg) - len, "%s %u: ", i ? "," : "", busiest[i]);
+        len += format_rates(outmsg + len, sizeof(outmsg) - len, &friend_info(busiest[i])->commands, curtime);
     }
-    send_msg(m, friendnum, outmsg);
 
-    free(groupchat_list);
+    if (num > 0)
+        send_msg(m, friendnum, outmsg);
 }
 
 static void cmd_invite(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
+    /* the admin console isn't a Tox friend */
+    if (friendnum == ADMIN_FRIENDNUM) {
+        send_msg(m, friendnum, "Error: Use invitemany to invite friends from the admin socket");
+        return;
+    }
+
     int groupnum = Tox_Bot.default_groupnum;
+    int pool = argc >= 1 ? pool_find(argv[1]) : -1;
+
+    if (pool != -1) {
+        groupnum = pool_pick(m, pool, friendnum, is_master(m, friendnum), timer_now());
+
+        if (groupnum == POOL_FULL) {
+            send_msg(m, friendnum, "All groups in that pool are full. Please try again later.");
+            return;
+        }
+
+        if (groupnum == POOL_PROTECTED) {
+            send_msg(m, friendnum, "The groups in that pool are password protected. Use: invite <n> <password>");
+            return;
+        }
 
-    if (argc >= 1) {
+        if (groupnum == -1) {
+            send_msg(m, friendnum, "Invite failed.");
+            return;
+        }
+    } else if (argc >= 1) {
         groupnum = atoi(argv[1]);
 
         if (groupnum == 0 && strcmp(argv[1], "0")) {
@@ -318,304 +788,702 @@ static void cmd_invite(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
 
     int has_pass = Tox_Bot.g_chats[idx].has_pass;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    const char *passwd = NULL;
+
+    if (argc >= 2)
+        passwd = argv[2];
+
+    if (has_pass && (!passwd || strcmp(argv[2], Tox_Bot.g_chats[idx].password) != 0)) {
+        log_event(LOG_INFO, EV_INVITE_BAD_PASSWORD, friendnum, groupnum, 0, NULL);
+		send_msg(m, friendnum, "Invalid password");
+        return;
+    }
+
+    uint64_t now = timer_now();
+
+    switch (group_invite_check(idx, friendnum, now)) {
+        case INVITE_PRESENT:
+            send_msg(m, friendnum, "You are already in that group.");
+            return;
+
+        case INVITE_RECENT:
+            send_msg(m, friendnum, "Invite already sent. Please wait a moment before asking again.");
+            return;
+
+        case INVITE_SEND:
+            break;
+    }
+
+    if (tox_invite_friend(m, friendnum, groupnum) == -1) {
+        log_event(LOG_WARNING, EV_INVITE_FAILED, friendnum, groupnum, 0, NULL);
+		send_msg(m, friendnum, "Invite failed.");
+        return;
+    }
+
+    group_invite_sent(idx, friendnum, now);
+
+    log_event(LOG_INFO, EV_INVITE_SENT, friendnum, groupnum, 0, NULL);
+}
+
+static void cmd_leave(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+		send_msg(m, friendnum, "Error: Group number required");
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+
+    if (groupnum == 0 && strcmp(argv[1], "0")) {
+		send_msg(m, friendnum, "Error: Invalid group number");
+        return;
+    }
+
+    if (tox_del_groupchat(m, groupnum) == -1) {
+		send_msg(m, friendnum, "Error: Invalid group number");
+        return;
+    }
+
+    char msg[MAX_COMMAND_LENGTH];
+
+    group_leave(groupnum);
+
+    log_event(LOG_INFO, EV_GROUP_LEFT, friendnum, groupnum, 0, NULL);
+    snprintf(msg, sizeof(msg), "Left group %d", groupnum);
+	send_msg(m, friendnum, msg);
+}
+
+static void cmd_loglevel(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        send_msg(m, friendnum, "Error: level required (debug, info, warning or error)");
+        return;
+    }
+
+    int level = log_level_from_str(argv[1]);
+
+    if (level == -1) {
+        send_msg(m, friendnum, "Error: Invalid level (debug, info, warning or error)");
+        return;
+    }
+
+    log_set_level(level);
+    log_event(LOG_INFO, EV_LOG_LEVEL_SET, friendnum, -1, level, NULL);
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Log level set to %s", argv[1]);
+    send_msg(m, friendnum, msg);
+}
+
+static void cmd_master(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+		send_msg(m, friendnum, "Error: Tox ID required");
+        return;
+    }
+
+    const char *id = argv[1];
+
+    if (strlen(id) != TOX_ADDRESS_SIZE * 2) {
+		send_msg(m, friendnum, "Error: Invalid Tox ID");
+        return;
+    }
+
+    FILE *fp = fopen(MASTERLIST_FILE, "a");
+
+    if (fp == NULL) {
+		send_msg(m, friendnum, "Error: could not find masterkeys file");
+        return;
+    }
+
+    fprintf(fp, "%s\n", id);
+    fclose(fp);
+    friend_master_added(m, id);
+
+    log_event(LOG_INFO, EV_MASTER_ADDED, friendnum, -1, 0, id);
+	send_msg(m, friendnum, "ID added to masterkeys list");
+}
+
+static void cmd_mem(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    struct Mem_Process proc;
+    mem_get_process(&proc);
+
+    char outmsg[MAX_COMMAND_LENGTH];
+    snprintf(outmsg, sizeof(outmsg), "Memory | RSS: %.1f KiB | heap in use: %.1f KiB, free: %.1f KiB, "
+             "mmapped: %.1f KiB | toxcore savedata: %zu bytes", proc.rss / 1024.0, proc.heap_in_use / 1024.0,
+             proc.heap_free / 1024.0, proc.heap_mmapped / 1024.0, tox_get_savedata_size(m));
+    send_msg(m, friendnum, outmsg);
+
+    int i;
+
+    for (i = 0; i < NUM_MEM_TAGS; ++i) {
+        struct Mem_Stats s;
+        mem_get_stats(i, &s);
+
+        int len = snprintf(outmsg, sizeof(outmsg), "%s: %.1f KiB live, %.1f KiB peak, %"PRIu64" allocs, "
+                           "%"PRIu64" frees", mem_tag_names[i], s.live / 1024.0, s.peak / 1024.0, s.allocs, s.frees);
+
+        if (s.mapped)
+            snprintf(outmsg + len, sizeof(outmsg) - len, ", %.1f KiB mapped", s.mapped / 1024.0);
+
+        send_msg(m, friendnum, outmsg);
+    }
+}
+
+static void cmd_name(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+		send_msg(m, friendnum, "Error: Name required");
+        return;
+    }
+
+    char name[TOX_MAX_NAME_LENGTH];
+    int len = 0;
+
+    if (argv[1][0] == '\"') {    /* remove opening and closing quotes */
+        snprintf(name, sizeof(name), "%s", &argv[1][1]);
+        len = strlen(name) - 1;
+    } else {
+        snprintf(name, sizeof(name), "%s", argv[1]);
+        len = strlen(name);
+    }
+
+    name[len] = '\0';
+    tox_self_set_name(m, (uint8_t *) name, (uint16_t) len, NULL);
+
+    log_event(LOG_INFO, EV_NAME_SET, friendnum, -1, 0, name);
+    save_data(m, DATA_FILE);
+}
+
+static void cmd_passwd(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+		send_msg(m, friendnum, "Error: group number required");
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+
+    if (groupnum == 0 && strcmp(argv[1], "0")) {
+		send_msg(m, friendnum, "Error: Invalid group number");
+        return;
+    }
+
+    int idx = group_index(groupnum);
+
+    if (idx == -1) {
+		send_msg(m, friendnum, "Error: Invalid group number");
+        return;
+    }
+
+    /* no password */
+    if (argc < 2) {
+        Tox_Bot.g_chats[idx].has_pass = false;
+        memset(Tox_Bot.g_chats[idx].password, 0, MAX_PASSWORD_SIZE);
+
+		send_msg(m, friendnum, "No password set");
+        log_event(LOG_INFO, EV_PASSWORD_SET, friendnum, groupnum, 0, NULL);
+        return;
+    }
+
+    if (strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
+		send_msg(m, friendnum, "Password too long");
+        return;
+    }
+
+    Tox_Bot.g_chats[idx].has_pass = true;
+    snprintf(Tox_Bot.g_chats[idx].password, sizeof(Tox_Bot.g_chats[idx].password), "%s", argv[2]);
+
+	send_msg(m, friendnum, "Password set");
+    log_event(LOG_INFO, EV_PASSWORD_SET, friendnum, groupnum, 1, NULL);
+}
+
+static void cmd_play(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 2) {
+        send_msg(m, friendnum, "Error: Two arguments are required");
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+    int idx = group_index(groupnum);
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || idx == -1) {
+        send_msg(m, friendnum, "Error: Invalid group number");
+        return;
+    }
+
+    if (Tox_Bot.g_chats[idx].type != TOX_GROUPCHAT_TYPE_AV) {
+        send_msg(m, friendnum, "Error: Not an audio groupchat");
+        return;
+    }
+
+    int volume = 100;
+
+    if (argc >= 3) {
+        volume = atoi(argv[3]);
+
+        if (volume < 0 || volume > PLAYBACK_MAX_VOLUME || (volume == 0 && strcmp(argv[3], "0"))) {
+            send_msg(m, friendnum, "Error: Volume must be between 0 and 200");
+            return;
+        }
+    }
+
+    char path[MAX_COMMAND_LENGTH];
+    int len = 0;
+
+    if (argv[2][0] == '\"') {    /* remove opening and closing quotes */
+        snprintf(path, sizeof(path), "%s", &argv[2][1]);
+        len = strlen(path) - 1;
+    } else {
+        snprintf(path, sizeof(path), "%s", argv[2]);
+        len = strlen(path);
+    }
+
+    path[len] = '\0';
+
+    switch (playback_start(groupnum, path, volume)) {
+        case PLAYBACK_OK:
+            send_msg(m, friendnum, "Playback started");
+            break;
+
+        case PLAYBACK_ERR_BUSY:
+            send_msg(m, friendnum, "Error: Already playing in that group. Use stop first");
+            break;
+
+        case PLAYBACK_ERR_FULL:
+            send_msg(m, friendnum, "Error: Too many streams are playing");
+            break;
+
+        case PLAYBACK_ERR_OPEN:
+            send_msg(m, friendnum, "Error: Could not open file");
+            break;
+
+        case PLAYBACK_ERR_FORMAT:
+            send_msg(m, friendnum, "Error: Unsupported file. Only 16-bit PCM WAV files are supported");
+            break;
+
+        case PLAYBACK_ERR_THREAD:
+            send_msg(m, friendnum, "Error: Audio playback is unavailable");
+            break;
+    }
+}
+
+static void cmd_pool(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char msg[MAX_COMMAND_LENGTH];
+    int id;
+
+    if (argc < 1) {
+        bool any = false;
+
+        for (id = 0; id < POOL_MAX; ++id) {
+            if (pool_format(id, msg, sizeof(msg)) > 0) {
+                send_msg(m, friendnum, msg);
+                any = true;
+            }
+        }
+
+        if (!any)
+            send_msg(m, friendnum, "No pools defined");
+
+        return;
+    }
+
+    if (argc < 2) {
+        send_msg(m, friendnum, "Error: Max peer count, add <n> or delete required");
+        return;
+    }
+
+    id = pool_find(argv[1]);
+
+    if (!strcmp(argv[2], "delete")) {
+        if (id == -1) {
+            send_msg(m, friendnum, "Error: No such pool");
+            return;
+        }
+
+        pool_delete(id);
+        log_event(LOG_INFO, EV_POOL_DELETED, friendnum, -1, 0, argv[1]);
+        send_msg(m, friendnum, "Pool deleted");
+        return;
+    }
+
+    if (!strcmp(argv[2], "add")) {
+        if (id == -1) {
+            send_msg(m, friendnum, "Error: No such pool");
+            return;
+        }
 
-    const char *passwd = NULL;
+        int groupnum = argc >= 3 ? atoi(argv[3]) : -1;
 
-    if (argc >= 2)
-        passwd = argv[2];
+        if (argc < 3 || (groupnum == 0 && strcmp(argv[3], "0")) || pool_add_group(id, groupnum) == -1) {
+            send_msg(m, friendnum, "Error: Invalid group number");
+            return;
+        }
 
-    if (has_pass && (!passwd || strcmp(argv[2], Tox_Bot.g_chats[idx].password) != 0)) {
-        fprintf(stderr, "Failed to invite %s to group %d (invalid password)\n", name, groupnum);
-		send_msg(m, friendnum, "Invalid password");
+        info_cache_invalidate();
+        snprintf(msg, sizeof(msg), "Group %d added to pool %s", groupnum, argv[1]);
+        send_msg(m, friendnum, msg);
         return;
     }
 
-    if (tox_invite_friend(m, friendnum, groupnum) == -1) {
-        fprintf(stderr, "Failed to invite %s to group %d\n", name, groupnum);
-		send_msg(m, friendnum, "Invite failed.");
+    int max_peers = atoi(argv[2]);
+
+    if (max_peers <= 0) {
+        send_msg(m, friendnum, "Error: Max peer count must be a positive number");
         return;
     }
 
-    printf("Invited %s to group %d\n", name, groupnum);
+    switch (pool_set(argv[1], max_peers)) {
+        case -1:
+            send_msg(m, friendnum, "Error: Pool names must start with a letter and contain only letters, digits, - and _");
+            return;
+
+        case -2:
+            send_msg(m, friendnum, "Error: Too many pools");
+            return;
+    }
+
+    log_event(LOG_INFO, EV_POOL_SET, friendnum, -1, max_peers, argv[1]);
+    snprintf(msg, sizeof(msg), "Pool %s %s with at most %d peers per group", argv[1], id == -1 ? "created" : "updated",
+             max_peers);
+    send_msg(m, friendnum, msg);
 }
 
-static void cmd_leave(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_purge(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
-		send_msg(m, friendnum, "Error: Group number required");
+		send_msg(m, friendnum, "Error: number > 0 required");
         return;
     }
 
-    int groupnum = atoi(argv[1]);
+    uint64_t days = (uint64_t) atoi(argv[1]);
 
-    if (groupnum == 0 && strcmp(argv[1], "0")) {
-		send_msg(m, friendnum, "Error: Invalid group number");
+    if (days <= 0) {
+		send_msg(m, friendnum, "Error: number > 0 required");
         return;
     }
 
-    if (tox_del_groupchat(m, groupnum) == -1) {
-		send_msg(m, friendnum, "Error: Invalid group number");
-        return;
-    }
+    uint64_t seconds = days * SECONDS_IN_DAY;
+    Tox_Bot.inactive_limit = seconds;
+    info_cache_invalidate();
 
     char msg[MAX_COMMAND_LENGTH];
-
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
-
-    group_leave(groupnum);
-
-    printf("Left group %d (%s)\n", groupnum, name);
-    snprintf(msg, sizeof(msg), "Left group %d", groupnum);
+    snprintf(msg, sizeof(msg), "Purge time set to %"PRIu64" days", days);
 	send_msg(m, friendnum, msg);
+
+    log_event(LOG_INFO, EV_PURGE_SET, friendnum, -1, days, NULL);
 }
 
-static void cmd_master(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_record(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
-    if (argc < 1) {
-		send_msg(m, friendnum, "Error: Tox ID required");
+    if (argc < 2) {
+        send_msg(m, friendnum, "Error: Two arguments are required");
         return;
     }
 
-    const char *id = argv[1];
+    int groupnum = atoi(argv[1]);
+    int idx = group_index(groupnum);
 
-    if (strlen(id) != TOX_ADDRESS_SIZE * 2) {
-		send_msg(m, friendnum, "Error: Invalid Tox ID");
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || idx == -1) {
+        send_msg(m, friendnum, "Error: Invalid group number");
         return;
     }
 
-    FILE *fp = fopen(MASTERLIST_FILE, "a");
+    if (strcasecmp(argv[2], "off") == 0) {
+        if (!recorder_stop(groupnum)) {
+            send_msg(m, friendnum, "Error: That group is not being recorded");
+            return;
+        }
 
-    if (fp == NULL) {
-		send_msg(m, friendnum, "Error: could not find masterkeys file");
+        send_msg(m, friendnum, "Recording stopped");
         return;
     }
 
-    fprintf(fp, "%s\n", id);
-    fclose(fp);
+    if (strcasecmp(argv[2], "on") != 0) {
+        send_msg(m, friendnum, "Error: Must be on or off");
+        return;
+    }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnum, NULL);
-    name[len] = '\0';
+    if (Tox_Bot.g_chats[idx].type != TOX_GROUPCHAT_TYPE_AV) {
+        send_msg(m, friendnum, "Error: Not an audio groupchat");
+        return;
+    }
 
-    printf("%s added master: %s\n", name, id);
-	send_msg(m, friendnum, "ID added to masterkeys list");
+    switch (recorder_start(groupnum)) {
+        case RECORDER_OK:
+            send_msg(m, friendnum, "Recording started");
+            break;
+
+        case RECORDER_ERR_BUSY:
+            send_msg(m, friendnum, "Error: That group is already being recorded");
+            break;
+
+        case RECORDER_ERR_FULL:
+            send_msg(m, friendnum, "Error: Too many recordings in progress");
+            break;
+
+        case RECORDER_ERR_THREAD:
+            send_msg(m, friendnum, "Error: Recording is unavailable");
+            break;
+    }
 }
 
-static void cmd_name(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_status(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
-		send_msg(m, friendnum, "Error: Name required");
+		send_msg(m, friendnum, "Error: status required");
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int len = 0;
+    TOX_USER_STATUS type;
+    const char *status = argv[1];
 
-    if (argv[1][0] == '\"') {    /* remove opening and closing quotes */
-        snprintf(name, sizeof(name), "%s", &argv[1][1]);
-        len = strlen(name) - 1;
-    } else {
-        snprintf(name, sizeof(name), "%s", argv[1]);
-        len = strlen(name);
+    if (strcasecmp(status, "online") == 0)
+        type = TOX_USER_STATUS_NONE;
+    else if (strcasecmp(status, "away") == 0)
+        type = TOX_USER_STATUS_AWAY;
+    else if (strcasecmp(status, "busy") == 0)
+        type = TOX_USER_STATUS_BUSY;
+    else {
+		send_msg(m, friendnum, "Invalid status. Valid statuses are: online, busy and away.");
+        return;
     }
 
-    name[len] = '\0';
-    tox_self_set_name(m, (uint8_t *) name, (uint16_t) len, NULL);
-
-    char m_name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) m_name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    m_name[nlen] = '\0';
+    tox_self_set_status(m, type);
 
-    printf("%s set name to %s\n", m_name, name);
+    log_event(LOG_INFO, EV_STATUS_SET, friendnum, -1, 0, status);
     save_data(m, DATA_FILE);
 }
 
-static void cmd_passwd(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_statusmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
-		send_msg(m, friendnum, "Error: group number required");
+		send_msg(m, friendnum, "Error: message required");
         return;
     }
 
-    int groupnum = atoi(argv[1]);
-
-    if (groupnum == 0 && strcmp(argv[1], "0")) {
-		send_msg(m, friendnum, "Error: Invalid group number");
+    if (argv[1][0] != '\"') {
+		send_msg(m, friendnum, "Error: message must be enclosed in quotes");
         return;
     }
 
-    int idx = group_index(groupnum);
+    /* remove opening and closing quotes */
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "%s", &argv[1][1]);
+    int len = strlen(msg) - 1;
+    msg[len] = '\0';
 
-    if (idx == -1) {
-		send_msg(m, friendnum, "Error: Invalid group number");
-        return;
+    tox_self_set_status_message(m, (uint8_t *) msg, len, NULL);
+
+    log_event(LOG_INFO, EV_STATUS_MESSAGE_SET, friendnum, -1, 0, msg);
+    save_data(m, DATA_FILE);
+}
+
+/* Returns the text of the command being executed that follows its first n arguments, as it was typed.
+   For commands whose last argument may contain any number of words. */
+static const char *command_rest(int n)
+{
+    const char *p = Batch.cmd;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        while (*p == ' ')
+            ++p;
+
+        if (*p == '\"') {
+            const char *end = strchr(p + 1, '\"');
+            p = end ? end + 1 : p + strlen(p);
+        } else {
+            p += strcspn(p, " ");
+        }
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+    while (*p == ' ')
+        ++p;
 
+    return p;
+}
 
-    /* no password */
-    if (argc < 2) {
-        Tox_Bot.g_chats[idx].has_pass = false;
-        memset(Tox_Bot.g_chats[idx].password, 0, MAX_PASSWORD_SIZE);
+static void cmd_search(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
 
-		send_msg(m, friendnum, "No password set");
-        printf("No password set for group %d by %s\n", groupnum, name);
+    if (argc < 2) {
+        send_msg(m, friendnum, "Error: Two arguments are required");
         return;
     }
 
-    if (strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
-		send_msg(m, friendnum, "Password too long");
+    int groupnum = atoi(argv[1]);
+
+    if (groupnum == 0 && strcmp(argv[1], "0")) {
+        send_msg(m, friendnum, "Error: Invalid group number");
         return;
     }
 
-    Tox_Bot.g_chats[idx].has_pass = true;
-    snprintf(Tox_Bot.g_chats[idx].password, sizeof(Tox_Bot.g_chats[idx].password), "%s", argv[2]);
+    /* argv only holds the first words; quotes and other punctuation are ignored by the archive */
+    struct Reply_Dest dest = { m, friendnum };
+    int ret = archive_search(groupnum, command_rest(2), archive_reply, &dest);
 
-	send_msg(m, friendnum, "Password set");
-    printf("Password for group %d set by %s\n", groupnum, name);
+    if (ret == -1)
+        send_msg(m, friendnum, "Error: No archive is loaded for that group");
+    else if (ret == 0)
+        send_msg(m, friendnum, "No matches");
 }
 
-static void cmd_purge(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_stop(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
-		send_msg(m, friendnum, "Error: number > 0 required");
+        send_msg(m, friendnum, "Error: Group number required");
         return;
     }
 
-    uint64_t days = (uint64_t) atoi(argv[1]);
+    int groupnum = atoi(argv[1]);
 
-    if (days <= 0) {
-		send_msg(m, friendnum, "Error: number > 0 required");
+    if (groupnum == 0 && strcmp(argv[1], "0")) {
+        send_msg(m, friendnum, "Error: Invalid group number");
         return;
     }
 
-    uint64_t seconds = days * SECONDS_IN_DAY;
-    Tox_Bot.inactive_limit = seconds;
-
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
-
-    char msg[MAX_COMMAND_LENGTH];
-    snprintf(msg, sizeof(msg), "Purge time set to %"PRIu64" days", days);
-	send_msg(m, friendnum, msg);
+    if (!playback_stop(groupnum)) {
+        send_msg(m, friendnum, "Error: Nothing is playing in that group");
+        return;
+    }
 
-    printf("Purge time set to %"PRIu64" days by %s\n", days, name);
+    send_msg(m, friendnum, "Playback stopped");
 }
 
-static void cmd_status(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_unban(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
-		send_msg(m, friendnum, "Error: status required");
+        send_msg(m, friendnum, "Error: Tox ID, public key or friend number required");
         return;
     }
 
-    TOX_USER_STATUS type;
-    const char *status = argv[1];
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
 
-    if (strcasecmp(status, "online") == 0)
-        type = TOX_USER_STATUS_NONE;
-    else if (strcasecmp(status, "away") == 0)
-        type = TOX_USER_STATUS_AWAY;
-    else if (strcasecmp(status, "busy") == 0)
-        type = TOX_USER_STATUS_BUSY;
-    else {
-		send_msg(m, friendnum, "Invalid status. Valid statuses are: online, busy and away.");
+    if (ban_target(m, argv[1], key) == -2) {
+        send_msg(m, friendnum, "Error: Invalid Tox ID, public key or friend number");
         return;
     }
 
-    tox_self_set_status(m, type);
+    switch (ban_remove(key)) {
+        case 0:
+            log_event(LOG_INFO, EV_BAN_REMOVED, friendnum, -1, 0, argv[1]);
+            send_msg(m, friendnum, "Key unbanned");
+            break;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
+        case 1:
+            send_msg(m, friendnum, "Key is not banned");
+            break;
 
-    printf("%s set status to %s\n", name, status);
-    save_data(m, DATA_FILE);
+        default:
+            send_msg(m, friendnum, "Error: could not rewrite banlist file");
+            break;
+    }
 }
 
-static void cmd_statusmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_unbridge(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
-    if (argc < 1) {
-		send_msg(m, friendnum, "Error: message required");
+    int a, b;
+
+    if (bridge_groups(argc, argv, &a, &b) == -1) {
+        send_msg(m, friendnum, "Error: Two group numbers required");
         return;
     }
 
-    if (argv[1][0] != '\"') {
-		send_msg(m, friendnum, "Error: message must be enclosed in quotes");
+    if (bridge_remove(a, b) == -1) {
+        send_msg(m, friendnum, "Error: Groups aren't bridged");
         return;
     }
 
-    /* remove opening and closing quotes */
-    char msg[MAX_COMMAND_LENGTH];
-    snprintf(msg, sizeof(msg), "%s", &argv[1][1]);
-    int len = strlen(msg) - 1;
-    msg[len] = '\0';
-
-    tox_self_set_status_message(m, (uint8_t *) msg, len, NULL);
-
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
-
-    printf("%s set status message to \"%s\"\n", name, msg);
-    save_data(m, DATA_FILE);
+    log_event(LOG_INFO, EV_BRIDGE_REMOVED, friendnum, a, b, NULL);
+    send_msg(m, friendnum, "Bridge removed");
 }
 
 static void cmd_title_set(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
@@ -643,34 +1511,26 @@ static void cmd_title_set(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMM
     int len = strlen(title) - 1;
     title[len] = '\0';
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnum, (uint8_t *) name, NULL);
-    size_t nlen = tox_friend_get_name_size(m, friendnum, NULL);
-    name[nlen] = '\0';
-
     if (tox_group_set_title(m, groupnum, (uint8_t *) title, len) != 0) {
 		send_msg(m, friendnum, "Failed to set title. This may be caused by an invalid group number or an empty room");
-        printf("%s failed to set the title '%s' for group %d\n", name, title, groupnum);
+        log_event(LOG_WARNING, EV_TITLE_FAILED, friendnum, groupnum, 0, title);
         return;
     }
 
     int idx = group_index(groupnum);
     memcpy(Tox_Bot.g_chats[idx].title, title, len + 1);
     Tox_Bot.g_chats[idx].title_len = len;
+    info_cache_invalidate();
 
 	send_msg(m, friendnum, "Group title set");
-    printf("%s set group %d title to %s\n", name, groupnum, title);
+    log_event(LOG_INFO, EV_TITLE_SET, friendnum, groupnum, 0, title);
 }
 
 /* Parses input command and puts args into arg array.
    Returns number of arguments on success, -1 on failure. */
 static int parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
 {
-    char *cmd = strdup(input);
-
-    if (cmd == NULL)
-        exit(EXIT_FAILURE);
-
+    const char *cmd = input;
     int num_args = 0;
     int i = 0;    /* index of last char in an argument */
 
@@ -682,10 +1542,8 @@ static int parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
             qt_ofst = 1;
             i = char_find(1, cmd, '\"');
 
-            if (cmd[i] == '\0') {
-                free(cmd);
+            if (cmd[i] == '\0')
                 return -1;
-            }
         } else {
             i = char_find(0, cmd, ' ');
         }
@@ -696,12 +1554,9 @@ static int parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
         if (cmd[i] == '\0')    /* no more args */
             break;
 
-        char tmp[MAX_COMMAND_LENGTH];
-        snprintf(tmp, sizeof(tmp), "%s", &cmd[i + 1]);
-        strcpy(cmd, tmp);    /* tmp will always fit inside cmd */
+        cmd += i + 1;
     }
 
-    free(cmd);
     return num_args;
 }
 
@@ -709,21 +1564,35 @@ static struct {
     const char *name;
     void (*func)(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
 } commands[] = {
+    { "admit",            cmd_admit         },
+    { "ban",              cmd_ban           },
+    { "bridge",           cmd_bridge        },
+    { "capacity",         cmd_capacity      },
     { "default",          cmd_default       },
     { "group",            cmd_group         },
     { "gmessage",         cmd_gmessage      },
     { "help",             cmd_help          },
+    { "history",          cmd_history       },
     { "id",               cmd_id            },
     { "info",             cmd_info          },
     { "invite",           cmd_invite        },
     { "leave",            cmd_leave         },
+    { "loglevel",         cmd_loglevel      },
     { "master",           cmd_master        },
+    { "mem",              cmd_mem           },
     { "name",             cmd_name          },
     { "passwd",           cmd_passwd        },
+    { "play",             cmd_play          },
+    { "pool",             cmd_pool          },
     { "purge",            cmd_purge         },
+    { "record",           cmd_record        },
+    { "search",           cmd_search        },
     { "status",           cmd_status        },
     { "statusmessage",    cmd_statusmessage },
+    { "stop",             cmd_stop          },
     { "title",            cmd_title_set     },
+    { "unban",            cmd_unban         },
+    { "unbridge",         cmd_unbridge      },
     { NULL,               NULL              },
 };
 
@@ -733,7 +1602,9 @@ static int do_command(Tox *m, int friendnum, int num_args, char (*args)[MAX_COMM
 
     for (i = 0; commands[i].name; ++i) {
         if (strcmp(args[0], commands[i].name) == 0) {
+            struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_COMMAND, commands[i].name);
             (commands[i].func)(m, friendnum, num_args - 1, args);
+            watchdog_restore_phase(prev_phase);
             return 0;
         }
     }
@@ -741,16 +1612,124 @@ static int do_command(Tox *m, int friendnum, int num_args, char (*args)[MAX_COMM
     return -1;
 }
 
-int execute(Tox *m, int friendnum, const char *input, int length)
+/* Splits input into commands separated by newlines or semicolons outside of double quotes.
+   Puts a pointer to each of the first max_cmds commands in cmds (input is modified in place) and returns
+   their number. The number of further commands is put in num_ignored and *ignored points to the rest of
+   the input starting at the first of them, or is NULL if there are none. */
+static int split_commands(char *input, char **cmds, int max_cmds, int *num_ignored, char **ignored)
 {
-    if (length >= MAX_COMMAND_LENGTH)
-        return -1;
+    int num_cmds = 0;
+    bool in_quotes = false;
+    char *start = input;
+    char *p;
+
+    *num_ignored = 0;
+    *ignored = NULL;
+
+    for (p = input; ; ++p) {
+        if (*p == '\"')
+            in_quotes = !in_quotes;
+
+        if (*p != '\0' && (in_quotes || (*p != '\n' && *p != ';')))
+            continue;
+
+        bool end = *p == '\0';
+
+        while (start < p && (*start == ' ' || *start == '\t' || *start == '\r'))
+            ++start;
+
+        if (start < p) {
+            if (num_cmds < max_cmds) {
+                *p = '\0';
+                cmds[num_cmds++] = start;
+            } else {
+                if (*ignored == NULL)
+                    *ignored = start;
+
+                ++*num_ignored;
+            }
+        }
+
+        if (end)
+            break;
+
+        start = p + 1;
+    }
+
+    return num_cmds;
+}
 
+/* Executes one command. Returns 0 on success, -1 if the command is invalid. */
+static int execute_one(Tox *m, int friendnum, const char *cmd)
+{
     char args[MAX_NUM_ARGS][MAX_COMMAND_LENGTH];
-    int num_args = parse_command(input, args);
+    int num_args = parse_command(cmd, args);
 
     if (num_args == -1)
         return -1;
 
+    Batch.cmd = cmd;
     return do_command(m, friendnum, num_args, args);
 }
+
+int execute(Tox *m, int friendnum, const char *input, int length)
+{
+    if (length >= MAX_COMMAND_LENGTH)
+        return -1;
+
+    char buf[MAX_COMMAND_LENGTH];
+    memcpy(buf, input, length);
+    buf[length] = '\0';
+
+    char *cmds[MAX_BATCH_COMMANDS];
+    char *ignored;
+    int num_ignored;
+    int num_cmds = split_commands(buf, cmds, MAX_BATCH_COMMANDS, &num_ignored, &ignored);
+
+    if (num_cmds == 0)
+        return -1;
+
+#ifdef ALLOC_DEBUG
+    uint64_t heap_allocs = arena_heap_allocs();
+#endif
+
+    if (friendnum != ADMIN_FRIENDNUM)
+        friend_count_commands(friendnum, num_cmds, (uint64_t) time(NULL));
+
+    Batch.active = true;
+    Batch.friendnum = friendnum;
+    Batch.is_master = -1;
+    Batch.reply_len = 0;
+
+    int i, num_valid = 0;
+    bool reported = false;
+    char msg[MAX_COMMAND_LENGTH];
+
+    for (i = 0; i < num_cmds; ++i) {
+        if (execute_one(m, friendnum, cmds[i]) == 0) {
+            ++num_valid;
+        } else if (num_cmds > 1 || num_ignored) {
+            snprintf(msg, sizeof(msg), "Invalid command: %s", cmds[i]);
+            send_msg(m, friendnum, msg);
+            reported = true;
+        }
+    }
+
+    if (num_ignored) {
+        snprintf(msg, sizeof(msg), "Error: At most %d commands are run per message; %d ignored: %s",
+                 MAX_BATCH_COMMANDS, num_ignored, ignored);
+        send_msg(m, friendnum, msg);
+        reported = true;
+    }
+
+    flush_reply(m);
+    Batch.active = false;
+
+#ifdef ALLOC_DEBUG
+    /* commands must be served entirely from the arena in steady state */
+    assert(arena_heap_allocs() == heap_allocs);
+#endif
+
+    arena_reset();
+    return num_valid || reported ? 0 : -1;
+}
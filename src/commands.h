@@ -23,6 +23,15 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+/* Pseudo friend number for commands issued over the local admin socket */
+#define ADMIN_FRIENDNUM -1
+
+/* Executes the commands in input, which may hold several separated by newlines or semicolons.
+   Returns -1 if input holds no valid command and no error was reported to the sender, 0 otherwise. */
 int execute(Tox *m, int friendnumber, const char *input, int length);
 
+/* Marks the cached info reply as stale. Must be called whenever something it shows changes
+   (groups, group titles or peer counts, the purge limit). */
+void info_cache_invalidate(void);
+
 #endif    /* COMMANDS_H */
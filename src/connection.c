@@ -0,0 +1,254 @@
+/*  connection.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "misc.h"
+#include "connection.h"
+#include "log.h"
+#include "timers.h"
+#include "watchdog.h"
+#include "events.h"
+
+static void attempt_reconnect(Tox *m, void *data);
+
+static struct Conn_State Conn;
+static struct Timer attempt_timer = TIMER_INITIALIZER("reconnect", attempt_reconnect, NULL);
+
+/* TODO: hardcoding is bad stop being lazy */
+static struct toxNodes {
+    const char *ip;
+    uint16_t    port;
+    const char *key;
+    uint32_t    successes;    /* times a connection came up after bootstrapping to this node */
+    uint32_t    failures;     /* times tox_bootstrap() rejected this node */
+    bool        pending;      /* used in the attempt currently awaiting a connection */
+} nodes[] = {
+    { "144.76.60.215",   33445, "04119E835DF3E78BACF0F84235B300546AF8B936F035185E2A8E9E0A67C8924F" },
+    { "192.210.149.121", 33445, "F404ABAA1C99A9D37D61AB54898F56793E1DEF8BD46B1038B9D822E8460FAB67" },
+    { "195.154.119.113", 33445, "E398A69646B8CEACA9F0B84F553726C1C49270558C57DF5F3C368F05A7D71354" },
+    { "46.38.239.179",   33445, "F5A1A38EFB6BD3C2C8AF8B10D85F0F89E931704D349F1D0720C3C4059AF2440A" },
+    { "76.191.23.96",    33445, "93574A3FAB7D612FEA29FD8D67D3DD10DFD07A075A5D62E8AF3DD9F5D0932E11" },
+    { NULL, 0, NULL },
+};
+
+static const char *status_names[] = { "none", "tcp", "udp" };
+
+static bool bootstrap_node(Tox *m, int idx)
+{
+    char key[TOX_PUBLIC_KEY_SIZE];
+
+    if (hex_string_to_bin(nodes[idx].key, strlen(nodes[idx].key), key, sizeof(key)) == -1) {
+        ++nodes[idx].failures;
+        return false;
+    }
+
+    TOX_ERR_BOOTSTRAP err;
+    tox_bootstrap(m, nodes[idx].ip, nodes[idx].port, (uint8_t *) key, &err);
+
+    if (err != TOX_ERR_BOOTSTRAP_OK) {
+        log_event(LOG_WARNING, EV_BOOTSTRAP_FAILED, -1, -1, err, nodes[idx].ip);
+        ++nodes[idx].failures;
+        return false;
+    }
+
+    nodes[idx].pending = true;
+    return true;
+}
+
+/* Higher is better. Nodes that got us connected before rank first; nodes that fail to resolve sink. */
+static int64_t node_score(int idx)
+{
+    return (int64_t) nodes[idx].successes - (int64_t) nodes[idx].failures;
+}
+
+/* Bootstraps to the CONN_BOOTSTRAP_NODES best scoring nodes. Ties are broken by rotating through the list
+   so that repeated attempts don't keep hammering the same unresponsive nodes. */
+static void bootstrap_best_nodes(Tox *m)
+{
+    static int rotation = 0;
+    int num_nodes = 0;
+    int i, j;
+
+    while (nodes[num_nodes].ip)
+        ++num_nodes;
+
+    if (num_nodes == 0)
+        return;
+
+    bool used[num_nodes];
+    memset(used, 0, sizeof(used));
+
+    for (j = 0; j < MIN(CONN_BOOTSTRAP_NODES, num_nodes); ++j) {
+        int best = -1;
+
+        for (i = 0; i < num_nodes; ++i) {
+            int idx = (i + rotation) % num_nodes;
+
+            if (used[idx])
+                continue;
+
+            if (best == -1 || node_score(idx) > node_score(best))
+                best = idx;
+        }
+
+        used[best] = true;
+        bootstrap_node(m, best);
+    }
+
+    rotation = (rotation + 1) % num_nodes;
+}
+
+static void schedule_attempt(uint64_t delay)
+{
+    timer_set(&attempt_timer, delay * 1000);
+}
+
+static void on_self_connection(Tox *m, const struct Event *ev)
+{
+    conn_status_change(ev->self_connection.status, ev->time);
+}
+
+void conn_init(Tox *m, uint64_t cur_time)
+{
+    memset(&Conn, 0, sizeof(Conn));
+    Conn.status = TOX_CONNECTION_NONE;
+    Conn.status_since = cur_time;
+    Conn.offline_since = cur_time;
+    Conn.backoff = CONN_BACKOFF_MIN;
+
+    int i;
+
+    for (i = 0; nodes[i].ip; ++i)
+        bootstrap_node(m, i);
+
+    schedule_attempt(Conn.backoff);
+    event_subscribe(EVENT_SELF_CONNECTION, "connection", on_self_connection);
+}
+
+void conn_status_change(TOX_CONNECTION status, uint64_t cur_time)
+{
+    if (status == Conn.status)
+        return;
+
+    Conn.time_in[Conn.status] += cur_time - Conn.status_since;
+    Conn.status = status;
+    Conn.status_since = cur_time;
+
+    switch (status) {
+        case TOX_CONNECTION_NONE:
+            log_event(LOG_WARNING, EV_CONN_LOST, -1, -1, 0, NULL);
+
+            if (Conn.offline_since == 0)
+                Conn.offline_since = cur_time;
+
+            Conn.backoff = CONN_BACKOFF_MIN;
+            schedule_attempt(Conn.backoff);
+            return;
+
+        case TOX_CONNECTION_TCP:
+            log_event(LOG_INFO, EV_CONN_TCP, -1, -1, 0, NULL);
+
+            if (Conn.offline_since == 0)
+                Conn.offline_since = cur_time;
+
+            /* We're reachable, so give TCP a chance to upgrade before bootstrapping again */
+            Conn.backoff = CONN_BACKOFF_MIN;
+            schedule_attempt(CONN_TCP_TIMEOUT);
+            break;
+
+        case TOX_CONNECTION_UDP:
+            log_event(LOG_INFO, EV_CONN_UDP, -1, -1, 0, NULL);
+            Conn.backoff = CONN_BACKOFF_MIN;
+            timer_cancel(&attempt_timer);
+            break;
+    }
+
+    /* Credit the nodes that got us back online */
+    int i;
+
+    for (i = 0; nodes[i].ip; ++i) {
+        if (nodes[i].pending) {
+            ++nodes[i].successes;
+            nodes[i].pending = false;
+        }
+    }
+
+    if (status == TOX_CONNECTION_UDP && Conn.offline_since) {
+        uint64_t latency = cur_time - Conn.offline_since;
+        Conn.last_reconnect = latency;
+        Conn.max_reconnect = MAX(Conn.max_reconnect, latency);
+        ++Conn.num_reconnects;
+        Conn.offline_since = 0;
+    }
+}
+
+/* Re-bootstraps and schedules the next attempt with exponential backoff */
+static void attempt_reconnect(Tox *m, void *data)
+{
+    struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_CONNECTION, NULL);
+    uint64_t cur_time = (uint64_t) time(NULL);
+
+    log_event(LOG_INFO, EV_REBOOTSTRAP, -1, -1, cur_time - Conn.status_since, status_names[Conn.status]);
+
+    bootstrap_best_nodes(m);
+    ++Conn.num_attempts;
+
+    Conn.backoff = MIN(Conn.backoff * 2, CONN_BACKOFF_MAX);
+    schedule_attempt(Conn.backoff);
+    watchdog_restore_phase(prev_phase);
+}
+
+uint64_t conn_time_in_status(TOX_CONNECTION status, uint64_t cur_time)
+{
+    uint64_t t = Conn.time_in[status];
+
+    if (status == Conn.status)
+        t += cur_time - Conn.status_since;
+
+    return t;
+}
+
+void conn_print_metrics(FILE *fp, uint64_t cur_time)
+{
+    int i;
+
+    fprintf(fp, "connection_status %d\n", Conn.status);
+
+    for (i = TOX_CONNECTION_NONE; i <= TOX_CONNECTION_UDP; ++i)
+        fprintf(fp, "connection_seconds{status=\"%s\"} %"PRIu64"\n", status_names[i], conn_time_in_status(i, cur_time));
+
+    fprintf(fp, "connection_status_seconds %"PRIu64"\n", cur_time - Conn.status_since);
+    fprintf(fp, "connection_offline_seconds %"PRIu64"\n", Conn.offline_since ? cur_time - Conn.offline_since : 0);
+    fprintf(fp, "connection_bootstrap_attempts %"PRIu64"\n", Conn.num_attempts);
+    fprintf(fp, "connection_reconnects %"PRIu64"\n", Conn.num_reconnects);
+    fprintf(fp, "connection_last_reconnect_seconds %"PRIu64"\n", Conn.last_reconnect);
+    fprintf(fp, "connection_max_reconnect_seconds %"PRIu64"\n", Conn.max_reconnect);
+}
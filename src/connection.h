@@ -0,0 +1,61 @@
+/*  connection.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define CONN_BACKOFF_MIN 5       /* seconds before the first re-bootstrap attempt */
+#define CONN_BACKOFF_MAX 600     /* upper bound for the exponential backoff */
+#define CONN_TCP_TIMEOUT 300     /* seconds we tolerate a TCP-only connection before re-bootstrapping */
+#define CONN_BOOTSTRAP_NODES 3   /* number of nodes used per re-bootstrap attempt */
+
+struct Conn_State {
+    TOX_CONNECTION status;
+    uint64_t status_since;      /* time we entered the current status */
+    uint64_t time_in[3];        /* accumulated seconds spent in each TOX_CONNECTION state */
+    uint64_t offline_since;     /* time we last lost UDP connectivity; 0 if connected via UDP */
+    uint64_t backoff;
+    uint64_t num_attempts;      /* total re-bootstrap attempts */
+    uint64_t num_reconnects;    /* number of times we regained a connection after losing it */
+    uint64_t last_reconnect;    /* seconds it took to regain the last lost connection */
+    uint64_t max_reconnect;
+};
+
+/* Bootstraps to all known nodes, initializes the connection state and subscribes to connection status
+   events. From then on a timer re-bootstraps with exponential backoff while we're offline or have been
+   stuck on TCP for too long. */
+void conn_init(Tox *m, uint64_t cur_time);
+
+/* Records a change in our connection to the Tox network */
+void conn_status_change(TOX_CONNECTION status, uint64_t cur_time);
+
+/* Returns the total number of seconds spent in status */
+uint64_t conn_time_in_status(TOX_CONNECTION status, uint64_t cur_time);
+
+/* Writes connection metrics to fp */
+void conn_print_metrics(FILE *fp, uint64_t cur_time);
+
+#endif /* CONNECTION_H */
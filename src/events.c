@@ -0,0 +1,116 @@
+/*  events.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "events.h"
+
+struct Subscriber {
+    event_cb *cb;
+    const char *name;
+    uint64_t sampled_ns;    /* time spent in cb during timed dispatches */
+};
+
+static struct {
+    struct Subscriber subscribers[NUM_EVENT_TYPES][EVENT_MAX_SUBSCRIBERS];
+    int num_subscribers[NUM_EVENT_TYPES];
+
+    uint64_t published[NUM_EVENT_TYPES];
+} Events;
+
+const char *event_type_names[NUM_EVENT_TYPES] = {
+    [EVENT_SELF_CONNECTION]   = "self_connection",
+    [EVENT_FRIEND_CONNECTION] = "friend_connection",
+    [EVENT_FRIEND_REQUEST]    = "friend_request",
+    [EVENT_FRIEND_MESSAGE]    = "friend_message",
+    [EVENT_GROUP_INVITE]      = "group_invite",
+    [EVENT_GROUP_TITLE]       = "group_title",
+    [EVENT_GROUP_MESSAGE]     = "group_message",
+    [EVENT_GROUP_PEERS]       = "group_peers",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int event_subscribe(EVENT_TYPE type, const char *name, event_cb *cb)
+{
+    if (Events.num_subscribers[type] == EVENT_MAX_SUBSCRIBERS)
+        return -1;
+
+    struct Subscriber *s = &Events.subscribers[type][Events.num_subscribers[type]++];
+    s->cb = cb;
+    s->name = name;
+    s->sampled_ns = 0;
+
+    return 0;
+}
+
+void event_publish(Tox *m, const struct Event *ev)
+{
+    struct Subscriber *s = Events.subscribers[ev->type];
+    int i, n = Events.num_subscribers[ev->type];
+
+    /* reading the clock costs more than a dispatch, so only every EVENT_TIMING_SAMPLE'th one is timed */
+    if (Events.published[ev->type]++ % EVENT_TIMING_SAMPLE) {
+        for (i = 0; i < n; ++i)
+            s[i].cb(m, ev);
+
+        return;
+    }
+
+    uint64_t t = now_ns();
+
+    for (i = 0; i < n; ++i) {
+        s[i].cb(m, ev);
+
+        uint64_t end = now_ns();
+        s[i].sampled_ns += end - t;
+        t = end;
+    }
+}
+
+void events_print_metrics(FILE *fp)
+{
+    int type, i;
+
+    for (type = 0; type < NUM_EVENT_TYPES; ++type) {
+        const char *name = event_type_names[type];
+        fprintf(fp, "events_published{type=\"%s\"} %"PRIu64"\n", name, Events.published[type]);
+
+        for (i = 0; i < Events.num_subscribers[type]; ++i) {
+            const struct Subscriber *s = &Events.subscribers[type][i];
+            fprintf(fp, "event_handler_seconds{type=\"%s\",subscriber=\"%s\"} %.6f\n", name, s->name,
+                    s->sampled_ns * EVENT_TIMING_SAMPLE / 1e9);
+        }
+    }
+}
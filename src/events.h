@@ -0,0 +1,121 @@
+/*  events.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <tox/tox.h>
+
+/* Tox callbacks decode their arguments once into a struct Event and publish it to every subscriber of its
+   type. Events live on the publisher's stack and the dispatch table is a fixed size array, so publishing
+   never allocates. Pointers in an event are only valid for the duration of the dispatch. */
+
+#define EVENT_MAX_SUBSCRIBERS 8    /* per event type */
+#define EVENT_TIMING_SAMPLE 16     /* one in this many dispatches is timed for the metrics */
+
+typedef enum {
+    EVENT_SELF_CONNECTION,
+    EVENT_FRIEND_CONNECTION,
+    EVENT_FRIEND_REQUEST,
+    EVENT_FRIEND_MESSAGE,
+    EVENT_GROUP_INVITE,
+    EVENT_GROUP_TITLE,
+    EVENT_GROUP_MESSAGE,
+    EVENT_GROUP_PEERS,
+    NUM_EVENT_TYPES
+} EVENT_TYPE;
+
+struct Event {
+    EVENT_TYPE type;
+    uint64_t time;    /* time(NULL) when the event was published */
+
+    union {
+        struct {
+            TOX_CONNECTION status;
+        } self_connection;
+
+        struct {
+            uint32_t friendnum;
+            TOX_CONNECTION status;
+        } friend_connection;
+
+        struct {
+            const uint8_t *public_key;
+        } friend_request;
+
+        struct {
+            uint32_t friendnum;
+            const char *text;    /* sanitized and NUL terminated */
+            size_t length;
+        } friend_message;
+
+        struct {
+            int32_t friendnum;
+            uint8_t type;
+            const uint8_t *data;
+            uint16_t length;
+        } group_invite;
+
+        struct {
+            int groupnum;
+            int peernum;
+            const char *title;    /* sanitized and NUL terminated */
+            size_t length;
+        } group_title;
+
+        struct {
+            int groupnum;
+            int peernum;
+            const char *name;    /* sender's name, not NUL terminated */
+            size_t name_len;
+            const char *text;
+            size_t length;
+        } group_message;
+
+        struct {
+            int groupnum;
+            int peernum;
+            uint8_t change;    /* TOX_CHAT_CHANGE_PEER_ADD or TOX_CHAT_CHANGE_PEER_DEL */
+        } group_peers;
+    };
+};
+
+typedef void event_cb(Tox *m, const struct Event *ev);
+
+extern const char *event_type_names[NUM_EVENT_TYPES];
+
+/* Registers cb to be called for every event of the given type. Subscribers are called in the order they
+   subscribed. name must be a static string and is used in metrics. Returns 0 on success, -1 if type
+   already has EVENT_MAX_SUBSCRIBERS subscribers. */
+int event_subscribe(EVENT_TYPE type, const char *name, event_cb *cb);
+
+/* Calls every subscriber of ev->type with ev */
+void event_publish(Tox *m, const struct Event *ev);
+
+/* Writes event counts and the estimated time spent in each subscriber to fp */
+void events_print_metrics(FILE *fp);
+
+#endif /* EVENTS_H */
@@ -0,0 +1,263 @@
+/*  friendreq.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "misc.h"
+#include "commands.h"
+#include "friendreq.h"
+#include "log.h"
+#include "bans.h"
+#include "friends.h"
+#include "groupchats.h"
+
+extern struct Tox_Bot Tox_Bot;
+
+#define ADMIT_WINDOW 60
+
+/* open addressing table of queued keys; a power of two at least twice the queue size */
+#define FRIENDREQ_HASH_SIZE (FRIENDREQ_QUEUE_SIZE * 2)
+
+static struct {
+    uint8_t keys[FRIENDREQ_QUEUE_SIZE][TOX_PUBLIC_KEY_SIZE];
+    uint16_t index[FRIENDREQ_HASH_SIZE];    /* queue slot + 1 of each queued key, 0 if unused */
+    size_t head;
+    size_t count;
+
+    uint64_t window_start;
+    uint32_t window_admitted;
+
+    uint64_t num_queued;
+    uint64_t num_duplicates;
+    uint64_t num_admitted;
+    uint64_t num_rejected;
+    uint64_t num_evicted;
+} Requests;
+
+/* public keys are random so their first bytes make a good hash */
+static size_t key_hash(const uint8_t *public_key)
+{
+    uint32_t h;
+    memcpy(&h, public_key, sizeof(h));
+    return h & (FRIENDREQ_HASH_SIZE - 1);
+}
+
+/* Returns the index table position of public_key, or the empty position where it would go if not queued */
+static size_t index_find(const uint8_t *public_key)
+{
+    size_t pos = key_hash(public_key);
+
+    while (Requests.index[pos] != 0) {
+        if (memcmp(Requests.keys[Requests.index[pos] - 1], public_key, TOX_PUBLIC_KEY_SIZE) == 0)
+            break;
+
+        pos = (pos + 1) & (FRIENDREQ_HASH_SIZE - 1);
+    }
+
+    return pos;
+}
+
+/* Removes public_key from the index, shifting back later entries of its probe run so lookups never
+   stop early at the hole. */
+static void index_remove(const uint8_t *public_key)
+{
+    size_t hole = index_find(public_key);
+
+    if (Requests.index[hole] == 0)
+        return;
+
+    size_t pos = hole;
+
+    while (true) {
+        pos = (pos + 1) & (FRIENDREQ_HASH_SIZE - 1);
+
+        if (Requests.index[pos] == 0)
+            break;
+
+        size_t home = key_hash(Requests.keys[Requests.index[pos] - 1]);
+
+        /* entries whose home lies cyclically in (hole, pos] are already reachable */
+        if (((pos - home) & (FRIENDREQ_HASH_SIZE - 1)) >= ((pos - hole) & (FRIENDREQ_HASH_SIZE - 1))) {
+            Requests.index[hole] = Requests.index[pos];
+            hole = pos;
+        }
+    }
+
+    Requests.index[hole] = 0;
+}
+
+int friendreq_add(const uint8_t *public_key)
+{
+    size_t pos = index_find(public_key);
+
+    if (Requests.index[pos] != 0) {
+        ++Requests.num_duplicates;
+        return 0;
+    }
+
+    if (Requests.count == FRIENDREQ_QUEUE_SIZE) {
+        ++Requests.num_rejected;
+        return -1;
+    }
+
+    size_t tail = (Requests.head + Requests.count) % FRIENDREQ_QUEUE_SIZE;
+    memcpy(Requests.keys[tail], public_key, TOX_PUBLIC_KEY_SIZE);
+    Requests.index[pos] = tail + 1;
+    ++Requests.count;
+    ++Requests.num_queued;
+
+    return 0;
+}
+
+/* Deletes up to FRIEND_EVICT_MAX of the least recently active non-masters while the friend list is at
+   capacity, preferring those who are offline. Evicting more than one lets the list shrink gradually after
+   the capacity is lowered. Returns false if there is no room for another friend. */
+static bool make_room(Tox *m)
+{
+    if (Tox_Bot.friend_capacity == 0)
+        return true;
+
+    size_t num_friends = tox_self_get_friend_list_size(m);
+    int evicted = 0;
+
+    while (num_friends >= Tox_Bot.friend_capacity && evicted < FRIEND_EVICT_MAX) {
+        uint32_t friendnum = friend_lru_oldest();
+
+        if (friendnum == FRIEND_NONE)
+            break;
+
+        /* deleted friends get no connection callback */
+        if (friend_info(friendnum)->online)
+            --Tox_Bot.num_online_friends;
+
+        tox_friend_delete(m, friendnum, NULL);
+        friend_info_remove(friendnum);
+        group_forget_friend(friendnum);
+        log_event(LOG_INFO, EV_FRIEND_EVICTED, friendnum, -1, 0, NULL);
+        --num_friends;
+        ++evicted;
+    }
+
+    Requests.num_evicted += evicted;
+    return evicted > 0 || num_friends < Tox_Bot.friend_capacity;
+}
+
+/* Returns false if public_key is our own or already belongs to a friend, which toxcore would refuse to add */
+static bool can_add(Tox *m, const uint8_t *public_key)
+{
+    uint8_t self_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(m, self_key);
+
+    if (memcmp(public_key, self_key, TOX_PUBLIC_KEY_SIZE) == 0)
+        return false;
+
+    TOX_ERR_FRIEND_BY_PUBLIC_KEY err;
+    tox_friend_by_public_key(m, public_key, &err);
+    return err != TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK;
+}
+
+int friendreq_do(Tox *m, uint64_t cur_time)
+{
+    if (Requests.count == 0)
+        return 0;
+
+    if (timed_out(Requests.window_start, cur_time, ADMIT_WINDOW)) {
+        Requests.window_start = cur_time;
+        Requests.window_admitted = 0;
+    }
+
+    if (Requests.window_admitted >= Tox_Bot.admit_limit)
+        return 0;
+
+    uint32_t budget = MIN(FRIENDREQ_BATCH_SIZE, Tox_Bot.admit_limit - Requests.window_admitted);
+    int added = 0;
+
+    /* read once for the whole batch, and only if something is admitted */
+    struct Master_Keys masters = { NULL, 0 };
+    bool masters_loaded = false;
+
+    while (budget-- && Requests.count) {
+        const uint8_t *public_key = Requests.keys[Requests.head];
+        index_remove(public_key);
+        Requests.head = (Requests.head + 1) % FRIENDREQ_QUEUE_SIZE;
+        --Requests.count;
+
+        /* the key may have been banned while it was queued */
+        if (ban_check(public_key)) {
+            log_event(LOG_DEBUG, EV_FRIEND_REQUEST_BANNED, -1, -1, 0, NULL);
+            continue;
+        }
+
+        /* friends are only evicted for requests that can actually be added */
+        if (!can_add(m, public_key)) {
+            ++Requests.num_duplicates;
+            continue;
+        }
+
+        if (!make_room(m)) {
+            log_event(LOG_WARNING, EV_FRIEND_ADD_FAILED, -1, -1, 0, "at capacity and no friend can be evicted");
+            ++Requests.num_rejected;
+            continue;
+        }
+
+        TOX_ERR_FRIEND_ADD err;
+        uint32_t friendnum = tox_friend_add_norequest(m, public_key, &err);
+        ++Requests.window_admitted;
+
+        if (err != TOX_ERR_FRIEND_ADD_OK) {
+            log_event(LOG_WARNING, EV_FRIEND_ADD_FAILED, -1, -1, err, NULL);
+            ++Requests.num_rejected;
+            continue;
+        }
+
+        if (!masters_loaded) {
+            master_keys_load(&masters);
+            masters_loaded = true;
+        }
+
+        friend_track(friendnum, master_keys_match(m, &masters, friendnum));
+        ++Requests.num_admitted;
+        ++added;
+    }
+
+    master_keys_free(&masters);
+    return added;
+}
+
+void friendreq_print_metrics(FILE *fp)
+{
+    fprintf(fp, "friend_requests_queued %"PRIu64"\n", Requests.num_queued);
+    fprintf(fp, "friend_requests_duplicate %"PRIu64"\n", Requests.num_duplicates);
+    fprintf(fp, "friend_requests_admitted %"PRIu64"\n", Requests.num_admitted);
+    fprintf(fp, "friend_requests_rejected %"PRIu64"\n", Requests.num_rejected);
+    fprintf(fp, "friends_evicted %"PRIu64"\n", Requests.num_evicted);
+    fprintf(fp, "friend_capacity %u\n", Tox_Bot.friend_capacity);
+    fprintf(fp, "friend_requests_pending %zu\n", Requests.count);
+}
@@ -0,0 +1,47 @@
+/*  friendreq.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRIENDREQ_H
+#define FRIENDREQ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define FRIENDREQ_QUEUE_SIZE 1024    /* requests beyond this are rejected */
+#define FRIENDREQ_BATCH_SIZE 32      /* max number of requests admitted per loop iteration */
+#define DEFAULT_ADMIT_LIMIT 120      /* default max number of requests admitted per minute */
+#define FRIEND_EVICT_MAX 8           /* max number of friends evicted to admit one request */
+
+/* Queues a friend request for admission. Duplicate requests from a key that is already queued are ignored.
+   Returns 0 on success, -1 if the queue is full. */
+int friendreq_add(const uint8_t *public_key);
+
+/* Admits up to FRIENDREQ_BATCH_SIZE queued requests, subject to the per-minute admission limit. When the
+   friend list is at capacity, the least recently active non-masters are deleted to make room.
+   Returns the number of friends added. */
+int friendreq_do(Tox *m, uint64_t cur_time);
+
+/* Writes friend request metrics to fp */
+void friendreq_print_metrics(FILE *fp);
+
+#endif /* FRIENDREQ_H */
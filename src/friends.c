@@ -0,0 +1,228 @@
+/*  friends.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "friends.h"
+#include "mem.h"
+
+/* Eviction list of tracked non-masters. There is one for offline and one for online friends so that the
+   least recently active offline friend is found in O(1). */
+struct Friend_LRU {
+    uint32_t head;    /* most recently active */
+    uint32_t tail;    /* least recently active, next to be evicted */
+    uint32_t size;
+};
+
+static struct {
+    struct Friend_Info *friends;
+    uint32_t size;
+
+    struct Friend_LRU lru[2];    /* indexed by Friend_Info.online */
+} Friends = {
+    .lru = {
+        { FRIEND_NONE, FRIEND_NONE, 0 },
+        { FRIEND_NONE, FRIEND_NONE, 0 },
+    },
+};
+
+static void lru_unlink(struct Friend_Info *f)
+{
+    struct Friend_LRU *l = &Friends.lru[f->online];
+
+    if (f->lru_prev != FRIEND_NONE)
+        Friends.friends[f->lru_prev].lru_next = f->lru_next;
+    else
+        l->head = f->lru_next;
+
+    if (f->lru_next != FRIEND_NONE)
+        Friends.friends[f->lru_next].lru_prev = f->lru_prev;
+    else
+        l->tail = f->lru_prev;
+
+    f->in_lru = false;
+    --l->size;
+}
+
+static void lru_push(uint32_t friendnum, struct Friend_Info *f)
+{
+    struct Friend_LRU *l = &Friends.lru[f->online];
+
+    f->lru_prev = FRIEND_NONE;
+    f->lru_next = l->head;
+
+    if (l->head != FRIEND_NONE)
+        Friends.friends[l->head].lru_prev = friendnum;
+    else
+        l->tail = friendnum;
+
+    l->head = friendnum;
+    f->in_lru = true;
+    ++l->size;
+}
+
+struct Friend_Info *friend_info(uint32_t friendnum)
+{
+    if (friendnum >= Friends.size) {
+        uint32_t size = Friends.size ? Friends.size : 64;
+
+        while (size <= friendnum)
+            size *= 2;
+
+        struct Friend_Info *friends = mem_realloc(MEM_FRIENDS, Friends.friends, size * sizeof(struct Friend_Info));
+
+        if (friends == NULL)
+            return NULL;
+
+        memset(friends + Friends.size, 0, (size - Friends.size) * sizeof(struct Friend_Info));
+        Friends.friends = friends;
+        Friends.size = size;
+    }
+
+    return &Friends.friends[friendnum];
+}
+
+void friend_info_remove(uint32_t friendnum)
+{
+    if (friendnum >= Friends.size)
+        return;
+
+    struct Friend_Info *f = &Friends.friends[friendnum];
+
+    if (f->in_lru)
+        lru_unlink(f);
+
+    memset(f, 0, sizeof(struct Friend_Info));
+}
+
+void friend_track(uint32_t friendnum, bool master)
+{
+    struct Friend_Info *f = friend_info(friendnum);
+
+    if (f == NULL)
+        return;
+
+    f->master = master;
+
+    if (master && f->in_lru)
+        lru_unlink(f);
+    else if (!master && !f->in_lru)
+        lru_push(friendnum, f);
+}
+
+void friend_touch(uint32_t friendnum)
+{
+    if (friendnum >= Friends.size)
+        return;
+
+    struct Friend_Info *f = &Friends.friends[friendnum];
+
+    if (f->in_lru && Friends.lru[f->online].head != friendnum) {
+        lru_unlink(f);
+        lru_push(friendnum, f);
+    }
+}
+
+void friend_set_online(uint32_t friendnum, bool online)
+{
+    struct Friend_Info *f = friend_info(friendnum);
+
+    if (f == NULL)
+        return;
+
+    if (!f->in_lru) {
+        f->online = online;
+        return;
+    }
+
+    lru_unlink(f);
+    f->online = online;
+    lru_push(friendnum, f);
+}
+
+uint32_t friend_lru_oldest(void)
+{
+    if (Friends.lru[false].tail != FRIEND_NONE)
+        return Friends.lru[false].tail;
+
+    return Friends.lru[true].tail;
+}
+
+void friend_count_commands(uint32_t friendnum, uint32_t n, uint64_t cur_time)
+{
+    struct Friend_Info *f = friend_info(friendnum);
+
+    if (f)
+        rate_add(&f->commands, cur_time, n);
+}
+
+int friends_busiest(uint32_t *out, int max, RATE_WINDOW window, uint64_t cur_time)
+{
+    uint32_t counts[max];
+    int num = 0;
+    uint32_t i;
+
+    /* insertion into a short sorted list; max is small */
+    for (i = 0; i < Friends.size; ++i) {
+        uint32_t count = rate_sum(&Friends.friends[i].commands, cur_time, window);
+
+        if (count == 0 || (num == max && count <= counts[num - 1]))
+            continue;
+
+        int j = num < max ? num++ : max - 1;
+
+        for (; j > 0 && counts[j - 1] < count; --j) {
+            counts[j] = counts[j - 1];
+            out[j] = out[j - 1];
+        }
+
+        counts[j] = count;
+        out[j] = i;
+    }
+
+    return num;
+}
+
+void friends_print_metrics(FILE *fp, uint64_t cur_time)
+{
+    uint32_t i;
+    int w;
+
+    fprintf(fp, "friends_evictable %u\n", Friends.lru[false].size + Friends.lru[true].size);
+    fprintf(fp, "friends_evictable_offline %u\n", Friends.lru[false].size);
+
+    /* only friends active in the last hour, to keep the output proportional to activity */
+    for (i = 0; i < Friends.size; ++i) {
+        const struct Rate_Counter *c = &Friends.friends[i].commands;
+
+        if (rate_sum(c, cur_time, RATE_1H) == 0)
+            continue;
+
+        for (w = 0; w < NUM_RATE_WINDOWS; ++w)
+            fprintf(fp, "friend_commands{friend=\"%u\",window=\"%s\"} %u\n", i, rate_window_names[w],
+                    rate_sum(c, cur_time, w));
+    }
+}
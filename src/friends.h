@@ -0,0 +1,77 @@
+/*  friends.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rates.h"
+
+#define FRIEND_NONE UINT32_MAX
+
+/* Per-friend state kept alongside toxcore's friend list, indexed by friend number */
+struct Friend_Info {
+    struct Rate_Counter commands;
+    uint32_t ban_generation;    /* ban list generation banned was computed for; 0 if never */
+    bool banned;
+    bool master;                /* cached role; masters are never evicted */
+    bool online;                /* selects the offline or online eviction list */
+    bool in_lru;                /* friend is a tracked non-master, linked into an eviction list */
+    uint32_t lru_prev;          /* neighbours in the eviction list by friend number, more recently active first */
+    uint32_t lru_next;
+};
+
+/* Returns the state of friendnum, growing the registry if needed. Returns NULL on allocation failure. */
+struct Friend_Info *friend_info(uint32_t friendnum);
+
+/* Resets the state of friendnum. Call when a friend is deleted since toxcore reuses friend numbers. */
+void friend_info_remove(uint32_t friendnum);
+
+/* Starts tracking friendnum's activity, or updates its role if it is already tracked. Non-masters join the
+   eviction list as the most recently active friend; masters are taken off it. */
+void friend_track(uint32_t friendnum, bool master);
+
+/* Marks friendnum as the most recently active friend. O(1); call on messages. */
+void friend_touch(uint32_t friendnum);
+
+/* Records whether friendnum is online, moving them to the front of the matching eviction list. O(1); call on
+   connection changes. */
+void friend_set_online(uint32_t friendnum, bool online);
+
+/* Returns the least recently active tracked non-master that is offline, or if they're all online the least
+   recently active one. Returns FRIEND_NONE if there is none. O(1). */
+uint32_t friend_lru_oldest(void);
+
+/* Counts n commands sent by friendnum */
+void friend_count_commands(uint32_t friendnum, uint32_t n, uint64_t cur_time);
+
+/* Puts the numbers of up to max friends who sent the most commands in window into out, busiest first.
+   Returns the number of friends. */
+int friends_busiest(uint32_t *out, int max, RATE_WINDOW window, uint64_t cur_time);
+
+/* Writes per-friend metrics to fp */
+void friends_print_metrics(FILE *fp, uint64_t cur_time);
+
+#endif /* FRIENDS_H */
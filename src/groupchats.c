@@ -24,21 +24,58 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include "toxbot.h"
+#include "misc.h"
+#include "commands.h"
 #include "groupchats.h"
+#include "log.h"
+#include "playback.h"
+#include "recorder.h"
+#include "archive.h"
+#include "mem.h"
+#include "timers.h"
+#include "watchdog.h"
+#include "bridges.h"
 
 extern struct Tox_Bot Tox_Bot;
 
+static void reap_empty(Tox *m, void *data);
+
+/* fires at the earliest time an empty group may need to be reaped */
+static struct Timer reap_timer = TIMER_INITIALIZER("reap_empty_groups", reap_empty, NULL);
+static uint64_t groups_reaped;
+
+static uint64_t invite_hits;      /* invites answered locally */
+static uint64_t invite_misses;    /* invites sent over the network */
+
+static uint64_t peer_updates;     /* peer list changes mirrored incrementally */
+static uint64_t peer_rebuilds;    /* peer lists rebuilt in full */
+
+const char *group_rate_names[NUM_GROUP_RATES] = {
+    [GROUP_RATE_MESSAGES] = "messages",
+    [GROUP_RATE_JOINS]    = "joins",
+    [GROUP_RATE_LEAVES]   = "leaves",
+};
+
+static void schedule_reap(uint64_t deadline)
+{
+    uint64_t now = timer_now();
+    timer_set_earliest(&reap_timer, deadline > now ? deadline - now : 0);
+}
+
 void realloc_groupchats(int n)
 {
     if (n <= 0) {
-        free(Tox_Bot.g_chats);
+        mem_free(Tox_Bot.g_chats);
         Tox_Bot.g_chats = NULL;
         return;
     }
 
-    struct Group_Chat *g = realloc(Tox_Bot.g_chats, n * sizeof(struct Group_Chat));
+    struct Group_Chat *g = mem_realloc(MEM_GROUPS, Tox_Bot.g_chats, n * sizeof(struct Group_Chat));
 
     if (g == NULL)
         exit(EXIT_FAILURE);
@@ -61,6 +98,9 @@ int group_add(int groupnum, uint8_t type, const char *password)
         Tox_Bot.g_chats[i].num = groupnum;
         Tox_Bot.g_chats[i].active = true;
         Tox_Bot.g_chats[i].type = type;
+        Tox_Bot.g_chats[i].num_peers = 1;
+        Tox_Bot.g_chats[i].empty_since = timer_now();
+        schedule_reap(Tox_Bot.g_chats[i].empty_since + GROUP_REAP_GRACE * 1000);
 
         if (password) {
             Tox_Bot.g_chats[i].has_pass = true;
@@ -70,6 +110,8 @@ int group_add(int groupnum, uint8_t type, const char *password)
         if (Tox_Bot.chats_idx == i)
             ++Tox_Bot.chats_idx;
 
+        archive_open_group(groupnum);
+        info_cache_invalidate();
         return 0;
     }
 
@@ -80,8 +122,15 @@ void group_leave(int groupnum)
 {
     int i;
 
+    playback_stop(groupnum);
+    recorder_stop(groupnum);
+    archive_close_group(groupnum);
+    bridges_remove_group(groupnum);
+
     for (i = 0; i < Tox_Bot.chats_idx; ++i) {
         if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].num == groupnum) {
+            mem_free(Tox_Bot.g_chats[i].peer_friends);
+            mem_free(Tox_Bot.g_chats[i].peer_map);
             memset(&Tox_Bot.g_chats[i], 0, sizeof(struct Group_Chat));
             break;
         }
@@ -94,6 +143,7 @@ void group_leave(int groupnum)
 
     Tox_Bot.chats_idx = i;
     realloc_groupchats(i);
+    info_cache_invalidate();
 }
 
 int group_index(int groupnum)
@@ -107,3 +157,297 @@ int group_index(int groupnum)
 
     return -1;
 }
+
+static bool peer_friends_get(const struct Group_Chat *g, uint32_t friendnum)
+{
+    size_t word = friendnum / 32;
+
+    if (word >= g->peer_friends_words)
+        return false;
+
+    return g->peer_friends[word] & (1U << (friendnum % 32));
+}
+
+static void peer_friends_set(struct Group_Chat *g, uint32_t friendnum)
+{
+    size_t word = friendnum / 32;
+
+    if (word >= g->peer_friends_words) {
+        size_t new_words = MAX(word + 1, g->peer_friends_words * 2);
+        uint32_t *tmp = mem_realloc(MEM_GROUPS, g->peer_friends, new_words * sizeof(uint32_t));
+
+        if (tmp == NULL)
+            exit(EXIT_FAILURE);
+
+        memset(tmp + g->peer_friends_words, 0, (new_words - g->peer_friends_words) * sizeof(uint32_t));
+        g->peer_friends = tmp;
+        g->peer_friends_words = new_words;
+    }
+
+    g->peer_friends[word] |= 1U << (friendnum % 32);
+}
+
+static bool invite_recent(const struct Recent_Invite *r, uint64_t now)
+{
+    return r->time && now - r->time < INVITE_COOLDOWN * 1000;
+}
+
+static INVITE_CHECK invite_state(const struct Group_Chat *g, uint32_t friendnum, uint64_t now)
+{
+    if (peer_friends_get(g, friendnum))
+        return INVITE_PRESENT;
+
+    const struct Recent_Invite *r = &g->recent_invites[friendnum & (INVITE_CACHE_SIZE - 1)];
+
+    if (r->friendnum == friendnum && invite_recent(r, now))
+        return INVITE_RECENT;
+
+    return INVITE_SEND;
+}
+
+INVITE_CHECK group_invite_check(int idx, uint32_t friendnum, uint64_t now)
+{
+    INVITE_CHECK state = invite_state(&Tox_Bot.g_chats[idx], friendnum, now);
+
+    if (state == INVITE_SEND)
+        ++invite_misses;
+    else
+        ++invite_hits;
+
+    return state;
+}
+
+bool group_has_friend(int idx, uint32_t friendnum, uint64_t now)
+{
+    return invite_state(&Tox_Bot.g_chats[idx], friendnum, now) != INVITE_SEND;
+}
+
+int group_load(int idx, uint64_t now)
+{
+    const struct Group_Chat *g = &Tox_Bot.g_chats[idx];
+    int i, load = g->num_peers - 1;
+
+    for (i = 0; i < INVITE_CACHE_SIZE; ++i) {
+        const struct Recent_Invite *r = &g->recent_invites[i];
+
+        if (invite_recent(r, now) && !peer_friends_get(g, r->friendnum))
+            ++load;
+    }
+
+    return load;
+}
+
+void group_invite_sent(int idx, uint32_t friendnum, uint64_t now)
+{
+    struct Recent_Invite *r = &Tox_Bot.g_chats[idx].recent_invites[friendnum & (INVITE_CACHE_SIZE - 1)];
+    r->friendnum = friendnum;
+    r->time = now;
+}
+
+void group_forget_friend(uint32_t friendnum)
+{
+    int i, j;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!g->active)
+            continue;
+
+        if (friendnum / 32 < g->peer_friends_words)
+            g->peer_friends[friendnum / 32] &= ~(1U << (friendnum % 32));
+
+        struct Recent_Invite *r = &g->recent_invites[friendnum & (INVITE_CACHE_SIZE - 1)];
+
+        if (r->friendnum == friendnum)
+            r->time = 0;
+
+        /* so the peer leaving later doesn't clear the bit of whoever gets the number next */
+        for (j = 0; j < g->num_mapped; ++j) {
+            if (g->peer_map[j] == friendnum)
+                g->peer_map[j] = FRIEND_NONE;
+        }
+    }
+}
+
+/* Returns the friend number of peernum, or FRIEND_NONE if it's ourselves or not a friend */
+static uint32_t peer_friendnum(Tox *m, int groupnum, int peernum)
+{
+    if (tox_group_peernumber_is_ours(m, groupnum, peernum))
+        return FRIEND_NONE;
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (tox_group_peer_pubkey(m, groupnum, peernum, public_key) == -1)
+        return FRIEND_NONE;
+
+    TOX_ERR_FRIEND_BY_PUBLIC_KEY err;
+    uint32_t friendnum = tox_friend_by_public_key(m, public_key, &err);
+
+    return err == TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK ? friendnum : FRIEND_NONE;
+}
+
+static void peer_map_reserve(struct Group_Chat *g, int size)
+{
+    if (size <= g->peer_map_size)
+        return;
+
+    int new_size = MAX(size, g->peer_map_size * 2);
+    uint32_t *tmp = mem_realloc(MEM_GROUPS, g->peer_map, new_size * sizeof(uint32_t));
+
+    if (tmp == NULL)
+        exit(EXIT_FAILURE);
+
+    g->peer_map = tmp;
+    g->peer_map_size = new_size;
+}
+
+/* Friends who just left may want to come back right away */
+static void peer_friend_left(struct Group_Chat *g, uint32_t friendnum)
+{
+    g->peer_friends[friendnum / 32] &= ~(1U << (friendnum % 32));
+
+    struct Recent_Invite *r = &g->recent_invites[friendnum & (INVITE_CACHE_SIZE - 1)];
+
+    if (r->friendnum == friendnum)
+        r->time = 0;
+}
+
+/* Rebuilds the peer map and the set of friends present from toxcore's peer list */
+static void rebuild_peers(Tox *m, struct Group_Chat *g, int groupnum, int num_peers)
+{
+    int i;
+
+    for (i = 0; i < g->num_mapped; ++i) {
+        if (g->peer_map[i] != FRIEND_NONE)
+            peer_friend_left(g, g->peer_map[i]);
+    }
+
+    peer_map_reserve(g, num_peers);
+
+    for (i = 0; i < num_peers; ++i) {
+        uint32_t friendnum = peer_friendnum(m, groupnum, i);
+        g->peer_map[i] = friendnum;
+
+        if (friendnum != FRIEND_NONE)
+            peer_friends_set(g, friendnum);
+    }
+
+    g->num_mapped = num_peers;
+    g->peers_synced = true;
+    ++peer_rebuilds;
+}
+
+void group_peer_change(Tox *m, int groupnum, int peernum, uint8_t change)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1)
+        return;
+
+    info_cache_invalidate();
+
+    struct Group_Chat *g = &Tox_Bot.g_chats[idx];
+    int num_peers = tox_group_number_peers(m, groupnum);
+
+    if (num_peers == -1)
+        return;
+
+    g->num_peers = num_peers;
+
+    if (g->num_peers > 1) {
+        g->empty_since = 0;
+
+        if (g->title_pending && tox_group_set_title(m, groupnum, (uint8_t *) g->title, g->title_len) == 0)
+            g->title_pending = false;
+    } else if (g->empty_since == 0) {
+        g->empty_since = timer_now();
+        schedule_reap(g->empty_since + GROUP_REAP_GRACE * 1000);
+    }
+
+    if (change == TOX_CHAT_CHANGE_PEER_ADD && g->peers_synced && peernum == g->num_mapped
+            && num_peers == g->num_mapped + 1) {
+        uint32_t friendnum = peer_friendnum(m, groupnum, peernum);
+
+        peer_map_reserve(g, num_peers);
+        g->peer_map[g->num_mapped++] = friendnum;
+
+        if (friendnum != FRIEND_NONE)
+            peer_friends_set(g, friendnum);
+
+        ++peer_updates;
+    } else if (change == TOX_CHAT_CHANGE_PEER_DEL && g->peers_synced && peernum < g->num_mapped
+               && num_peers == g->num_mapped - 1) {
+        uint32_t friendnum = g->peer_map[peernum];
+
+        if (friendnum != FRIEND_NONE)
+            peer_friend_left(g, friendnum);
+
+        g->peer_map[peernum] = g->peer_map[--g->num_mapped];
+        ++peer_updates;
+    } else if (change != TOX_CHAT_CHANGE_PEER_NAME) {
+        rebuild_peers(m, g, groupnum, num_peers);
+    }
+}
+
+/* Leaves groups that have been empty for GROUP_REAP_GRACE seconds */
+static void reap_empty(Tox *m, void *data)
+{
+    struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_REAP_GROUPS, NULL);
+    uint64_t now = timer_now();
+    int i;
+
+    for (i = Tox_Bot.chats_idx - 1; i >= 0; --i) {
+        struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!g->active || g->empty_since == 0)
+            continue;
+
+        if (now - g->empty_since < GROUP_REAP_GRACE * 1000) {
+            schedule_reap(g->empty_since + GROUP_REAP_GRACE * 1000);
+            continue;
+        }
+
+        int groupnum = g->num;
+        log_event(LOG_INFO, EV_GROUP_EMPTY_DELETED, -1, groupnum, 0, NULL);
+        tox_del_groupchat(m, groupnum);
+        group_leave(groupnum);
+        ++groups_reaped;
+    }
+
+    watchdog_restore_phase(prev_phase);
+}
+
+void group_count(int groupnum, GROUP_RATE rate, uint64_t cur_time)
+{
+    int idx = group_index(groupnum);
+
+    if (idx != -1)
+        rate_add(&Tox_Bot.g_chats[idx].rates[rate], cur_time, 1);
+}
+
+void group_print_metrics(FILE *fp, uint64_t cur_time)
+{
+    int i, r, w;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        const struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!g->active)
+            continue;
+
+        fprintf(fp, "group_peers{group=\"%d\"} %d\n", g->num, g->num_peers);
+
+        for (r = 0; r < NUM_GROUP_RATES; ++r) {
+            for (w = 0; w < NUM_RATE_WINDOWS; ++w)
+                fprintf(fp, "group_%s{group=\"%d\",window=\"%s\"} %u\n", group_rate_names[r], g->num,
+                        rate_window_names[w], rate_sum(&g->rates[r], cur_time, w));
+        }
+    }
+
+    fprintf(fp, "groups_reaped %"PRIu64"\n", groups_reaped);
+    fprintf(fp, "invite_cache_hits %"PRIu64"\n", invite_hits);
+    fprintf(fp, "invite_cache_misses %"PRIu64"\n", invite_misses);
+    fprintf(fp, "group_peer_updates %"PRIu64"\n", peer_updates);
+    fprintf(fp, "group_peer_rebuilds %"PRIu64"\n", peer_rebuilds);
+}
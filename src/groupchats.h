@@ -23,8 +23,28 @@
 #ifndef GROUPCHATS_H
 #define GROUPCHATS_H
 
+#include "rates.h"
+#include "friends.h"
+
 #define SECONDS_IN_DAY 86400UL
 #define MAX_PASSWORD_SIZE 64
+#define GROUP_REAP_GRACE 600    /* seconds a group may stay empty before we leave it */
+#define INVITE_COOLDOWN 30      /* seconds before a repeat invite for the same friend is sent */
+#define INVITE_CACHE_SIZE 64    /* must be a power of 2 */
+
+struct Recent_Invite {
+    uint32_t friendnum;
+    uint64_t time;    /* timer_now() when the invite was sent; 0 if the slot is unused */
+};
+
+typedef enum {
+    GROUP_RATE_MESSAGES,
+    GROUP_RATE_JOINS,
+    GROUP_RATE_LEAVES,
+    NUM_GROUP_RATES
+} GROUP_RATE;
+
+extern const char *group_rate_names[NUM_GROUP_RATES];
 
 struct Group_Chat {
     int num;
@@ -33,12 +53,61 @@ struct Group_Chat {
     uint8_t type;
     char title[TOX_MAX_NAME_LENGTH];
     int title_len;
+    bool title_pending;      /* title couldn't be set yet because we were alone in the group */
+    uint8_t pool;            /* id + 1 of the pool the group belongs to; 0 if none */
     char password[MAX_PASSWORD_SIZE];
+    int num_peers;           /* including ourselves */
+    uint64_t empty_since;    /* timer_now() when the group became empty; 0 if it has other peers */
+    uint32_t *peer_friends;    /* bitmap of friend numbers that are currently peers in the group */
+    size_t peer_friends_words;
+    uint32_t *peer_map;        /* friend number of each peer by peer number; FRIEND_NONE if not a friend */
+    int peer_map_size;
+    int num_mapped;            /* peers in peer_map */
+    bool peers_synced;         /* peer_map mirrors toxcore's peer list and can be updated incrementally */
+    struct Recent_Invite recent_invites[INVITE_CACHE_SIZE];    /* indexed by friend number modulo size */
+    struct Rate_Counter rates[NUM_GROUP_RATES];
 };
 
+typedef enum {
+    INVITE_SEND,       /* friend needs an invite */
+    INVITE_PRESENT,    /* friend is already a peer in the group */
+    INVITE_RECENT,     /* friend was invited less than INVITE_COOLDOWN seconds ago */
+} INVITE_CHECK;
+
 int group_add(int groupnum, uint8_t type, const char *password);
 void group_leave(int groupnum);
 int group_index(int groupnum);
 void realloc_groupchats(int n);
 
+/* Checks whether friendnum needs to be sent an invite to the group at index idx. now is timer_now(). */
+INVITE_CHECK group_invite_check(int idx, uint32_t friendnum, uint64_t now);
+
+/* Returns true if friendnum is a peer in the group at index idx or was invited to it recently. Unlike
+   group_invite_check this isn't counted in the invite cache metrics. */
+bool group_has_friend(int idx, uint32_t friendnum, uint64_t now);
+
+/* Returns the number of peers other than ourselves in the group at index idx, plus the friends that were
+   invited recently and haven't joined yet. */
+int group_load(int idx, uint64_t now);
+
+/* Records that friendnum was sent an invite to the group at index idx */
+void group_invite_sent(int idx, uint32_t friendnum, uint64_t now);
+
+/* Forgets everything the groups know about friendnum. Call when a friend is deleted, as toxcore gives their
+   number to the next friend added. */
+void group_forget_friend(uint32_t friendnum);
+
+/* Updates the peer count of groupnum and the set of friends present in it after peernum was added or
+   deleted (change is a TOX_CHAT_CHANGE value). Toxcore appends new peers and moves the last peer into the
+   slot of a deleted one, which is mirrored in O(1); the peer list is only rebuilt in full after joining or
+   if the mirror and toxcore disagree. Groups left empty are reaped after GROUP_REAP_GRACE seconds by a
+   timer. A pending title is set once the group has other peers. */
+void group_peer_change(Tox *m, int groupnum, int peernum, uint8_t change);
+
+/* Counts an event of the given type in groupnum */
+void group_count(int groupnum, GROUP_RATE rate, uint64_t cur_time);
+
+/* Writes groupchat metrics to fp */
+void group_print_metrics(FILE *fp, uint64_t cur_time);
+
 #endif  /* GROUPCHATS_H */
@@ -0,0 +1,204 @@
+/*  inbox.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "commands.h"
+#include "inbox.h"
+
+struct Inbox_Entry {
+    uint32_t friendnum;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];    /* of the sender, as friend numbers are reused */
+    uint16_t length;
+    uint64_t queued_us;
+    char text[TOX_MAX_MESSAGE_LENGTH + 1];
+};
+
+struct Inbox_Queue {
+    struct Inbox_Entry *entries;
+    uint32_t size;
+    uint32_t head;
+    uint32_t count;
+
+    uint32_t max_count;
+    uint64_t executed;
+    uint64_t wait_us;        /* total time executed messages spent queued */
+    uint64_t max_wait_us;
+    uint64_t shed_full;
+    uint64_t shed_stale;
+    uint64_t shed_gone;      /* the sender was deleted while the message was queued */
+};
+
+static struct Inbox_Entry master_entries[INBOX_MASTER_SIZE];
+static struct Inbox_Entry public_entries[INBOX_PUBLIC_SIZE];
+
+static struct {
+    struct Inbox_Queue queues[NUM_INBOX_CLASSES];
+    uint64_t master_overflows;    /* master messages that found their queue full and drained it */
+    uint64_t over_budget;
+} Inbox = {
+    .queues = {
+        [INBOX_MASTER] = { .entries = master_entries, .size = INBOX_MASTER_SIZE },
+        [INBOX_PUBLIC] = { .entries = public_entries, .size = INBOX_PUBLIC_SIZE },
+    },
+};
+
+static const char *inbox_class_names[NUM_INBOX_CLASSES] = {
+    [INBOX_MASTER] = "master",
+    [INBOX_PUBLIC] = "public",
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void run_message(Tox *m, uint32_t friendnum, const char *text, size_t length)
+{
+    if (execute(m, friendnum, text, length) == -1) {
+        const char *outmsg = "Invalid command. Type help for a list of commands";
+        tox_friend_send_message(m, friendnum, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
+    }
+}
+
+/* Executes the oldest message of q, or drops it if it's a public message that has waited too long */
+static void run_oldest(Tox *m, INBOX_CLASS cls, uint64_t now)
+{
+    struct Inbox_Queue *q = &Inbox.queues[cls];
+    struct Inbox_Entry *e = &q->entries[q->head];
+    uint64_t wait = now - e->queued_us;
+
+    q->head = (q->head + 1) % q->size;
+    --q->count;
+
+    if (cls == INBOX_PUBLIC && wait > INBOX_PUBLIC_MAX_WAIT_MS * 1000) {
+        ++q->shed_stale;
+        return;
+    }
+
+    /* the friend may have been deleted while the message was queued, and their number given to someone else */
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (!tox_friend_get_public_key(m, e->friendnum, public_key, NULL)
+            || memcmp(public_key, e->public_key, TOX_PUBLIC_KEY_SIZE) != 0) {
+        ++q->shed_gone;
+        return;
+    }
+
+    ++q->executed;
+    q->wait_us += wait;
+
+    if (wait > q->max_wait_us)
+        q->max_wait_us = wait;
+
+    run_message(m, e->friendnum, e->text, e->length);
+}
+
+void inbox_push(Tox *m, uint32_t friendnum, INBOX_CLASS cls, const char *text, size_t length)
+{
+    struct Inbox_Queue *q = &Inbox.queues[cls];
+
+    if (length > TOX_MAX_MESSAGE_LENGTH)
+        length = TOX_MAX_MESSAGE_LENGTH;
+
+    if (q->count == q->size) {
+        if (cls == INBOX_MASTER) {
+            /* masters rely on their commands running in order, so the older ones go first */
+            ++Inbox.master_overflows;
+
+            while (q->count)
+                run_oldest(m, INBOX_MASTER, now_us());
+
+            run_message(m, friendnum, text, length);
+        } else {
+            ++q->shed_full;
+        }
+
+        return;
+    }
+
+    struct Inbox_Entry *e = &q->entries[(q->head + q->count) % q->size];
+
+    if (!tox_friend_get_public_key(m, friendnum, e->public_key, NULL))
+        return;
+
+    e->friendnum = friendnum;
+    e->length = length;
+    e->queued_us = now_us();
+    memcpy(e->text, text, length);
+    e->text[length] = '\0';
+
+    if (++q->count > q->max_count)
+        q->max_count = q->count;
+}
+
+void inbox_run(Tox *m, uint32_t budget_us)
+{
+    struct Inbox_Queue *masters = &Inbox.queues[INBOX_MASTER];
+    struct Inbox_Queue *public = &Inbox.queues[INBOX_PUBLIC];
+
+    if (masters->count == 0 && public->count == 0)
+        return;
+
+    uint64_t start = now_us(), now = start;
+
+    do {
+        run_oldest(m, masters->count ? INBOX_MASTER : INBOX_PUBLIC, now);
+        now = now_us();
+    } while ((masters->count || public->count) && now - start < budget_us);
+
+    if (now - start >= budget_us)
+        ++Inbox.over_budget;
+}
+
+void inbox_print_metrics(FILE *fp)
+{
+    int i;
+
+    for (i = 0; i < NUM_INBOX_CLASSES; ++i) {
+        const struct Inbox_Queue *q = &Inbox.queues[i];
+        const char *name = inbox_class_names[i];
+
+        fprintf(fp, "inbox_queued{class=\"%s\"} %u\n", name, q->count);
+        fprintf(fp, "inbox_max_queued{class=\"%s\"} %u\n", name, q->max_count);
+        fprintf(fp, "inbox_executed{class=\"%s\"} %"PRIu64"\n", name, q->executed);
+        fprintf(fp, "inbox_wait_seconds_sum{class=\"%s\"} %.6f\n", name, q->wait_us / 1e6);
+        fprintf(fp, "inbox_wait_seconds_max{class=\"%s\"} %.6f\n", name, q->max_wait_us / 1e6);
+        fprintf(fp, "inbox_shed{class=\"%s\",reason=\"full\"} %"PRIu64"\n", name, q->shed_full);
+        fprintf(fp, "inbox_shed{class=\"%s\",reason=\"stale\"} %"PRIu64"\n", name, q->shed_stale);
+        fprintf(fp, "inbox_shed{class=\"%s\",reason=\"gone\"} %"PRIu64"\n", name, q->shed_gone);
+    }
+
+    fprintf(fp, "inbox_master_overflows %"PRIu64"\n", Inbox.master_overflows);
+    fprintf(fp, "inbox_ticks_over_budget %"PRIu64"\n", Inbox.over_budget);
+}
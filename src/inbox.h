@@ -0,0 +1,58 @@
+/*  inbox.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INBOX_H
+#define INBOX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <tox/tox.h>
+
+/* Friend messages are queued by class and executed from the main loop, masters first, so that admins can
+   still act while public traffic is backed up. Public messages are shed when their queue is full or they
+   have waited too long; master messages never are. */
+
+#define INBOX_MASTER_SIZE 32
+#define INBOX_PUBLIC_SIZE 256
+#define INBOX_PUBLIC_MAX_WAIT_MS 10000    /* public messages older than this are dropped unexecuted */
+#define INBOX_BUDGET_US 20000             /* time the main loop spends executing messages per iteration */
+
+typedef enum {
+    INBOX_MASTER,
+    INBOX_PUBLIC,
+    NUM_INBOX_CLASSES
+} INBOX_CLASS;
+
+/* Queues a message from friendnum for execution. A master message that finds its queue full is executed
+   right away instead, after the queued master messages so that they still run in order. */
+void inbox_push(Tox *m, uint32_t friendnum, INBOX_CLASS cls, const char *text, size_t length);
+
+/* Executes queued messages, masters first, until none are left or budget_us microseconds have elapsed.
+   At least one message is executed per call. Should be called once per main loop iteration. */
+void inbox_run(Tox *m, uint32_t budget_us);
+
+/* Writes queue depths, wait times and shedding counts to fp */
+void inbox_print_metrics(FILE *fp);
+
+#endif /* INBOX_H */
@@ -0,0 +1,279 @@
+/*  log.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime, strnlen */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "log.h"
+#include "mem.h"
+
+_Static_assert(sizeof(struct Log_Record) == LOG_RECORD_SIZE, "log record size mismatch");
+_Static_assert(sizeof(struct Log_Header) == 4096, "log header size mismatch");
+
+static struct Log_Header *Log;
+static struct Log_Record *Records;
+static LOG_LEVEL Log_Level = LOG_INFO;
+static uint64_t num_filtered;
+
+static const char *level_names[] = { "debug", "info", "warning", "error" };
+
+static const struct {
+    const char *name;
+    const char *value_label;    /* NULL if the event has no meaningful value */
+} events[NUM_LOG_EVENTS] = {
+    [EV_NONE]                   = { "none",                  NULL       },
+    [EV_CONN_LOST]              = { "connection_lost",       NULL       },
+    [EV_CONN_TCP]               = { "connection_tcp",        NULL       },
+    [EV_CONN_UDP]               = { "connection_udp",        NULL       },
+    [EV_REBOOTSTRAP]            = { "rebootstrap",           "seconds"  },
+    [EV_BOOTSTRAP_FAILED]       = { "bootstrap_failed",      "error"    },
+    [EV_FRIEND_REQUEST_DROPPED] = { "friend_request_dropped", NULL      },
+    [EV_FRIEND_ADD_FAILED]      = { "friend_add_failed",     "error"    },
+    [EV_MASTERKEYS_ERROR]       = { "masterkeys_error",      NULL       },
+    [EV_GROUP_INVITE_ACCEPTED]  = { "group_invite_accepted", NULL       },
+    [EV_GROUP_INVITE_FAILED]    = { "group_invite_failed",   NULL       },
+    [EV_GROUP_CREATED]          = { "group_created",         "password" },
+    [EV_GROUP_CREATE_FAILED]    = { "group_create_failed",   NULL       },
+    [EV_GROUP_LEFT]             = { "group_left",            NULL       },
+    [EV_GROUP_EMPTY_DELETED]    = { "group_empty_deleted",   NULL       },
+    [EV_INVITE_SENT]            = { "invite_sent",           NULL       },
+    [EV_INVITE_FAILED]          = { "invite_failed",         NULL       },
+    [EV_INVITE_BAD_PASSWORD]    = { "invite_bad_password",   NULL       },
+    [EV_GROUP_MESSAGE_SENT]     = { "group_message_sent",    NULL       },
+    [EV_TITLE_SET]              = { "title_set",             NULL       },
+    [EV_TITLE_FAILED]           = { "title_failed",          NULL       },
+    [EV_DEFAULT_GROUP_SET]      = { "default_group_set",     NULL       },
+    [EV_NAME_SET]               = { "name_set",              NULL       },
+    [EV_STATUS_SET]             = { "status_set",            NULL       },
+    [EV_STATUS_MESSAGE_SET]     = { "status_message_set",    NULL       },
+    [EV_PASSWORD_SET]           = { "password_set",          "password" },
+    [EV_PURGE_SET]              = { "purge_set",             "days"     },
+    [EV_MASTER_ADDED]           = { "master_added",          NULL       },
+    [EV_ADMIT_LIMIT_SET]        = { "admit_limit_set",       "limit"    },
+    [EV_LOG_LEVEL_SET]          = { "log_level_set",         "level"    },
+    [EV_SAVE_FAILED]            = { "save_failed",           NULL       },
+    [EV_LOOP_STALL]             = { "loop_stall",            "ms"       },
+    [EV_LOOP_STALL_END]         = { "loop_stall_end",        "ms"       },
+    [EV_LOOP_STALL_FRAME]       = { "loop_stall_frame",      "address"  },
+    [EV_PLAYBACK_STARTED]       = { "playback_started",      "volume"   },
+    [EV_PLAYBACK_STOPPED]       = { "playback_stopped",      "frames"   },
+    [EV_PLAYBACK_TRACK]         = { "playback_track",        "rate"     },
+    [EV_PLAYBACK_BAD_TRACK]     = { "playback_bad_track",    NULL       },
+    [EV_RECORD_STARTED]         = { "record_started",        NULL       },
+    [EV_RECORD_STOPPED]         = { "record_stopped",        "seconds"  },
+    [EV_RECORD_SEGMENT]         = { "record_segment",        NULL       },
+    [EV_RECORD_WRITE_FAILED]    = { "record_write_failed",   "bytes"    },
+    [EV_ARCHIVE_WRITE_FAILED]   = { "archive_write_failed",  NULL       },
+    [EV_BLOCKLIST_LOADED]       = { "blocklist_loaded",      "patterns" },
+    [EV_BLOCKLIST_FAILED]       = { "blocklist_failed",      NULL       },
+    [EV_SPAM_MATCH]             = { "spam_match",            "action"   },
+    [EV_FRIENDS_PURGED]         = { "friends_purged",        "count"    },
+    [EV_BANLIST_LOADED]         = { "banlist_loaded",        "keys"     },
+    [EV_BANLIST_FAILED]         = { "banlist_failed",        NULL       },
+    [EV_BAN_ADDED]              = { "ban_added",             NULL       },
+    [EV_BAN_REMOVED]            = { "ban_removed",           NULL       },
+    [EV_FRIEND_REQUEST_BANNED]  = { "friend_request_banned", NULL       },
+    [EV_POOL_SET]               = { "pool_set",              "max_peers" },
+    [EV_POOL_DELETED]           = { "pool_deleted",          NULL       },
+    [EV_POOL_SHARD_CREATED]     = { "pool_shard_created",    "shard"    },
+    [EV_FRIEND_EVICTED]         = { "friend_evicted",        NULL       },
+    [EV_FRIEND_CAPACITY_SET]    = { "friend_capacity_set",   "capacity" },
+    [EV_BRIDGE_ADDED]           = { "bridge_added",          "to_group" },
+    [EV_BRIDGE_REMOVED]         = { "bridge_removed",        "to_group" },
+};
+
+int log_init(const char *path)
+{
+    size_t map_size = sizeof(struct Log_Header) + LOG_CAPACITY * sizeof(struct Log_Record);
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || (st.st_size != map_size && ftruncate(fd, map_size) == -1)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    mem_mapped(MEM_LOGGING, map_size);
+    struct Log_Header *hdr = map;
+
+    /* Keep the history of a previous run if the layout matches; otherwise start over */
+    if (hdr->magic != LOG_MAGIC || hdr->version != LOG_VERSION || hdr->record_size != LOG_RECORD_SIZE
+            || hdr->capacity != LOG_CAPACITY) {
+        memset(hdr, 0, sizeof(struct Log_Header));
+        memset((char *) map + sizeof(struct Log_Header), 0, LOG_CAPACITY * sizeof(struct Log_Record));
+        hdr->version = LOG_VERSION;
+        hdr->record_size = LOG_RECORD_SIZE;
+        hdr->capacity = LOG_CAPACITY;
+        __atomic_store_n(&hdr->magic, LOG_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    Records = (struct Log_Record *) ((char *) map + sizeof(struct Log_Header));
+    Log = hdr;
+    return 0;
+}
+
+void log_set_level(LOG_LEVEL level)
+{
+    __atomic_store_n(&Log_Level, level, __ATOMIC_RELAXED);
+}
+
+LOG_LEVEL log_get_level(void)
+{
+    return __atomic_load_n(&Log_Level, __ATOMIC_RELAXED);
+}
+
+int log_level_from_str(const char *name)
+{
+    int i;
+
+    for (i = LOG_DEBUG; i <= LOG_ERROR; ++i) {
+        if (strcmp(name, level_names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static void fill_record(struct Log_Record *rec, LOG_LEVEL level, LOG_EVENT event, int32_t friendnum,
+                        int32_t groupnum, int64_t value, const char *payload)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    rec->timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->event = event;
+    rec->level = level;
+    rec->friendnum = friendnum;
+    rec->groupnum = groupnum;
+    rec->value = value;
+    rec->payload_len = 0;
+
+    if (payload) {
+        size_t len = strnlen(payload, sizeof(rec->payload));
+        memcpy(rec->payload, payload, len);
+        rec->payload_len = len;
+    }
+}
+
+void log_event(LOG_LEVEL level, LOG_EVENT event, int32_t friendnum, int32_t groupnum, int64_t value,
+               const char *payload)
+{
+    if (level < log_get_level() && event != EV_LOG_LEVEL_SET) {
+        __atomic_fetch_add(&num_filtered, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (Log == NULL) {
+        struct Log_Record rec;
+        char line[256];
+        fill_record(&rec, level, event, friendnum, groupnum, value, payload);
+        log_format_record(&rec, line, sizeof(line));
+        fprintf(stderr, "%s\n", line);
+        return;
+    }
+
+    uint64_t seq = __atomic_fetch_add(&Log->head, 1, __ATOMIC_ACQ_REL);
+
+    uint64_t tail = __atomic_load_n(&Log->tail, __ATOMIC_ACQUIRE);
+
+    /* overwriting an unread record: push the tail past it so each lost record is counted once */
+    while (seq >= tail + LOG_CAPACITY) {
+        uint64_t new_tail = seq - LOG_CAPACITY + 1;
+
+        if (__atomic_compare_exchange_n(&Log->tail, &tail, new_tail, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&Log->drops, new_tail - tail, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    struct Log_Record *rec = &Records[seq & (LOG_CAPACITY - 1)];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    fill_record(rec, level, event, friendnum, groupnum, value, payload);
+
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void log_format_record(const struct Log_Record *rec, char *buf, size_t size)
+{
+    time_t secs = rec->timestamp / 1000000000ULL;
+    unsigned int msecs = (rec->timestamp % 1000000000ULL) / 1000000;
+    struct tm tm;
+    char timestr[32];
+
+    localtime_r(&secs, &tm);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+
+    const char *level = rec->level <= LOG_ERROR ? level_names[rec->level] : "?";
+    const char *name = rec->event < NUM_LOG_EVENTS && events[rec->event].name ? events[rec->event].name : "unknown";
+
+    int len = snprintf(buf, size, "%s.%03u %-7s %s", timestr, msecs, level, name);
+
+    if (rec->friendnum >= 0 && len < size)
+        len += snprintf(buf + len, size - len, " friend=%"PRId32, rec->friendnum);
+
+    if (rec->groupnum >= 0 && len < size)
+        len += snprintf(buf + len, size - len, " group=%"PRId32, rec->groupnum);
+
+    if (rec->event < NUM_LOG_EVENTS && events[rec->event].value_label && len < size)
+        len += snprintf(buf + len, size - len, " %s=%"PRId64, events[rec->event].value_label, rec->value);
+
+    if (rec->payload_len && len < size) {
+        int plen = MIN(rec->payload_len, sizeof(rec->payload));
+        snprintf(buf + len, size - len, " \"%.*s\"", plen, rec->payload);
+    }
+}
+
+void log_print_metrics(FILE *fp)
+{
+    fprintf(fp, "log_level %d\n", log_get_level());
+    fprintf(fp, "log_filtered %"PRIu64"\n", __atomic_load_n(&num_filtered, __ATOMIC_RELAXED));
+
+    if (Log == NULL)
+        return;
+
+    fprintf(fp, "log_records %"PRIu64"\n", __atomic_load_n(&Log->head, __ATOMIC_RELAXED));
+    fprintf(fp, "log_drops %"PRIu64"\n", __atomic_load_n(&Log->drops, __ATOMIC_RELAXED));
+}
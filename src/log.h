@@ -0,0 +1,154 @@
+/*  log.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOG_CAPACITY 65536       /* number of records in the ring; must be a power of 2 */
+#define LOG_RECORD_SIZE 128
+#define LOG_PAYLOAD_SIZE 88
+#define LOG_MAGIC 0x544f58424f544c47ULL    /* "TOXBOTLG" */
+#define LOG_VERSION 1
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+} LOG_LEVEL;
+
+/* Append new events at the end; the numeric ids are stored in the log file */
+typedef enum {
+    EV_NONE,
+    EV_CONN_LOST,
+    EV_CONN_TCP,
+    EV_CONN_UDP,
+    EV_REBOOTSTRAP,
+    EV_BOOTSTRAP_FAILED,
+    EV_FRIEND_REQUEST_DROPPED,
+    EV_FRIEND_ADD_FAILED,
+    EV_MASTERKEYS_ERROR,
+    EV_GROUP_INVITE_ACCEPTED,
+    EV_GROUP_INVITE_FAILED,
+    EV_GROUP_CREATED,
+    EV_GROUP_CREATE_FAILED,
+    EV_GROUP_LEFT,
+    EV_GROUP_EMPTY_DELETED,
+    EV_INVITE_SENT,
+    EV_INVITE_FAILED,
+    EV_INVITE_BAD_PASSWORD,
+    EV_GROUP_MESSAGE_SENT,
+    EV_TITLE_SET,
+    EV_TITLE_FAILED,
+    EV_DEFAULT_GROUP_SET,
+    EV_NAME_SET,
+    EV_STATUS_SET,
+    EV_STATUS_MESSAGE_SET,
+    EV_PASSWORD_SET,
+    EV_PURGE_SET,
+    EV_MASTER_ADDED,
+    EV_ADMIT_LIMIT_SET,
+    EV_LOG_LEVEL_SET,
+    EV_SAVE_FAILED,
+    EV_LOOP_STALL,
+    EV_LOOP_STALL_END,
+    EV_LOOP_STALL_FRAME,
+    EV_PLAYBACK_STARTED,
+    EV_PLAYBACK_STOPPED,
+    EV_PLAYBACK_TRACK,
+    EV_PLAYBACK_BAD_TRACK,
+    EV_RECORD_STARTED,
+    EV_RECORD_STOPPED,
+    EV_RECORD_SEGMENT,
+    EV_RECORD_WRITE_FAILED,
+    EV_ARCHIVE_WRITE_FAILED,
+    EV_BLOCKLIST_LOADED,
+    EV_BLOCKLIST_FAILED,
+    EV_SPAM_MATCH,
+    EV_FRIENDS_PURGED,
+    EV_BANLIST_LOADED,
+    EV_BANLIST_FAILED,
+    EV_BAN_ADDED,
+    EV_BAN_REMOVED,
+    EV_FRIEND_REQUEST_BANNED,
+    EV_POOL_SET,
+    EV_POOL_DELETED,
+    EV_POOL_SHARD_CREATED,
+    EV_FRIEND_EVICTED,
+    EV_FRIEND_CAPACITY_SET,
+    EV_BRIDGE_ADDED,
+    EV_BRIDGE_REMOVED,
+    NUM_LOG_EVENTS
+} LOG_EVENT;
+
+struct Log_Record {
+    uint64_t seq;          /* sequence number + 1; written last so readers can detect torn records */
+    uint64_t timestamp;    /* nanoseconds since the epoch */
+    uint16_t event;
+    uint8_t level;
+    uint8_t payload_len;
+    int32_t friendnum;     /* -1 if not applicable */
+    int32_t groupnum;      /* -1 if not applicable */
+    uint32_t reserved;
+    int64_t value;
+    char payload[LOG_PAYLOAD_SIZE];
+};
+
+struct Log_Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t head;     /* sequence number of the next record to be written */
+    uint64_t tail;     /* sequence number of the next record a follower will read; only ever moves forward */
+    uint64_t drops;    /* records overwritten before they were read */
+    char reserved[4096 - 48];
+};
+
+/* Maps the ring at path, creating it if necessary. If this fails events are formatted to stderr instead.
+   Returns 0 on success, -1 on failure. */
+int log_init(const char *path);
+
+void log_set_level(LOG_LEVEL level);
+LOG_LEVEL log_get_level(void);
+
+/* Parses a level name (debug, info, warning, error). Returns -1 if name is invalid. */
+int log_level_from_str(const char *name);
+
+/* Records an event. Never blocks: if the ring is full the oldest unread record is overwritten, counted as
+   dropped and the tail moved past it. Events below the current level are filtered, except for level changes
+   which are always recorded. payload may be NULL and is truncated to fit the record. Safe to call from any
+   thread. */
+void log_event(LOG_LEVEL level, LOG_EVENT event, int32_t friendnum, int32_t groupnum, int64_t value,
+               const char *payload);
+
+/* Formats a record as a single line of text (without a trailing newline) */
+void log_format_record(const struct Log_Record *rec, char *buf, size_t size);
+
+/* Writes logging metrics to fp */
+void log_print_metrics(FILE *fp);
+
+#endif /* LOG_H */
@@ -0,0 +1,154 @@
+/*  logread.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Offline reader for the binary event log written by toxbot.
+ *
+ * Usage: toxbot-logread [-f] [logfile]
+ *   -f  follow the log, consuming records as they are written (marks them as read)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "log.h"
+
+#define FOLLOW_INTERVAL 100000    /* usec */
+
+/* Copies record seq into out.
+   Returns 1 on success, 0 if the record is still being written, -1 if it has been overwritten. */
+static int read_record(const struct Log_Record *records, uint64_t seq, struct Log_Record *out)
+{
+    const struct Log_Record *rec = &records[seq & (LOG_CAPACITY - 1)];
+    uint64_t rec_seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+    if (rec_seq != seq + 1)
+        return rec_seq > seq + 1 ? -1 : 0;
+
+    memcpy(out, rec, sizeof(struct Log_Record));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq + 1 ? 1 : -1;
+}
+
+static void print_record(const struct Log_Record *rec)
+{
+    char line[256];
+    log_format_record(rec, line, sizeof(line));
+    printf("%s\n", line);
+}
+
+int main(int argc, char **argv)
+{
+    bool follow = false;
+    const char *path = "toxbot_log";
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-f") == 0)
+            follow = true;
+        else
+            path = argv[i];
+    }
+
+    int fd = open(path, follow ? O_RDWR : O_RDONLY);
+
+    if (fd == -1) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    size_t map_size = sizeof(struct Log_Header) + LOG_CAPACITY * sizeof(struct Log_Record);
+
+    if (file_size(path) != map_size) {
+        fprintf(stderr, "%s: not a toxbot log\n", path);
+        return EXIT_FAILURE;
+    }
+
+    int prot = follow ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(NULL, map_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    struct Log_Header *hdr = map;
+    const struct Log_Record *records = (const struct Log_Record *) ((char *) map + sizeof(struct Log_Header));
+
+    if (hdr->magic != LOG_MAGIC || hdr->version != LOG_VERSION || hdr->capacity != LOG_CAPACITY) {
+        fprintf(stderr, "%s: unsupported log format\n", path);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t seq = head > LOG_CAPACITY ? head - LOG_CAPACITY : 0;
+
+    if (follow)
+        seq = MAX(seq, __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE));
+
+    struct Log_Record rec;
+
+    while (true) {
+        for (; seq < head; ++seq) {
+            int ret = read_record(records, seq, &rec);
+
+            if (ret == 0 && follow)
+                break;
+
+            if (ret == 1)
+                print_record(&rec);
+        }
+
+        if (!follow)
+            break;
+
+        /* the bot moves the tail forward itself when it overwrites unread records */
+        uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+
+        while (tail < seq && !__atomic_compare_exchange_n(&hdr->tail, &tail, seq, false, __ATOMIC_ACQ_REL,
+                                                           __ATOMIC_ACQUIRE))
+            ;
+
+        fflush(stdout);
+        usleep(FOLLOW_INTERVAL);
+
+        head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+        /* we fell behind by more than a full ring; skip what was overwritten */
+        if (head - seq > LOG_CAPACITY)
+            seq = head - LOG_CAPACITY;
+    }
+
+    printf("%"PRIu64" records written, %"PRIu64" dropped\n", head, __atomic_load_n(&hdr->drops, __ATOMIC_RELAXED));
+    return 0;
+}
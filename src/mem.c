@@ -0,0 +1,220 @@
+/*  mem.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include "mem.h"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define HAVE_MALLINFO2
+#endif
+
+const char *mem_tag_names[NUM_MEM_TAGS] = {
+    "groups",
+    "friends",
+    "commands",
+    "persistence",
+    "logging",
+    "caches",
+    "archive",
+    "audio",
+    "spam",
+    "bans",
+};
+
+/* Prepended to every block so that mem_free knows what to credit. Sized to keep
+   the user pointer as aligned as malloc's own. */
+union Mem_Header {
+    struct {
+        size_t size;
+        MEM_TAG tag;
+    } h;
+    long double align;
+};
+
+/* Updated with relaxed atomics; the archive, playback and recorder threads allocate too */
+static struct Mem_Stats Stats[NUM_MEM_TAGS];
+
+static void charge(MEM_TAG tag, size_t size)
+{
+    struct Mem_Stats *s = &Stats[tag];
+    uint64_t live = __atomic_add_fetch(&s->live, size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+
+    while (live > peak && !__atomic_compare_exchange_n(&s->peak, &peak, live, true, __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED))
+        ;
+
+    __atomic_add_fetch(&s->allocs, 1, __ATOMIC_RELAXED);
+}
+
+static void credit(MEM_TAG tag, size_t size)
+{
+    __atomic_sub_fetch(&Stats[tag].live, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Stats[tag].frees, 1, __ATOMIC_RELAXED);
+}
+
+void *mem_alloc(MEM_TAG tag, size_t size)
+{
+    if (size > SIZE_MAX - sizeof(union Mem_Header))
+        return NULL;
+
+    union Mem_Header *hdr = malloc(sizeof(union Mem_Header) + size);
+
+    if (hdr == NULL)
+        return NULL;
+
+    hdr->h.size = size;
+    hdr->h.tag = tag;
+    charge(tag, size);
+
+    return hdr + 1;
+}
+
+void *mem_calloc(MEM_TAG tag, size_t num, size_t size)
+{
+    if (size && num > (SIZE_MAX - sizeof(union Mem_Header)) / size)
+        return NULL;
+
+    union Mem_Header *hdr = calloc(1, sizeof(union Mem_Header) + num * size);
+
+    if (hdr == NULL)
+        return NULL;
+
+    hdr->h.size = num * size;
+    hdr->h.tag = tag;
+    charge(tag, num * size);
+
+    return hdr + 1;
+}
+
+void *mem_realloc(MEM_TAG tag, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return mem_alloc(tag, size);
+
+    if (size > SIZE_MAX - sizeof(union Mem_Header))
+        return NULL;
+
+    union Mem_Header *old = (union Mem_Header *) ptr - 1;
+    size_t old_size = old->h.size;
+    MEM_TAG old_tag = old->h.tag;
+
+    union Mem_Header *hdr = realloc(old, sizeof(union Mem_Header) + size);
+
+    if (hdr == NULL)
+        return NULL;
+
+    credit(old_tag, old_size);
+    hdr->h.size = size;
+    hdr->h.tag = tag;
+    charge(tag, size);
+
+    return hdr + 1;
+}
+
+void mem_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    union Mem_Header *hdr = (union Mem_Header *) ptr - 1;
+    credit(hdr->h.tag, hdr->h.size);
+    free(hdr);
+}
+
+void mem_mapped(MEM_TAG tag, ssize_t delta)
+{
+    __atomic_add_fetch(&Stats[tag].mapped, delta, __ATOMIC_RELAXED);
+}
+
+void mem_get_stats(MEM_TAG tag, struct Mem_Stats *stats)
+{
+    const struct Mem_Stats *s = &Stats[tag];
+
+    stats->live = __atomic_load_n(&s->live, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&s->allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&s->frees, __ATOMIC_RELAXED);
+    stats->mapped = __atomic_load_n(&s->mapped, __ATOMIC_RELAXED);
+}
+
+void mem_get_process(struct Mem_Process *proc)
+{
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    proc->heap_in_use = mi.uordblks + mi.hblkhd;
+    proc->heap_free = mi.fordblks;
+    proc->heap_mmapped = mi.hblkhd;
+#elif defined(__GLIBC__)
+    /* mallinfo's int fields wrap above 2 GiB, which is still good enough to spot trends */
+    struct mallinfo mi = mallinfo();
+    proc->heap_in_use = (unsigned) mi.uordblks + (unsigned) mi.hblkhd;
+    proc->heap_free = (unsigned) mi.fordblks;
+    proc->heap_mmapped = (unsigned) mi.hblkhd;
+#else
+    proc->heap_in_use = proc->heap_free = proc->heap_mmapped = 0;
+#endif
+
+    proc->rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return;
+
+    unsigned long size, resident;
+
+    if (fscanf(fp, "%lu %lu", &size, &resident) == 2)
+        proc->rss = (uint64_t) resident * sysconf(_SC_PAGESIZE);
+
+    fclose(fp);
+}
+
+void mem_print_metrics(FILE *fp, size_t savedata_size)
+{
+    int i;
+
+    for (i = 0; i < NUM_MEM_TAGS; ++i) {
+        struct Mem_Stats s;
+        mem_get_stats(i, &s);
+
+        fprintf(fp, "mem_live_bytes{subsystem=\"%s\"} %"PRIu64"\n", mem_tag_names[i], s.live);
+        fprintf(fp, "mem_peak_bytes{subsystem=\"%s\"} %"PRIu64"\n", mem_tag_names[i], s.peak);
+        fprintf(fp, "mem_allocs{subsystem=\"%s\"} %"PRIu64"\n", mem_tag_names[i], s.allocs);
+        fprintf(fp, "mem_frees{subsystem=\"%s\"} %"PRIu64"\n", mem_tag_names[i], s.frees);
+        fprintf(fp, "mem_mapped_bytes{subsystem=\"%s\"} %"PRIu64"\n", mem_tag_names[i], s.mapped);
+    }
+
+    struct Mem_Process proc;
+    mem_get_process(&proc);
+
+    fprintf(fp, "mem_heap_in_use_bytes %"PRIu64"\n", proc.heap_in_use);
+    fprintf(fp, "mem_heap_free_bytes %"PRIu64"\n", proc.heap_free);
+    fprintf(fp, "mem_heap_mmapped_bytes %"PRIu64"\n", proc.heap_mmapped);
+    fprintf(fp, "mem_rss_bytes %"PRIu64"\n", proc.rss);
+    fprintf(fp, "mem_savedata_bytes %zu\n", savedata_size);
+}
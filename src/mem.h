@@ -0,0 +1,82 @@
+/*  mem.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Subsystems that heap allocations and memory mappings are charged to */
+typedef enum {
+    MEM_GROUPS,         /* groupchat list and peer bitmaps */
+    MEM_FRIENDS,        /* per-friend registry */
+    MEM_COMMANDS,       /* command arena overflow */
+    MEM_PERSISTENCE,    /* savedata buffers */
+    MEM_LOGGING,        /* event log ring */
+    MEM_CACHES,         /* rebuildable indexes (archive postings and sparse index) */
+    MEM_ARCHIVE,        /* archive groups and segments */
+    MEM_AUDIO,          /* playback and recording buffers */
+    MEM_SPAM,           /* spam filter automaton */
+    MEM_BANS,           /* ban list keys and Bloom filter */
+    NUM_MEM_TAGS
+} MEM_TAG;
+
+extern const char *mem_tag_names[NUM_MEM_TAGS];
+
+struct Mem_Stats {
+    uint64_t live;      /* bytes currently allocated */
+    uint64_t peak;      /* highest value of live */
+    uint64_t allocs;    /* number of successful allocations, including reallocations */
+    uint64_t frees;
+    uint64_t mapped;    /* bytes currently mapped with mmap */
+};
+
+/* Allocator-wide numbers from mallinfo2 and /proc/self/statm. Fields are 0 where unavailable. */
+struct Mem_Process {
+    uint64_t heap_in_use;    /* bytes handed out by malloc */
+    uint64_t heap_free;      /* bytes held by malloc but not in use */
+    uint64_t heap_mmapped;   /* bytes in chunks malloc got directly from mmap */
+    uint64_t rss;
+};
+
+/* Allocation wrappers with the semantics of malloc, calloc, realloc and free that charge
+   the memory to tag. Memory from these must only be released with mem_free or mem_realloc.
+   Safe to call from any thread. */
+void *mem_alloc(MEM_TAG tag, size_t size);
+void *mem_calloc(MEM_TAG tag, size_t num, size_t size);
+void *mem_realloc(MEM_TAG tag, void *ptr, size_t size);
+void mem_free(void *ptr);
+
+/* Charges (or with a negative delta, credits) size bytes of memory mapped by the caller to tag */
+void mem_mapped(MEM_TAG tag, ssize_t delta);
+
+void mem_get_stats(MEM_TAG tag, struct Mem_Stats *stats);
+void mem_get_process(struct Mem_Process *proc);
+
+/* Writes memory metrics to fp. savedata_size is the current size of the toxcore savedata. */
+void mem_print_metrics(FILE *fp, size_t savedata_size);
+
+#endif /* MEM_H */
@@ -0,0 +1,101 @@
+/*  metrics.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "groupchats.h"
+#include "connection.h"
+#include "arena.h"
+#include "friendreq.h"
+#include "log.h"
+#include "watchdog.h"
+#include "savefile.h"
+#include "playback.h"
+#include "recorder.h"
+#include "archive.h"
+#include "spam.h"
+#include "friends.h"
+#include "mem.h"
+#include "tasks.h"
+#include "timers.h"
+#include "bans.h"
+#include "pools.h"
+#include "events.h"
+#include "inbox.h"
+#include "bridges.h"
+#include "metrics.h"
+
+extern struct Tox_Bot Tox_Bot;
+
+static void print_bot_metrics(FILE *fp, Tox *m, uint64_t cur_time)
+{
+    fprintf(fp, "uptime_seconds %"PRIu64"\n", cur_time - Tox_Bot.start_time);
+    fprintf(fp, "friends %zu\n", tox_self_get_friend_list_size(m));
+    fprintf(fp, "friends_online %d\n", Tox_Bot.num_online_friends);
+    fprintf(fp, "groups %u\n", tox_count_chatlist(m));
+}
+
+int metrics_write(Tox *m, const char *path, uint64_t cur_time)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+
+    if (fp == NULL)
+        return -1;
+
+    print_bot_metrics(fp, m, cur_time);
+    conn_print_metrics(fp, cur_time);
+    arena_print_metrics(fp);
+    group_print_metrics(fp, cur_time);
+    friends_print_metrics(fp, cur_time);
+    friendreq_print_metrics(fp);
+    log_print_metrics(fp);
+    watchdog_print_metrics(fp);
+    savefile_print_metrics(fp, cur_time - Tox_Bot.start_time);
+    playback_print_metrics(fp);
+    recorder_print_metrics(fp);
+    archive_print_metrics(fp);
+    spam_print_metrics(fp);
+    mem_print_metrics(fp, tox_get_savedata_size(m));
+    tasks_print_metrics(fp);
+    timers_print_metrics(fp);
+    bans_print_metrics(fp);
+    pools_print_metrics(fp);
+    events_print_metrics(fp);
+    inbox_print_metrics(fp);
+    bridges_print_metrics(fp);
+
+    if (fclose(fp) != 0)
+        return -1;
+
+    return rename(tmp_path, path);
+}
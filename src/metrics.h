@@ -0,0 +1,36 @@
+/*  metrics.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define METRICS_INTERVAL 60
+
+/* Writes a snapshot of the bot's metrics to path in "name value" text format, one metric per line.
+   The file is replaced atomically so readers never see a partial snapshot.
+   Returns 0 on success, -1 on failure. */
+int metrics_write(Tox *m, const char *path, uint64_t cur_time);
+
+#endif /* METRICS_H */
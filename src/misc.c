@@ -36,20 +36,19 @@ bool timed_out(uint64_t timestamp, uint64_t curtime, uint64_t timeout)
     return timestamp + timeout <= curtime;
 }
 
-char *hex_string_to_bin(const char *hex_string)
+int hex_string_to_bin(const char *hex_string, size_t hex_len, char *output, size_t output_size)
 {
-    size_t len = strlen(hex_string);
-    char *val = malloc(len);
-
-    if (val == NULL)
-        exit(EXIT_FAILURE);
+    if (hex_len % 2 != 0 || hex_len / 2 > output_size)
+        return -1;
 
     size_t i;
 
-    for (i = 0; i < len; ++i, hex_string += 2)
-        sscanf(hex_string, "%2hhx", &val[i]);
+    for (i = 0; i < hex_len / 2; ++i, hex_string += 2) {
+        if (sscanf(hex_string, "%2hhx", &output[i]) != 1)
+            return -1;
+    }
 
-    return val;
+    return 0;
 }
 
 bool file_exists(const char *path)
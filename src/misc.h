@@ -33,8 +33,9 @@
 
 bool timed_out(uint64_t timestamp, uint64_t curtime, uint64_t timeout);
 
-/* converts hexidecimal string to binary */
-char *hex_string_to_bin(const char *hex_string);
+/* converts the first hex_len characters of a hexidecimal string to binary and puts the result in output.
+   Returns 0 on success, -1 if hex_len is odd, output is too small or the string contains invalid characters */
+int hex_string_to_bin(const char *hex_string, size_t hex_len, char *output, size_t output_size);
 
 /* checks if a file exists. Returns true or false */
 bool file_exists(const char *path);
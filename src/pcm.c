@@ -0,0 +1,286 @@
+/*  pcm.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pcm.h"
+
+void pcm_s16_to_float(const int16_t *in, float *out, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (in + i));
+        /* sign-extend to 32 bits by placing each sample in the high half and shifting down */
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(out + i, _mm_cvtepi32_ps(lo));
+        _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(hi));
+    }
+#endif
+
+    for (; i < n; ++i)
+        out[i] = in[i];
+}
+
+static inline int16_t clamp_s16(float x)
+{
+    if (x > 32767.0f)
+        return 32767;
+
+    if (x < -32768.0f)
+        return -32768;
+
+    return (int16_t) (x < 0 ? x - 0.5f : x + 0.5f);
+}
+
+void pcm_float_to_s16(const float *in, int16_t *out, size_t n, float gain)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128 g = _mm_set1_ps(gain);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+
+    for (; i + 8 <= n; i += 8) {
+        /* clamp before converting; out of range values would convert to INT32_MIN */
+        __m128 a = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i), g), max), min);
+        __m128 b = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), g), max), min);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128((__m128i *) (out + i), packed);
+    }
+#endif
+
+    for (; i < n; ++i)
+        out[i] = clamp_s16(in[i] * gain);
+}
+
+void pcm_mix_s16(const int16_t *in, int16_t *out, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (out + i));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_adds_epi16(a, b));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        int32_t x = (int32_t) in[i] + out[i];
+        out[i] = x > INT16_MAX ? INT16_MAX : x < INT16_MIN ? INT16_MIN : x;
+    }
+}
+
+void pcm_resampler_init(struct Resampler *rs, uint32_t in_rate)
+{
+    rs->step = (double) in_rate / PCM_RATE;
+    rs->pos = 0;
+}
+
+/* out[i] = a[i] + (b[i] - a[i]) * t[i] for n <= 4 samples */
+static inline void lerp4(const float *a, const float *b, const float *t, float *out, int n)
+{
+#ifdef __SSE2__
+    if (n == 4) {
+        __m128 va = _mm_loadu_ps(a);
+        __m128 vb = _mm_loadu_ps(b);
+        __m128 vt = _mm_loadu_ps(t);
+        _mm_storeu_ps(out, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vt)));
+        return;
+    }
+#endif
+
+    int i;
+
+    for (i = 0; i < n; ++i)
+        out[i] = a[i] + (b[i] - a[i]) * t[i];
+}
+
+size_t pcm_resample(struct Resampler *rs, const float *in, size_t in_frames, float *out, size_t out_frames,
+                    int channels)
+{
+    size_t n = 0;
+
+    if (rs->step == 1.0) {
+        size_t idx = (size_t) rs->pos;
+
+        if (idx >= in_frames)
+            return 0;
+
+        n = in_frames - idx < out_frames ? in_frames - idx : out_frames;
+        memcpy(out, in + idx * channels, n * channels * sizeof(float));
+        rs->pos += n;
+        return n;
+    }
+
+    /* gather samples four at a time and interpolate them in one go */
+    while (n < out_frames) {
+        float a[4], b[4], t[4];
+        int k = 0;
+        int c;
+
+        while (k + channels <= 4 && n < out_frames) {
+            size_t idx = (size_t) rs->pos;
+
+            if (idx + 1 >= in_frames)
+                break;
+
+            float frac = rs->pos - idx;
+
+            for (c = 0; c < channels; ++c, ++k) {
+                a[k] = in[idx * channels + c];
+                b[k] = in[(idx + 1) * channels + c];
+                t[k] = frac;
+            }
+
+            rs->pos += rs->step;
+            ++n;
+        }
+
+        if (k == 0)
+            break;
+
+        lerp4(a, b, t, out + n * channels - k, k);
+    }
+
+    return n;
+}
+
+size_t pcm_resampler_consumed(struct Resampler *rs, size_t in_frames)
+{
+    size_t idx = (size_t) rs->pos;
+
+    if (idx > in_frames)
+        idx = in_frames;
+
+    rs->pos -= idx;
+    return idx;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static void put_le16(uint8_t *p, uint16_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+}
+
+int wav_read_header(FILE *fp, struct Wav_Format *fmt)
+{
+    uint8_t riff[12];
+
+    if (fread(riff, sizeof(riff), 1, fp) != 1)
+        return -1;
+
+    if (memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0)
+        return -1;
+
+    bool have_fmt = false;
+    uint8_t chunk[8];
+
+    while (fread(chunk, sizeof(chunk), 1, fp) == 1) {
+        uint32_t len = get_le32(chunk + 4);
+
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            uint8_t f[16];
+
+            if (len < sizeof(f) || fread(f, sizeof(f), 1, fp) != 1)
+                return -1;
+
+            uint16_t format = get_le16(f);
+            fmt->channels = get_le16(f + 2);
+            fmt->sample_rate = get_le32(f + 4);
+            uint16_t bits = get_le16(f + 14);
+
+            /* 0xFFFE is WAVE_FORMAT_EXTENSIBLE, which we accept as long as the samples are 16-bit */
+            if ((format != 1 && format != 0xFFFE) || bits != 16)
+                return -1;
+
+            if (fmt->channels < 1 || fmt->channels > PCM_MAX_CHANNELS || fmt->sample_rate == 0)
+                return -1;
+
+            len -= sizeof(f);
+            have_fmt = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt)
+                return -1;
+
+            fmt->data_len = len;
+            return 0;
+        }
+
+        /* chunks are padded to an even length */
+        if (fseek(fp, len + (len & 1), SEEK_CUR) != 0)
+            return -1;
+    }
+
+    return -1;
+}
+
+int wav_write_header(FILE *fp, const struct Wav_Format *fmt)
+{
+    uint8_t h[44];
+    uint16_t block_align = fmt->channels * sizeof(int16_t);
+
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, 36 + fmt->data_len);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, 1);
+    put_le16(h + 22, fmt->channels);
+    put_le32(h + 24, fmt->sample_rate);
+    put_le32(h + 28, fmt->sample_rate * block_align);
+    put_le16(h + 32, block_align);
+    put_le16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, fmt->data_len);
+
+    return fwrite(h, sizeof(h), 1, fp) == 1 ? 0 : -1;
+}
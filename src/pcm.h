@@ -0,0 +1,76 @@
+/*  pcm.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PCM_H
+#define PCM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PCM_RATE 48000           /* sample rate of all audio we send and record */
+#define PCM_FRAME_MS 20
+#define PCM_FRAME_SIZE (PCM_RATE / 1000 * PCM_FRAME_MS)    /* samples per channel in one frame */
+#define PCM_MAX_CHANNELS 2
+
+struct Wav_Format {
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t data_len;    /* bytes of sample data following the header */
+};
+
+/* Linear interpolation resampler state for one stream */
+struct Resampler {
+    double step;    /* input frames per output frame */
+    double pos;     /* position of the next output frame in the input buffer */
+};
+
+/* Converts n 16-bit samples to floats. */
+void pcm_s16_to_float(const int16_t *in, float *out, size_t n);
+
+/* Scales n float samples by gain and converts them to 16-bit samples, saturating on overflow. */
+void pcm_float_to_s16(const float *in, int16_t *out, size_t n, float gain);
+
+/* Adds n samples of in to out, saturating on overflow. */
+void pcm_mix_s16(const int16_t *in, int16_t *out, size_t n);
+
+/* Sets up rs to convert from in_rate to PCM_RATE. */
+void pcm_resampler_init(struct Resampler *rs, uint32_t in_rate);
+
+/* Produces up to out_frames frames of interleaved output from in_frames frames of interleaved input.
+   Returns the number of frames produced; stops early when it runs out of input. The caller must then
+   discard the first pcm_resampler_consumed() input frames and append more input. */
+size_t pcm_resample(struct Resampler *rs, const float *in, size_t in_frames, float *out, size_t out_frames,
+                    int channels);
+
+/* Returns the number of leading frames of an in_frames long input buffer that are no longer needed,
+   and rebases rs past them. */
+size_t pcm_resampler_consumed(struct Resampler *rs, size_t in_frames);
+
+/* Reads a RIFF WAVE header from fp and leaves fp at the start of the sample data.
+   Only 16-bit PCM with 1 or 2 channels is supported. Returns 0 on success, -1 on failure. */
+int wav_read_header(FILE *fp, struct Wav_Format *fmt);
+
+/* Writes a 16-bit PCM WAVE header to fp. */
+int wav_write_header(FILE *fp, const struct Wav_Format *fmt);
+
+#endif /* PCM_H */
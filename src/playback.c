@@ -0,0 +1,540 @@
+/*  playback.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime, nanosleep */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
+
+#include "pcm.h"
+#include "log.h"
+#include "playback.h"
+#include "mem.h"
+
+#define PLAYBACK_IN_FRAMES 4096    /* input frames buffered ahead of the resampler */
+#define PLAYBACK_PATH_SIZE 512
+
+typedef enum {
+    STREAM_FREE,
+    STREAM_PLAYING,     /* the decoder thread owns the files and fills the ring */
+    STREAM_FINISHED,    /* the decoder reached the end; the main thread drains the ring and frees the slot */
+    STREAM_STOPPING,    /* stopped early; the decoder thread closes the files and frees the slot */
+} STREAM_STATE;
+
+struct Playback_Frame {
+    uint8_t channels;
+    int16_t pcm[PCM_FRAME_SIZE * PCM_MAX_CHANNELS];
+};
+
+struct Stream_Buffers {
+    struct Playback_Frame ring[PLAYBACK_RING_FRAMES];
+    float in[PLAYBACK_IN_FRAMES * PCM_MAX_CHANNELS];
+};
+
+struct Stream {
+    int state;    /* STREAM_STATE; accessed atomically */
+
+    /* single producer single consumer ring: the decoder thread advances head, the main thread tail */
+    uint32_t head;
+    uint32_t tail;
+    struct Stream_Buffers *buf;    /* allocated on first use and kept for reuse */
+
+    /* owned by the main thread */
+    int groupnum;
+    uint64_t next_send;    /* ms timestamp at which the next frame is due */
+    uint64_t frames_sent;
+
+    /* owned by whoever owns the stream according to state */
+    float gain;
+    FILE *playlist;
+    char dir[PLAYBACK_PATH_SIZE];    /* directory of the playlist, for relative paths */
+    FILE *track;
+    uint64_t track_left;             /* bytes of sample data left in the track */
+    bool track_ended;
+    int channels;
+    size_t in_frames;
+    struct Resampler rs;
+};
+
+static struct {
+    struct Stream streams[PLAYBACK_MAX_STREAMS];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+    bool quit;             /* protected by lock */
+    int num_streams;       /* slots that aren't free; protected by lock */
+
+    /* updated by the decoder thread */
+    uint64_t frames_decoded;
+    uint64_t decoder_cpu_ns;
+
+    uint64_t frames_sent;
+    uint64_t frames_skipped;
+    uint64_t underruns;
+    uint64_t send_errors;
+} Playback = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void)
+{
+    return clock_ns(CLOCK_MONOTONIC) / 1000000;
+}
+
+static bool has_suffix(const char *s, const char *suffix)
+{
+    size_t len = strlen(s);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+static void close_stream_files(struct Stream *s)
+{
+    if (s->track)
+        fclose(s->track);
+
+    if (s->playlist)
+        fclose(s->playlist);
+
+    s->track = NULL;
+    s->playlist = NULL;
+}
+
+/* Returns a slot to the free pool. The caller must own the stream. */
+static void free_stream(struct Stream *s)
+{
+    close_stream_files(s);
+    __atomic_store_n(&s->state, STREAM_FREE, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&Playback.lock);
+    --Playback.num_streams;
+    pthread_mutex_unlock(&Playback.lock);
+}
+
+static int open_track(struct Stream *s, const char *path)
+{
+    struct Wav_Format fmt;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return -1;
+
+    if (wav_read_header(fp, &fmt) == -1) {
+        fclose(fp);
+        return -1;
+    }
+
+    if (s->track)
+        fclose(s->track);
+
+    s->track = fp;
+    /* streamed WAV files may leave the length unset; play those until EOF */
+    s->track_left = fmt.data_len && fmt.data_len != UINT32_MAX ? fmt.data_len : UINT64_MAX;
+    s->track_ended = false;
+    s->channels = fmt.channels;
+    s->in_frames = 0;
+    pcm_resampler_init(&s->rs, fmt.sample_rate);
+
+    log_event(LOG_DEBUG, EV_PLAYBACK_TRACK, -1, s->groupnum, fmt.sample_rate, path);
+    return 0;
+}
+
+/* Opens the next playable track of the playlist. Returns 0 on success, -1 if there is none left. */
+static int next_track(struct Stream *s)
+{
+    if (s->playlist == NULL)
+        return -1;
+
+    char line[PLAYBACK_PATH_SIZE];
+
+    while (fgets(line, sizeof(line), s->playlist)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        char path[PLAYBACK_PATH_SIZE * 2];
+
+        if (line[0] == '/' || s->dir[0] == '\0')
+            snprintf(path, sizeof(path), "%s", line);
+        else
+            snprintf(path, sizeof(path), "%s/%s", s->dir, line);
+
+        if (open_track(s, path) == 0)
+            return 0;
+
+        log_event(LOG_WARNING, EV_PLAYBACK_BAD_TRACK, -1, s->groupnum, 0, path);
+    }
+
+    return -1;
+}
+
+/* Discards input the resampler is done with and reads more from the track.
+   Returns the number of frames read, or 0 at the end of the track. */
+static size_t refill(struct Stream *s)
+{
+    int ch = s->channels;
+    float *in = s->buf->in;
+    size_t used = pcm_resampler_consumed(&s->rs, s->in_frames);
+
+    memmove(in, in + used * ch, (s->in_frames - used) * ch * sizeof(float));
+    s->in_frames -= used;
+
+    size_t frame_size = ch * sizeof(int16_t);
+    size_t want = PLAYBACK_IN_FRAMES - s->in_frames;
+
+    if (want > s->track_left / frame_size)
+        want = s->track_left / frame_size;
+
+    int16_t raw[PLAYBACK_IN_FRAMES * PCM_MAX_CHANNELS];
+    size_t got = fread(raw, frame_size, want, s->track);
+
+    pcm_s16_to_float(raw, in + s->in_frames * ch, got * ch);
+    s->in_frames += got;
+    s->track_left -= got * frame_size;
+    return got;
+}
+
+static void decode_frame(struct Stream *s, struct Playback_Frame *f)
+{
+    float out[PCM_FRAME_SIZE * PCM_MAX_CHANNELS];
+    int ch = s->channels;
+    size_t n = 0;
+
+    while (n < PCM_FRAME_SIZE) {
+        n += pcm_resample(&s->rs, s->buf->in, s->in_frames, out + n * ch, PCM_FRAME_SIZE - n, ch);
+
+        if (n < PCM_FRAME_SIZE && refill(s) == 0) {
+            /* end of the track; pad the frame with silence */
+            memset(out + n * ch, 0, (PCM_FRAME_SIZE - n) * ch * sizeof(float));
+            s->track_ended = true;
+            break;
+        }
+    }
+
+    pcm_float_to_s16(out, f->pcm, PCM_FRAME_SIZE * ch, s->gain);
+    f->channels = ch;
+}
+
+/* Decodes frames until the ring of s is full or the stream has ended */
+static void fill_ring(struct Stream *s)
+{
+    uint32_t head = s->head;
+
+    while (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) < PLAYBACK_RING_FRAMES) {
+        if (s->track_ended && next_track(s) == -1) {
+            int expected = STREAM_PLAYING;
+            /* fails if the main thread stopped us meanwhile, in which case we'll clean up on the next pass */
+            __atomic_compare_exchange_n(&s->state, &expected, STREAM_FINISHED, false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED);
+            return;
+        }
+
+        decode_frame(s, &s->buf->ring[head % PLAYBACK_RING_FRAMES]);
+        __atomic_store_n(&s->head, ++head, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&Playback.frames_decoded, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *decoder_thread(void *arg)
+{
+    pthread_mutex_lock(&Playback.lock);
+
+    while (!Playback.quit) {
+        if (Playback.num_streams == 0) {
+            pthread_cond_wait(&Playback.cond, &Playback.lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&Playback.lock);
+
+        int i;
+
+        for (i = 0; i < PLAYBACK_MAX_STREAMS; ++i) {
+            struct Stream *s = &Playback.streams[i];
+            int state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+
+            if (state == STREAM_STOPPING)
+                free_stream(s);
+            else if (state == STREAM_PLAYING)
+                fill_ring(s);
+        }
+
+        __atomic_store_n(&Playback.decoder_cpu_ns, clock_ns(CLOCK_THREAD_CPUTIME_ID), __ATOMIC_RELAXED);
+
+        /* rings hold several frames, so waking up once per frame keeps them topped up */
+        struct timespec ts = { 0, PCM_FRAME_MS * 1000000L };
+        nanosleep(&ts, NULL);
+
+        pthread_mutex_lock(&Playback.lock);
+    }
+
+    pthread_mutex_unlock(&Playback.lock);
+    return NULL;
+}
+
+int playback_init(void)
+{
+    if (pthread_create(&Playback.thread, NULL, decoder_thread, NULL) != 0)
+        return -1;
+
+    Playback.running = true;
+    return 0;
+}
+
+void playback_close(void)
+{
+    if (!Playback.running)
+        return;
+
+    pthread_mutex_lock(&Playback.lock);
+    Playback.quit = true;
+    pthread_cond_signal(&Playback.cond);
+    pthread_mutex_unlock(&Playback.lock);
+
+    pthread_join(Playback.thread, NULL);
+    Playback.running = false;
+
+    int i;
+
+    for (i = 0; i < PLAYBACK_MAX_STREAMS; ++i) {
+        struct Stream *s = &Playback.streams[i];
+
+        if (s->state != STREAM_FREE)
+            free_stream(s);
+
+        mem_free(s->buf);
+        s->buf = NULL;
+    }
+}
+
+static struct Stream *find_stream(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < PLAYBACK_MAX_STREAMS; ++i) {
+        struct Stream *s = &Playback.streams[i];
+        int state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+
+        if ((state == STREAM_PLAYING || state == STREAM_FINISHED) && s->groupnum == groupnum)
+            return s;
+    }
+
+    return NULL;
+}
+
+PLAYBACK_ERROR playback_start(int groupnum, const char *path, int volume)
+{
+    if (!Playback.running)
+        return PLAYBACK_ERR_THREAD;
+
+    if (find_stream(groupnum))
+        return PLAYBACK_ERR_BUSY;
+
+    struct Stream *s = NULL;
+    int i;
+
+    for (i = 0; i < PLAYBACK_MAX_STREAMS; ++i) {
+        if (__atomic_load_n(&Playback.streams[i].state, __ATOMIC_ACQUIRE) == STREAM_FREE) {
+            s = &Playback.streams[i];
+            break;
+        }
+    }
+
+    if (s == NULL)
+        return PLAYBACK_ERR_FULL;
+
+    if (s->buf == NULL) {
+        s->buf = mem_alloc(MEM_AUDIO, sizeof(struct Stream_Buffers));
+
+        if (s->buf == NULL)
+            return PLAYBACK_ERR_FULL;
+    }
+
+    s->groupnum = groupnum;
+    s->dir[0] = '\0';
+
+    if (has_suffix(path, ".m3u")) {
+        s->playlist = fopen(path, "r");
+
+        if (s->playlist == NULL)
+            return PLAYBACK_ERR_OPEN;
+
+        const char *slash = strrchr(path, '/');
+
+        if (slash)
+            snprintf(s->dir, sizeof(s->dir), "%.*s", (int) (slash - path), path);
+
+        if (next_track(s) == -1) {
+            close_stream_files(s);
+            return PLAYBACK_ERR_FORMAT;
+        }
+    } else {
+        FILE *fp = fopen(path, "rb");
+
+        if (fp == NULL)
+            return PLAYBACK_ERR_OPEN;
+
+        fclose(fp);
+
+        if (open_track(s, path) == -1)
+            return PLAYBACK_ERR_FORMAT;
+    }
+
+    s->gain = volume / 100.0f;
+    s->head = 0;
+    s->tail = 0;
+    s->frames_sent = 0;
+    s->next_send = now_ms() + PCM_FRAME_MS;    /* give the decoder a head start */
+
+    /* hand the stream to the decoder thread */
+    pthread_mutex_lock(&Playback.lock);
+    ++Playback.num_streams;
+    __atomic_store_n(&s->state, STREAM_PLAYING, __ATOMIC_RELEASE);
+    pthread_cond_signal(&Playback.cond);
+    pthread_mutex_unlock(&Playback.lock);
+
+    log_event(LOG_INFO, EV_PLAYBACK_STARTED, -1, groupnum, volume, path);
+    return PLAYBACK_OK;
+}
+
+bool playback_stop(int groupnum)
+{
+    struct Stream *s = find_stream(groupnum);
+
+    if (s == NULL)
+        return false;
+
+    log_event(LOG_INFO, EV_PLAYBACK_STOPPED, -1, groupnum, s->frames_sent, NULL);
+
+    int expected = STREAM_PLAYING;
+
+    /* if the decoder already finished the stream it's ours to free */
+    if (!__atomic_compare_exchange_n(&s->state, &expected, STREAM_STOPPING, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+        free_stream(s);
+
+    return true;
+}
+
+int playback_do(Tox *m)
+{
+    uint64_t now = now_ms();
+    int wait = -1;
+    int i;
+
+    for (i = 0; i < PLAYBACK_MAX_STREAMS; ++i) {
+        struct Stream *s = &Playback.streams[i];
+        int state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+
+        if (state != STREAM_PLAYING && state != STREAM_FINISHED)
+            continue;
+
+        /* after a long stall don't burst out everything we missed */
+        if (now > s->next_send + PLAYBACK_MAX_LAG) {
+            Playback.frames_skipped += (now - s->next_send) / PCM_FRAME_MS;
+            s->next_send = now;
+        }
+
+        bool done = false;
+
+        while (s->next_send <= now) {
+            uint32_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+
+            if (head != s->tail) {
+                struct Playback_Frame *f = &s->buf->ring[s->tail % PLAYBACK_RING_FRAMES];
+
+                if (toxav_group_send_audio(m, s->groupnum, f->pcm, PCM_FRAME_SIZE, f->channels, PCM_RATE) != 0)
+                    ++Playback.send_errors;
+
+                __atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELEASE);
+                ++s->frames_sent;
+                ++Playback.frames_sent;
+            } else if (state == STREAM_FINISHED) {
+                log_event(LOG_INFO, EV_PLAYBACK_STOPPED, -1, s->groupnum, s->frames_sent, NULL);
+                free_stream(s);
+                done = true;
+                break;
+            } else {
+                ++Playback.underruns;
+            }
+
+            s->next_send += PCM_FRAME_MS;
+        }
+
+        if (done)
+            continue;
+
+        int until = s->next_send - now;
+
+        if (wait == -1 || until < wait)
+            wait = until;
+    }
+
+    return wait;
+}
+
+void playback_print_metrics(FILE *fp)
+{
+    int streams = 0;
+    int i;
+
+    for (i = 0; i < PLAYBACK_MAX_STREAMS; ++i) {
+        int state = __atomic_load_n(&Playback.streams[i].state, __ATOMIC_ACQUIRE);
+
+        if (state == STREAM_PLAYING || state == STREAM_FINISHED)
+            ++streams;
+    }
+
+    uint64_t decoded = __atomic_load_n(&Playback.frames_decoded, __ATOMIC_RELAXED);
+    uint64_t cpu_ns = __atomic_load_n(&Playback.decoder_cpu_ns, __ATOMIC_RELAXED);
+
+    fprintf(fp, "playback_streams %d\n", streams);
+    fprintf(fp, "playback_frames_decoded %" PRIu64 "\n", decoded);
+    fprintf(fp, "playback_frames_sent %" PRIu64 "\n", Playback.frames_sent);
+    fprintf(fp, "playback_underruns %" PRIu64 "\n", Playback.underruns);
+    fprintf(fp, "playback_frames_skipped %" PRIu64 "\n", Playback.frames_skipped);
+    fprintf(fp, "playback_send_errors %" PRIu64 "\n", Playback.send_errors);
+    fprintf(fp, "playback_decoder_cpu_seconds %.3f\n", cpu_ns / 1e9);
+
+    /* fraction of one core the decoder needs to keep a single stream playing in real time */
+    if (decoded)
+        fprintf(fp, "playback_decoder_load_per_stream %.6f\n", (double) cpu_ns / (decoded * PCM_FRAME_MS * 1e6));
+}
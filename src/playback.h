@@ -0,0 +1,66 @@
+/*  playback.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <tox/tox.h>
+
+#define PLAYBACK_MAX_STREAMS 64
+#define PLAYBACK_RING_FRAMES 16     /* decoded frames buffered per stream; must be a power of 2 */
+#define PLAYBACK_MAX_LAG 100        /* ms we may fall behind schedule before skipping ahead */
+#define PLAYBACK_MAX_VOLUME 200     /* percent */
+
+typedef enum {
+    PLAYBACK_OK,
+    PLAYBACK_ERR_BUSY,       /* something is already playing in the group */
+    PLAYBACK_ERR_FULL,       /* PLAYBACK_MAX_STREAMS are playing */
+    PLAYBACK_ERR_OPEN,       /* file could not be opened */
+    PLAYBACK_ERR_FORMAT,     /* file is not a supported WAV file or a playlist without any */
+    PLAYBACK_ERR_THREAD,     /* decoder thread isn't running */
+} PLAYBACK_ERROR;
+
+/* Starts the decoder thread. Returns 0 on success, -1 on failure. */
+int playback_init(void);
+
+/* Stops all streams and the decoder thread. */
+void playback_close(void);
+
+/* Starts streaming path into groupnum at volume percent. Files ending in .m3u are read as playlists with one
+   WAV file per line; anything else must be a 16-bit PCM WAV file. */
+PLAYBACK_ERROR playback_start(int groupnum, const char *path, int volume);
+
+/* Stops the stream playing in groupnum, if any. Returns true if there was one. */
+bool playback_stop(int groupnum);
+
+/* Sends every frame that is due. Returns the number of ms until the next frame is due, or -1 if nothing
+   is playing. Call at least every PCM_FRAME_MS ms while streams are active. */
+int playback_do(Tox *m);
+
+/* Writes playback metrics to fp */
+void playback_print_metrics(FILE *fp);
+
+#endif /* PLAYBACK_H */
@@ -0,0 +1,341 @@
+/*  pools.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "misc.h"
+#include "groupchats.h"
+#include "commands.h"
+#include "log.h"
+#include "pools.h"
+
+extern struct Tox_Bot Tox_Bot;
+
+struct Pool {
+    char name[POOL_NAME_LENGTH];    /* empty if the slot is unused */
+    int max_peers;                  /* peers other than ourselves */
+    uint32_t next_shard;            /* number given to the next shard's title */
+    uint64_t last_shard;            /* timer_now() when a shard was last created */
+
+    uint64_t invites;
+    uint64_t shards_created;
+    uint64_t full;                  /* invites refused because every group was full */
+    uint64_t throttled;             /* shards not created because one was created too recently */
+};
+
+static struct Pool Pools[POOL_MAX];
+static const char *pools_path;
+
+/* Groups store their pool as id + 1 so that zeroed groups belong to none */
+static bool in_pool(const struct Group_Chat *g, int id)
+{
+    return g->active && g->pool == id + 1;
+}
+
+static bool valid_name(const char *name)
+{
+    size_t i, len = strlen(name);
+
+    if (len == 0 || len >= POOL_NAME_LENGTH || !isalpha((unsigned char) name[0]))
+        return false;
+
+    for (i = 1; i < len; ++i) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '-' && name[i] != '_')
+            return false;
+    }
+
+    return true;
+}
+
+static int save(void)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pools_path);
+
+    FILE *fp = fopen(tmp_path, "w");
+
+    if (fp == NULL)
+        return -1;
+
+    int i;
+
+    for (i = 0; i < POOL_MAX; ++i) {
+        if (Pools[i].name[0])
+            fprintf(fp, "%s %d\n", Pools[i].name, Pools[i].max_peers);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, pools_path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Creates or resizes a pool without saving. Returns the pool id, -1 if name is invalid, -2 if there's no
+   free slot. */
+static int set(const char *name, int max_peers)
+{
+    if (!valid_name(name))
+        return -1;
+
+    int id = pool_find(name);
+
+    if (id == -1) {
+        for (id = 0; id < POOL_MAX && Pools[id].name[0]; ++id)
+            ;
+
+        if (id == POOL_MAX)
+            return -2;
+
+        memset(&Pools[id], 0, sizeof(struct Pool));
+        snprintf(Pools[id].name, sizeof(Pools[id].name), "%s", name);
+    }
+
+    Pools[id].max_peers = max_peers;
+    return id;
+}
+
+void pools_init(const char *path)
+{
+    pools_path = path;
+
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return;
+
+    char line[128];
+
+    while (fgets(line, sizeof(line), fp)) {
+        char name[POOL_NAME_LENGTH];
+        int max_peers;
+
+        if (line[0] == '#' || sscanf(line, "%31s %d", name, &max_peers) != 2 || max_peers <= 0)
+            continue;
+
+        if (set(name, max_peers) < 0)
+            fprintf(stderr, "Warning: ignoring pool %s\n", name);
+    }
+
+    fclose(fp);
+}
+
+int pool_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < POOL_MAX; ++i) {
+        if (Pools[i].name[0] && strcmp(Pools[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int pool_set(const char *name, int max_peers)
+{
+    int id = set(name, max_peers);
+
+    if (id >= 0 && save() == -1)
+        fprintf(stderr, "Warning: failed to save pools to %s\n", pools_path);
+
+    return id;
+}
+
+void pool_delete(int id)
+{
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (in_pool(&Tox_Bot.g_chats[i], id))
+            Tox_Bot.g_chats[i].pool = 0;
+    }
+
+    memset(&Pools[id], 0, sizeof(struct Pool));
+
+    if (save() == -1)
+        fprintf(stderr, "Warning: failed to save pools to %s\n", pools_path);
+}
+
+int pool_add_group(int id, int groupnum)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1)
+        return -1;
+
+    Tox_Bot.g_chats[idx].pool = id + 1;
+    return 0;
+}
+
+/* Creates a text group for pool id and titles it after the pool. Returns the group number, or -1 on failure. */
+static int new_shard(Tox *m, int id)
+{
+    struct Pool *p = &Pools[id];
+    int groupnum = tox_add_groupchat(m);
+
+    if (groupnum == -1) {
+        log_event(LOG_WARNING, EV_GROUP_CREATE_FAILED, -1, -1, 0, "failed to initialize");
+        return -1;
+    }
+
+    if (group_add(groupnum, TOX_GROUPCHAT_TYPE_TEXT, NULL) == -1) {
+        log_event(LOG_WARNING, EV_GROUP_CREATE_FAILED, -1, groupnum, 0, "group_add failed");
+        tox_del_groupchat(m, groupnum);
+        return -1;
+    }
+
+    struct Group_Chat *g = &Tox_Bot.g_chats[group_index(groupnum)];
+    g->pool = id + 1;
+    g->title_len = snprintf(g->title, sizeof(g->title), "%s #%u", p->name, ++p->next_shard);
+
+    /* Titles can't be set while we're alone in the group, so this is usually retried once someone joins */
+    g->title_pending = tox_group_set_title(m, groupnum, (uint8_t *) g->title, g->title_len) != 0;
+    info_cache_invalidate();
+
+    ++p->shards_created;
+    log_event(LOG_INFO, EV_POOL_SHARD_CREATED, -1, groupnum, p->next_shard, p->name);
+    return groupnum;
+}
+
+int pool_pick(Tox *m, int id, uint32_t friendnum, bool master, uint64_t now)
+{
+    struct Pool *p = &Pools[id];
+    int i, best = -1, best_load = INT_MAX, num_groups = 0, num_protected = 0;
+
+    ++p->invites;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        const struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!in_pool(g, id))
+            continue;
+
+        ++num_groups;
+
+        /* keep friends in the shard they're already in rather than spreading them over several */
+        if (group_has_friend(i, friendnum, now))
+            return g->num;
+
+        /* password protected groups are never picked, and don't make room for anyone without a password */
+        if (g->has_pass) {
+            ++num_protected;
+            continue;
+        }
+
+        int load = group_load(i, now);
+
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+
+    if (best != -1 && best_load < p->max_peers)
+        return Tox_Bot.g_chats[best].num;
+
+    if (num_groups > 0 && num_protected == num_groups)
+        return POOL_PROTECTED;
+
+    if (num_groups >= POOL_MAX_SHARDS) {
+        ++p->full;
+        return POOL_FULL;
+    }
+
+    if (!master && p->last_shard && now - p->last_shard < POOL_SHARD_INTERVAL * 1000) {
+        ++p->throttled;
+        return POOL_FULL;
+    }
+
+    int groupnum = new_shard(m, id);
+
+    if (groupnum != -1)
+        p->last_shard = now;
+
+    return groupnum;
+}
+
+int pool_format(int id, char *buf, size_t size)
+{
+    const struct Pool *p = &Pools[id];
+
+    if (!p->name[0])
+        return 0;
+
+    int i, len = snprintf(buf, size, "Pool %s (max %d peers):", p->name, p->max_peers);
+    bool empty = true;
+
+    for (i = 0; i < Tox_Bot.chats_idx && (size_t) len < size; ++i) {
+        const struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!in_pool(g, id))
+            continue;
+
+        len += snprintf(buf + len, size - len, "%s group %d (%d)", empty ? "" : ",", g->num, g->num_peers - 1);
+        empty = false;
+    }
+
+    if (empty && (size_t) len < size)
+        len += snprintf(buf + len, size - len, " no groups yet");
+
+    return MIN(len, (int) size - 1);
+}
+
+void pools_print_metrics(FILE *fp)
+{
+    int id, i;
+
+    for (id = 0; id < POOL_MAX; ++id) {
+        const struct Pool *p = &Pools[id];
+
+        if (!p->name[0])
+            continue;
+
+        int groups = 0, peers = 0;
+
+        for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+            if (in_pool(&Tox_Bot.g_chats[i], id)) {
+                ++groups;
+                peers += Tox_Bot.g_chats[i].num_peers - 1;
+            }
+        }
+
+        fprintf(fp, "pool_groups{pool=\"%s\"} %d\n", p->name, groups);
+        fprintf(fp, "pool_peers{pool=\"%s\"} %d\n", p->name, peers);
+        fprintf(fp, "pool_max_peers{pool=\"%s\"} %d\n", p->name, p->max_peers);
+        fprintf(fp, "pool_invites{pool=\"%s\"} %"PRIu64"\n", p->name, p->invites);
+        fprintf(fp, "pool_shards_created{pool=\"%s\"} %"PRIu64"\n", p->name, p->shards_created);
+        fprintf(fp, "pool_full{pool=\"%s\"} %"PRIu64"\n", p->name, p->full);
+        fprintf(fp, "pool_shards_throttled{pool=\"%s\"} %"PRIu64"\n", p->name, p->throttled);
+    }
+}
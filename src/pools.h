@@ -0,0 +1,70 @@
+/*  pools.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef POOLS_H
+#define POOLS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define POOL_MAX 16
+#define POOL_NAME_LENGTH 32
+#define POOL_MAX_SHARDS 32    /* groups a pool may grow to before invites are refused */
+#define POOL_SHARD_INTERVAL 60    /* min seconds between shards created on behalf of non-masters in a pool */
+
+#define POOL_FULL -2          /* returned by pool_pick when every group is full and no shard may be added */
+#define POOL_PROTECTED -3     /* returned by pool_pick when the pool only has password protected groups */
+
+/* Loads pool definitions from path, one "<name> <max peers>" per line. */
+void pools_init(const char *path);
+
+/* Returns the id of the pool called name, or -1 if there is none. */
+int pool_find(const char *name);
+
+/* Creates the pool name, or changes its max peer count if it exists. Names must start with a letter and
+   consist of letters, digits, - and _. Returns the pool id, -1 if name is invalid, -2 if there are already
+   POOL_MAX pools. */
+int pool_set(const char *name, int max_peers);
+
+/* Deletes pool id. Its groups are kept but no longer belong to a pool. */
+void pool_delete(int id);
+
+/* Adds groupnum to pool id. Returns 0 on success, -1 if the group doesn't exist. */
+int pool_add_group(int id, int groupnum);
+
+/* Returns the group of pool id that friendnum should be invited to: the group they are already in or were
+   just invited to, otherwise the least loaded group with room that has no password. If every such group is
+   full a new shard is created and titled, at most once per POOL_SHARD_INTERVAL unless master is set.
+   Returns -1 if creating the shard failed, POOL_FULL if the pool has POOL_MAX_SHARDS groups or a shard was
+   created too recently, POOL_PROTECTED if all of the pool's groups have passwords. now is timer_now(). */
+int pool_pick(Tox *m, int id, uint32_t friendnum, bool master, uint64_t now);
+
+/* Writes a one line summary of pool id and its groups into buf. Returns the length of the summary, or 0 if
+   there is no pool id. */
+int pool_format(int id, char *buf, size_t size);
+
+/* Writes pool metrics to fp */
+void pools_print_metrics(FILE *fp);
+
+#endif /* POOLS_H */
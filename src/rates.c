@@ -0,0 +1,94 @@
+/*  rates.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "rates.h"
+
+const char *rate_window_names[NUM_RATE_WINDOWS] = {
+    [RATE_1M] = "1m",
+    [RATE_5M] = "5m",
+    [RATE_1H] = "1h",
+};
+
+/* Clears the buckets that fell out of the window between epoch and now, and moves epoch to now */
+static void advance(uint32_t *buckets, uint32_t num_buckets, uint64_t *epoch, uint64_t now)
+{
+    if (now <= *epoch)
+        return;
+
+    uint64_t e = now - *epoch > num_buckets ? now - num_buckets : *epoch;
+
+    while (e < now)
+        buckets[++e % num_buckets] = 0;
+
+    *epoch = now;
+}
+
+/* Sums the last span buckets up to now */
+static uint32_t sum(const uint32_t *buckets, uint32_t num_buckets, uint64_t epoch, uint64_t now, uint32_t span)
+{
+    uint32_t total = 0;
+    uint32_t k;
+
+    for (k = 0; k < span && k <= epoch; ++k) {
+        uint64_t e = epoch - k;
+
+        if (e + span <= now)    /* older buckets are out of the window too */
+            break;
+
+        total += buckets[e % num_buckets];
+    }
+
+    return total;
+}
+
+void rate_add(struct Rate_Counter *c, uint64_t cur_time, uint32_t n)
+{
+    uint64_t fine = cur_time / RATE_FINE_SECONDS;
+    uint64_t coarse = cur_time / RATE_COARSE_SECONDS;
+
+    advance(c->fine, RATE_FINE_BUCKETS, &c->fine_epoch, fine);
+    advance(c->coarse, RATE_COARSE_BUCKETS, &c->coarse_epoch, coarse);
+
+    c->fine[fine % RATE_FINE_BUCKETS] += n;
+    c->coarse[coarse % RATE_COARSE_BUCKETS] += n;
+    c->total += n;
+}
+
+uint32_t rate_sum(const struct Rate_Counter *c, uint64_t cur_time, RATE_WINDOW window)
+{
+    switch (window) {
+        case RATE_1M:
+            return sum(c->fine, RATE_FINE_BUCKETS, c->fine_epoch, cur_time / RATE_FINE_SECONDS, RATE_FINE_BUCKETS);
+
+        case RATE_5M:
+            return sum(c->coarse, RATE_COARSE_BUCKETS, c->coarse_epoch, cur_time / RATE_COARSE_SECONDS, 5);
+
+        case RATE_1H:
+            return sum(c->coarse, RATE_COARSE_BUCKETS, c->coarse_epoch, cur_time / RATE_COARSE_SECONDS,
+                       RATE_COARSE_BUCKETS);
+
+        default:
+            return 0;
+    }
+}
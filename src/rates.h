@@ -0,0 +1,58 @@
+/*  rates.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RATES_H
+#define RATES_H
+
+#include <stdint.h>
+
+#define RATE_FINE_SECONDS 5      /* resolution of the 1 minute window */
+#define RATE_FINE_BUCKETS 12
+#define RATE_COARSE_SECONDS 60   /* resolution of the 5 minute and 1 hour windows */
+#define RATE_COARSE_BUCKETS 60
+
+typedef enum {
+    RATE_1M,
+    RATE_5M,
+    RATE_1H,
+    NUM_RATE_WINDOWS
+} RATE_WINDOW;
+
+extern const char *rate_window_names[NUM_RATE_WINDOWS];
+
+/* Counts events over sliding windows of the last minute, 5 minutes and hour in fixed memory.
+   A zeroed counter is ready to use. */
+struct Rate_Counter {
+    uint32_t fine[RATE_FINE_BUCKETS];        /* indexed by (time / RATE_FINE_SECONDS) modulo size */
+    uint32_t coarse[RATE_COARSE_BUCKETS];    /* indexed by (time / RATE_COARSE_SECONDS) modulo size */
+    uint64_t fine_epoch;      /* time / RATE_FINE_SECONDS of the last update */
+    uint64_t coarse_epoch;    /* time / RATE_COARSE_SECONDS of the last update */
+    uint64_t total;
+};
+
+/* Counts n events at cur_time */
+void rate_add(struct Rate_Counter *c, uint64_t cur_time, uint32_t n);
+
+/* Returns the number of events in the window ending at cur_time */
+uint32_t rate_sum(const struct Rate_Counter *c, uint64_t cur_time, RATE_WINDOW window);
+
+#endif /* RATES_H */
@@ -0,0 +1,538 @@
+/*  recorder.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime, nanosleep, localtime_r */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pcm.h"
+#include "log.h"
+#include "recorder.h"
+#include "mem.h"
+
+#define RECORDER_PACKET_SAMPLES 2880                      /* per channel; the longest frame Opus produces at 48 kHz */
+#define RECORDER_RESAMPLE_MAX (RECORDER_PACKET_SAMPLES * 6)    /* room to upsample 8 kHz frames */
+#define RECORDER_MIX_SAMPLES (PCM_RATE * 2)               /* length of the mixing window */
+#define RECORDER_SEGMENT_BYTES ((uint32_t) RECORDER_SEGMENT_SECONDS * PCM_RATE * sizeof(int16_t))
+#define RECORDER_WRITE_INTERVAL 50                        /* ms between writer passes */
+
+typedef enum {
+    REC_FREE,
+    REC_RECORDING,
+    REC_STOPPING,    /* the writer thread drains what's left, finishes the file and frees the slot */
+} REC_STATE;
+
+struct Record_Packet {
+    int peernum;
+    uint8_t channels;
+    uint32_t sample_rate;
+    uint32_t samples;
+    uint64_t arrival;    /* ms */
+    int16_t pcm[RECORDER_PACKET_SAMPLES * PCM_MAX_CHANNELS];
+};
+
+struct Recording_Buffers {
+    struct Record_Packet ring[RECORDER_RING_PACKETS];
+    int16_t mix[RECORDER_MIX_SAMPLES];    /* circular; indexed by output sample position modulo size */
+};
+
+struct Peer_Cursor {
+    int peernum;
+    bool used;
+    uint64_t pos;    /* output sample position at which the peer's next frame goes */
+};
+
+struct Recording {
+    int state;    /* REC_STATE; accessed atomically */
+
+    /* single producer single consumer ring: the main thread advances head, the writer thread tail */
+    uint32_t head;
+    uint32_t tail;
+    struct Recording_Buffers *buf;    /* allocated on first use and kept for reuse */
+
+    int groupnum;
+    uint64_t start;    /* ms */
+
+    /* owned by the writer thread */
+    FILE *fp;
+    uint32_t data_len;       /* bytes of samples in the current segment */
+    bool failed;             /* stop writing after an I/O error */
+    uint64_t written_pos;    /* output samples before this have been written out */
+    uint64_t end_pos;        /* end of the latest mixed frame */
+    struct Peer_Cursor peers[RECORDER_MAX_PEERS];
+};
+
+static struct {
+    struct Recording recordings[RECORDER_MAX_RECORDINGS];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+    bool quit;          /* protected by lock */
+    int num_slots;      /* slots that aren't free; protected by lock */
+    int num_active;     /* recordings in progress; main thread only */
+
+    /* updated by the main thread */
+    uint64_t frames_received;
+    uint64_t frames_dropped;
+
+    /* updated by the writer thread */
+    uint64_t frames_late;
+    uint64_t bytes_written;
+    uint64_t segments;
+    uint64_t write_errors;
+    uint64_t mixer_cpu_ns;
+} Recorder = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void)
+{
+    return clock_ns(CLOCK_MONOTONIC) / 1000000;
+}
+
+static struct Recording *find_recording(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_RECORDINGS; ++i) {
+        struct Recording *r = &Recorder.recordings[i];
+
+        if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == REC_RECORDING && r->groupnum == groupnum)
+            return r;
+    }
+
+    return NULL;
+}
+
+void recorder_audio_cb(void *tox, int groupnum, int peernum, const int16_t *pcm, unsigned int samples,
+                       uint8_t channels, unsigned int sample_rate, void *userdata)
+{
+    if (Recorder.num_active == 0)
+        return;
+
+    struct Recording *r = find_recording(groupnum);
+
+    if (r == NULL)
+        return;
+
+    ++Recorder.frames_received;
+
+    uint32_t head = r->head;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RECORDER_RING_PACKETS
+            || channels < 1 || channels > PCM_MAX_CHANNELS || sample_rate == 0) {
+        ++Recorder.frames_dropped;
+        return;
+    }
+
+    struct Record_Packet *p = &r->buf->ring[head % RECORDER_RING_PACKETS];
+
+    if (samples > RECORDER_PACKET_SAMPLES)
+        samples = RECORDER_PACKET_SAMPLES;
+
+    p->peernum = peernum;
+    p->channels = channels;
+    p->sample_rate = sample_rate;
+    p->samples = samples;
+    p->arrival = now_ms();
+    memcpy(p->pcm, pcm, samples * channels * sizeof(int16_t));
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t *peer_cursor(struct Recording *r, int peernum)
+{
+    struct Peer_Cursor *oldest = &r->peers[0];
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_PEERS; ++i) {
+        struct Peer_Cursor *c = &r->peers[i];
+
+        if (c->used && c->peernum == peernum)
+            return &c->pos;
+
+        if (!c->used || (oldest->used && c->pos < oldest->pos))
+            oldest = c;
+    }
+
+    /* take over a free slot or the one of the peer that spoke least recently */
+    oldest->used = true;
+    oldest->peernum = peernum;
+    oldest->pos = 0;
+    return &oldest->pos;
+}
+
+/* Adds a frame to the mixing window at the position it belongs to */
+static void mix_packet(struct Recording *r, const struct Record_Packet *p)
+{
+    int16_t mono[RECORDER_PACKET_SAMPLES];
+    size_t n = p->samples;
+    size_t i;
+
+    if (p->channels == 2) {
+        for (i = 0; i < n; ++i)
+            mono[i] = (p->pcm[i * 2] + p->pcm[i * 2 + 1]) / 2;
+    } else {
+        memcpy(mono, p->pcm, n * sizeof(int16_t));
+    }
+
+    const int16_t *in = mono;
+    int16_t resampled[RECORDER_RESAMPLE_MAX];
+
+    if (p->sample_rate != PCM_RATE) {
+        float fin[RECORDER_PACKET_SAMPLES];
+        float fout[RECORDER_RESAMPLE_MAX];
+        struct Resampler rs;
+
+        pcm_resampler_init(&rs, p->sample_rate);
+        pcm_s16_to_float(mono, fin, n);
+        n = pcm_resample(&rs, fin, n, fout, RECORDER_RESAMPLE_MAX, 1);
+        pcm_float_to_s16(fout, resampled, n, 1.0f);
+        in = resampled;
+    }
+
+    uint64_t arrival = (p->arrival - r->start) * (PCM_RATE / 1000);
+    uint64_t jitter = RECORDER_MIX_DELAY * (PCM_RATE / 1000);
+    uint64_t *cursor = peer_cursor(r, p->peernum);
+
+    /* a peer's frames normally follow on from each other; resync if it paused or drifted */
+    if (*cursor + jitter < arrival || *cursor > arrival + jitter)
+        *cursor = arrival;
+
+    uint64_t start = *cursor;
+    *cursor += n;
+
+    if (start < r->written_pos) {
+        if (start + n <= r->written_pos) {
+            __atomic_fetch_add(&Recorder.frames_late, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        size_t skip = r->written_pos - start;
+        in += skip;
+        n -= skip;
+        start = r->written_pos;
+    }
+
+    if (start + n > r->written_pos + RECORDER_MIX_SAMPLES) {
+        __atomic_fetch_add(&Recorder.frames_late, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t off = start % RECORDER_MIX_SAMPLES;
+    size_t first = n < RECORDER_MIX_SAMPLES - off ? n : RECORDER_MIX_SAMPLES - off;
+
+    pcm_mix_s16(in, r->buf->mix + off, first);
+    pcm_mix_s16(in + first, r->buf->mix, n - first);
+
+    if (start + n > r->end_pos)
+        r->end_pos = start + n;
+}
+
+static void drain(struct Recording *r)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    while (r->tail != head) {
+        mix_packet(r, &r->buf->ring[r->tail % RECORDER_RING_PACKETS]);
+        __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void write_failed(struct Recording *r)
+{
+    log_event(LOG_ERROR, EV_RECORD_WRITE_FAILED, -1, r->groupnum, r->data_len, NULL);
+    __atomic_fetch_add(&Recorder.write_errors, 1, __ATOMIC_RELAXED);
+
+    if (r->fp)
+        fclose(r->fp);
+
+    r->fp = NULL;
+    r->failed = true;
+}
+
+static void open_segment(struct Recording *r)
+{
+    char stamp[32];
+    char path[64];
+    time_t t = time(NULL);
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(path, sizeof(path), "record-%d-%s.wav", r->groupnum, stamp);
+
+    struct Wav_Format fmt = { 1, PCM_RATE, 0 };
+    r->fp = fopen(path, "wb");
+    r->data_len = 0;
+
+    if (r->fp == NULL || wav_write_header(r->fp, &fmt) == -1) {
+        write_failed(r);
+        return;
+    }
+
+    log_event(LOG_INFO, EV_RECORD_SEGMENT, -1, r->groupnum, 0, path);
+    __atomic_fetch_add(&Recorder.segments, 1, __ATOMIC_RELAXED);
+}
+
+/* Fills in the final length in the header and closes the segment */
+static void close_segment(struct Recording *r)
+{
+    struct Wav_Format fmt = { 1, PCM_RATE, r->data_len };
+
+    if (fseek(r->fp, 0, SEEK_SET) != 0 || wav_write_header(r->fp, &fmt) == -1 || fclose(r->fp) != 0) {
+        r->fp = NULL;
+        write_failed(r);
+        return;
+    }
+
+    r->fp = NULL;
+}
+
+/* Writes out the mixing window up to output sample position target */
+static void flush(struct Recording *r, uint64_t target)
+{
+    int16_t *mix = r->buf->mix;
+
+    while (r->written_pos < target) {
+        if (r->fp == NULL && !r->failed)
+            open_segment(r);
+
+        size_t off = r->written_pos % RECORDER_MIX_SAMPLES;
+        size_t n = RECORDER_MIX_SAMPLES - off;
+
+        if (n > target - r->written_pos)
+            n = target - r->written_pos;
+
+        if (n > (RECORDER_SEGMENT_BYTES - r->data_len) / sizeof(int16_t))
+            n = (RECORDER_SEGMENT_BYTES - r->data_len) / sizeof(int16_t);
+
+        if (r->fp) {
+            if (fwrite(mix + off, sizeof(int16_t), n, r->fp) != n) {
+                write_failed(r);
+            } else {
+                r->data_len += n * sizeof(int16_t);
+                __atomic_fetch_add(&Recorder.bytes_written, n * sizeof(int16_t), __ATOMIC_RELAXED);
+            }
+        }
+
+        memset(mix + off, 0, n * sizeof(int16_t));
+        r->written_pos += n;
+
+        if (r->fp && r->data_len >= RECORDER_SEGMENT_BYTES)
+            close_segment(r);
+    }
+}
+
+/* Writes out everything that's left and frees the slot. The caller must own the recording. */
+static void finish(struct Recording *r)
+{
+    drain(r);
+    flush(r, r->end_pos);
+
+    if (r->fp)
+        close_segment(r);
+
+    __atomic_store_n(&r->state, REC_FREE, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&Recorder.lock);
+    --Recorder.num_slots;
+    pthread_mutex_unlock(&Recorder.lock);
+}
+
+static void *writer_thread(void *arg)
+{
+    pthread_mutex_lock(&Recorder.lock);
+
+    while (!Recorder.quit) {
+        if (Recorder.num_slots == 0) {
+            pthread_cond_wait(&Recorder.cond, &Recorder.lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&Recorder.lock);
+
+        uint64_t now = now_ms();
+        int i;
+
+        for (i = 0; i < RECORDER_MAX_RECORDINGS; ++i) {
+            struct Recording *r = &Recorder.recordings[i];
+            int state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+
+            if (state == REC_STOPPING) {
+                finish(r);
+            } else if (state == REC_RECORDING) {
+                drain(r);
+
+                /* leave the most recent audio in the window in case frames for it are still on their way */
+                if (now - r->start > RECORDER_MIX_DELAY)
+                    flush(r, (now - r->start - RECORDER_MIX_DELAY) * (PCM_RATE / 1000));
+            }
+        }
+
+        __atomic_store_n(&Recorder.mixer_cpu_ns, clock_ns(CLOCK_THREAD_CPUTIME_ID), __ATOMIC_RELAXED);
+
+        struct timespec ts = { 0, RECORDER_WRITE_INTERVAL * 1000000L };
+        nanosleep(&ts, NULL);
+
+        pthread_mutex_lock(&Recorder.lock);
+    }
+
+    pthread_mutex_unlock(&Recorder.lock);
+    return NULL;
+}
+
+int recorder_init(void)
+{
+    if (pthread_create(&Recorder.thread, NULL, writer_thread, NULL) != 0)
+        return -1;
+
+    Recorder.running = true;
+    return 0;
+}
+
+void recorder_close(void)
+{
+    if (!Recorder.running)
+        return;
+
+    pthread_mutex_lock(&Recorder.lock);
+    Recorder.quit = true;
+    pthread_cond_signal(&Recorder.cond);
+    pthread_mutex_unlock(&Recorder.lock);
+
+    pthread_join(Recorder.thread, NULL);
+    Recorder.running = false;
+    Recorder.num_active = 0;
+
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_RECORDINGS; ++i) {
+        struct Recording *r = &Recorder.recordings[i];
+
+        if (r->state != REC_FREE)
+            finish(r);
+
+        mem_free(r->buf);
+        r->buf = NULL;
+    }
+}
+
+RECORDER_ERROR recorder_start(int groupnum)
+{
+    if (!Recorder.running)
+        return RECORDER_ERR_THREAD;
+
+    if (find_recording(groupnum))
+        return RECORDER_ERR_BUSY;
+
+    struct Recording *r = NULL;
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_RECORDINGS; ++i) {
+        if (__atomic_load_n(&Recorder.recordings[i].state, __ATOMIC_ACQUIRE) == REC_FREE) {
+            r = &Recorder.recordings[i];
+            break;
+        }
+    }
+
+    if (r == NULL)
+        return RECORDER_ERR_FULL;
+
+    if (r->buf == NULL) {
+        r->buf = mem_calloc(MEM_AUDIO, 1, sizeof(struct Recording_Buffers));
+
+        if (r->buf == NULL)
+            return RECORDER_ERR_FULL;
+    } else {
+        memset(r->buf->mix, 0, sizeof(r->buf->mix));
+    }
+
+    r->groupnum = groupnum;
+    r->start = now_ms();
+    r->head = 0;
+    r->tail = 0;
+    r->fp = NULL;
+    r->data_len = 0;
+    r->failed = false;
+    r->written_pos = 0;
+    r->end_pos = 0;
+    memset(r->peers, 0, sizeof(r->peers));
+
+    /* hand the recording to the writer thread */
+    pthread_mutex_lock(&Recorder.lock);
+    ++Recorder.num_slots;
+    __atomic_store_n(&r->state, REC_RECORDING, __ATOMIC_RELEASE);
+    pthread_cond_signal(&Recorder.cond);
+    pthread_mutex_unlock(&Recorder.lock);
+
+    ++Recorder.num_active;
+    log_event(LOG_INFO, EV_RECORD_STARTED, -1, groupnum, 0, NULL);
+    return RECORDER_OK;
+}
+
+bool recorder_stop(int groupnum)
+{
+    struct Recording *r = find_recording(groupnum);
+
+    if (r == NULL)
+        return false;
+
+    __atomic_store_n(&r->state, REC_STOPPING, __ATOMIC_RELEASE);
+    --Recorder.num_active;
+
+    log_event(LOG_INFO, EV_RECORD_STOPPED, -1, groupnum, (now_ms() - r->start) / 1000, NULL);
+    return true;
+}
+
+bool recorder_active(int groupnum)
+{
+    return find_recording(groupnum) != NULL;
+}
+
+void recorder_print_metrics(FILE *fp)
+{
+    fprintf(fp, "recorder_recordings %d\n", Recorder.num_active);
+    fprintf(fp, "recorder_frames_received %" PRIu64 "\n", Recorder.frames_received);
+    fprintf(fp, "recorder_frames_dropped %" PRIu64 "\n", Recorder.frames_dropped);
+    fprintf(fp, "recorder_frames_late %" PRIu64 "\n", __atomic_load_n(&Recorder.frames_late, __ATOMIC_RELAXED));
+    fprintf(fp, "recorder_bytes_written %" PRIu64 "\n", __atomic_load_n(&Recorder.bytes_written, __ATOMIC_RELAXED));
+    fprintf(fp, "recorder_segments %" PRIu64 "\n", __atomic_load_n(&Recorder.segments, __ATOMIC_RELAXED));
+    fprintf(fp, "recorder_write_errors %" PRIu64 "\n", __atomic_load_n(&Recorder.write_errors, __ATOMIC_RELAXED));
+    fprintf(fp, "recorder_mixer_cpu_seconds %.3f\n", __atomic_load_n(&Recorder.mixer_cpu_ns, __ATOMIC_RELAXED) / 1e9);
+}
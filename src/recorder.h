@@ -0,0 +1,65 @@
+/*  recorder.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RECORDER_MAX_RECORDINGS 8
+#define RECORDER_RING_PACKETS 64          /* frames buffered per recording; must be a power of 2 */
+#define RECORDER_MAX_PEERS 32             /* peers whose timing we track per recording */
+#define RECORDER_MIX_DELAY 200            /* ms we wait for late frames before writing a stretch of audio */
+#define RECORDER_SEGMENT_SECONDS 3600     /* length of each WAV file before we start a new one */
+
+typedef enum {
+    RECORDER_OK,
+    RECORDER_ERR_BUSY,      /* the group is already being recorded */
+    RECORDER_ERR_FULL,      /* RECORDER_MAX_RECORDINGS are in progress */
+    RECORDER_ERR_THREAD,    /* writer thread isn't running */
+} RECORDER_ERROR;
+
+/* Starts the writer thread. Returns 0 on success, -1 on failure. */
+int recorder_init(void);
+
+/* Finishes all recordings and stops the writer thread. */
+void recorder_close(void);
+
+/* Starts recording groupnum to WAV files named record-<groupnum>-<date>-<time>.wav */
+RECORDER_ERROR recorder_start(int groupnum);
+
+/* Stops recording groupnum. Returns true if it was being recorded. */
+bool recorder_stop(int groupnum);
+
+/* Returns true if groupnum is being recorded */
+bool recorder_active(int groupnum);
+
+/* Audio callback for toxav AV groupchats. Only copies the frame into a ring buffer, never blocks. */
+void recorder_audio_cb(void *tox, int groupnum, int peernum, const int16_t *pcm, unsigned int samples,
+                       uint8_t channels, unsigned int sample_rate, void *userdata);
+
+/* Writes recording metrics to fp */
+void recorder_print_metrics(FILE *fp);
+
+#endif /* RECORDER_H */
@@ -0,0 +1,265 @@
+/*  savefile.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#include "misc.h"
+#include "savefile.h"
+#include "mem.h"
+
+static struct {
+    bool have_hash;
+    uint64_t last_hash;     /* hash of the savedata currently on disk */
+
+    char *buf;              /* reused compression buffer; only ever grows */
+    size_t buf_size;
+
+    uint64_t num_writes;
+    uint64_t num_skipped;
+    uint64_t bytes_written;
+    uint64_t raw_bytes;     /* uncompressed size of everything written */
+    uint64_t last_latency;  /* usec */
+    uint64_t max_latency;
+} Savefile;
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t savefile_hash(const char *data, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    size_t i;
+
+    /* FNV-1a over 64-bit words, with a final mix so the tail bytes affect every bit */
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 32;
+    }
+
+    for (; i < len; ++i)
+        h = (h ^ (uint8_t) data[i]) * 0x100000001b3ULL;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#ifdef USE_LZ4
+static bool reserve_buf(size_t size)
+{
+    if (size <= Savefile.buf_size)
+        return true;
+
+    char *tmp = mem_realloc(MEM_PERSISTENCE, Savefile.buf, size);
+
+    if (tmp == NULL)
+        return false;
+
+    Savefile.buf = tmp;
+    Savefile.buf_size = size;
+    return true;
+}
+#endif
+
+/* Points out and out_len at the bytes to be written to disk for data */
+static int encode(const char *data, size_t len, uint64_t hash, const char **out, size_t *out_len)
+{
+#ifdef USE_LZ4
+    if (len <= INT_MAX) {
+        size_t bound = sizeof(struct Savefile_Header) + LZ4_compressBound(len);
+
+        if (!reserve_buf(bound))
+            return -1;
+
+        struct Savefile_Header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN);
+        hdr.raw_len = len;
+        hdr.hash = hash;
+        memcpy(Savefile.buf, &hdr, sizeof(hdr));
+
+        int clen = LZ4_compress_default(data, Savefile.buf + sizeof(hdr), len, bound - sizeof(hdr));
+
+        if (clen > 0) {
+            *out = Savefile.buf;
+            *out_len = sizeof(hdr) + clen;
+            return 0;
+        }
+    }
+#endif
+
+    *out = data;
+    *out_len = len;
+    return 0;
+}
+
+int savefile_write(const char *path, const char *data, size_t len)
+{
+    uint64_t start = now_usec();
+    uint64_t hash = savefile_hash(data, len);
+
+    if (Savefile.have_hash && hash == Savefile.last_hash) {
+        ++Savefile.num_skipped;
+        return 1;
+    }
+
+    const char *out;
+    size_t out_len;
+
+    if (encode(data, len, hash, &out, &out_len) == -1)
+        return -1;
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+
+    if (fp == NULL)
+        return -1;
+
+    if (fwrite(out, out_len, 1, fp) != 1) {
+        fclose(fp);
+        remove(tmp_path);
+        return -1;
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    Savefile.have_hash = true;
+    Savefile.last_hash = hash;
+
+    uint64_t latency = now_usec() - start;
+    ++Savefile.num_writes;
+    Savefile.bytes_written += out_len;
+    Savefile.raw_bytes += len;
+    Savefile.last_latency = latency;
+    Savefile.max_latency = MAX(Savefile.max_latency, latency);
+
+    return 0;
+}
+
+static char *decode(char *data, size_t *len)
+{
+    struct Savefile_Header hdr;
+
+    if (*len < sizeof(hdr) || memcmp(data, SAVEFILE_MAGIC, SAVEFILE_MAGIC_LEN) != 0)
+        return data;    /* raw savedata */
+
+    memcpy(&hdr, data, sizeof(hdr));
+
+#ifdef USE_LZ4
+    char *raw = NULL;
+
+    if (hdr.raw_len <= INT_MAX && (raw = mem_alloc(MEM_PERSISTENCE, hdr.raw_len ? hdr.raw_len : 1))) {
+        int ret = LZ4_decompress_safe(data + sizeof(hdr), raw, *len - sizeof(hdr), hdr.raw_len);
+
+        if (ret == hdr.raw_len && savefile_hash(raw, hdr.raw_len) == hdr.hash) {
+            mem_free(data);
+            *len = hdr.raw_len;
+            return raw;
+        }
+    }
+
+    fprintf(stderr, "Compressed save file is corrupt\n");
+    mem_free(raw);
+#else
+    fprintf(stderr, "Save file is compressed but toxbot was built without LZ4 support\n");
+#endif
+
+    mem_free(data);
+    return NULL;
+}
+
+char *savefile_read(const char *path, size_t *len)
+{
+    off_t file_len = file_size(path);
+
+    if (file_len == 0)
+        return NULL;
+
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return NULL;
+
+    char *data = mem_alloc(MEM_PERSISTENCE, file_len);
+
+    if (data == NULL || fread(data, file_len, 1, fp) != 1) {
+        mem_free(data);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    *len = file_len;
+    data = decode(data, len);
+
+    if (data) {
+        Savefile.have_hash = true;
+        Savefile.last_hash = savefile_hash(data, *len);
+    }
+
+    return data;
+}
+
+void savefile_print_metrics(FILE *fp, uint64_t uptime)
+{
+    uint64_t hours_x1000 = MAX(uptime * 1000 / 3600, 1);
+
+#ifdef USE_LZ4
+    fprintf(fp, "save_compressed 1\n");
+#else
+    fprintf(fp, "save_compressed 0\n");
+#endif
+    fprintf(fp, "save_writes %"PRIu64"\n", Savefile.num_writes);
+    fprintf(fp, "save_skipped_unchanged %"PRIu64"\n", Savefile.num_skipped);
+    fprintf(fp, "save_bytes_written %"PRIu64"\n", Savefile.bytes_written);
+    fprintf(fp, "save_raw_bytes %"PRIu64"\n", Savefile.raw_bytes);
+    fprintf(fp, "save_bytes_written_per_hour %"PRIu64"\n", Savefile.bytes_written * 1000 / hours_x1000);
+    fprintf(fp, "save_last_latency_us %"PRIu64"\n", Savefile.last_latency);
+    fprintf(fp, "save_max_latency_us %"PRIu64"\n", Savefile.max_latency);
+}
@@ -0,0 +1,57 @@
+/*  savefile.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compressed save files start with this magic, followed by the header below. Raw toxcore savedata never
+   starts with it, so both formats can be told apart. */
+#define SAVEFILE_MAGIC "TBZ1"
+#define SAVEFILE_MAGIC_LEN 4
+
+struct Savefile_Header {
+    char magic[SAVEFILE_MAGIC_LEN];
+    uint32_t reserved;
+    uint64_t raw_len;    /* length of the uncompressed savedata */
+    uint64_t hash;       /* savefile_hash() of the uncompressed savedata */
+};
+
+/* Returns a cheap 64-bit content hash of data (not cryptographically secure) */
+uint64_t savefile_hash(const char *data, size_t len);
+
+/* Writes savedata to path, replacing the file atomically. If the bot was built with LZ4 support the data is
+   stored compressed. Nothing is written if data is identical to what was last read or written.
+   Returns 1 if the write was skipped, 0 on success and -1 on failure. */
+int savefile_write(const char *path, const char *data, size_t len);
+
+/* Reads savedata from path, transparently accepting both raw and compressed files.
+   Returns a buffer that must be freed by the caller and puts its length in len, or NULL on failure. */
+char *savefile_read(const char *path, size_t *len);
+
+/* Writes persistence metrics to fp */
+void savefile_print_metrics(FILE *fp, uint64_t uptime);
+
+#endif /* SAVEFILE_H */
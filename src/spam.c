@@ -0,0 +1,576 @@
+/*  spam.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "misc.h"
+#include "log.h"
+#include "spam.h"
+#include "mem.h"
+#include "timers.h"
+#include "events.h"
+#include "friends.h"
+
+#define SPAM_MAX_PATTERN 256
+#define SPAM_GROUP_SLOTS 64
+#define SPAM_REPORT_PATTERN 64    /* bytes of the matched pattern quoted in reports */
+
+/*
+ * The blocklist is compiled into an Aho-Corasick automaton with every failure transition resolved ahead
+ * of time, so matching costs a single table lookup per byte of the message. Bytes are mapped to classes
+ * first: every distinct byte that occurs in a pattern gets its own class (upper and lower case ASCII share
+ * one) and all other bytes share class 0, which keeps the transition table small.
+ */
+struct Automaton {
+    uint8_t classes[256];
+    uint32_t num_classes;
+    uint32_t num_states;
+    uint32_t *next;       /* num_states * num_classes transitions */
+    uint8_t *action;      /* strongest action of the patterns that end at each state */
+    uint32_t *pattern;    /* the pattern with that action */
+    char **patterns;      /* lowercased, for logging and the naive comparison */
+    uint8_t *pattern_actions;
+    uint32_t num_patterns;
+};
+
+struct Spam_Group {
+    int groupnum;
+    bool used;
+    uint64_t last_warn;
+    uint64_t last_report;
+    uint32_t pending;    /* reportable matches since the last report */
+    char name[TOX_MAX_NAME_LENGTH + 1];    /* of the last reportable sender */
+    char pattern[SPAM_REPORT_PATTERN];     /* of the last reportable match; copied as reloads free patterns */
+};
+
+static struct {
+    const char *path;
+    struct Automaton *ac;
+    time_t mtime;
+    off_t size;
+    struct Timer reload_timer;    /* checks whether the blocklist changed */
+    struct Spam_Group groups[SPAM_GROUP_SLOTS];
+    SPAM_ACTION verdict;    /* of the group message being published */
+
+    uint64_t reloads;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t matches[SPAM_REPORT + 1];
+    uint64_t scan_ns;
+    uint64_t sampled;
+    uint64_t sampled_ac_ns;
+    uint64_t sampled_naive_ns;
+    uint64_t sample_mismatches;
+} Spam;
+
+static const char *action_names[] = {
+    [SPAM_NONE]   = "none",
+    [SPAM_LOG]    = "log",
+    [SPAM_WARN]   = "warn",
+    [SPAM_REPORT] = "report",
+};
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static void free_automaton(struct Automaton *a)
+{
+    if (a == NULL)
+        return;
+
+    uint32_t i;
+
+    for (i = 0; i < a->num_patterns; ++i)
+        mem_free(a->patterns[i]);
+
+    mem_free(a->patterns);
+    mem_free(a->pattern_actions);
+    mem_free(a->next);
+    mem_free(a->action);
+    mem_free(a->pattern);
+    mem_free(a);
+}
+
+/* Adds a pattern to the list. Returns 0 on success, -1 on allocation failure. */
+static int add_pattern(struct Automaton *a, const char *pattern, SPAM_ACTION action)
+{
+    char **patterns = mem_realloc(MEM_SPAM, a->patterns, (a->num_patterns + 1) * sizeof(char *));
+
+    if (patterns == NULL)
+        return -1;
+
+    a->patterns = patterns;
+
+    uint8_t *actions = mem_realloc(MEM_SPAM, a->pattern_actions, a->num_patterns + 1);
+
+    if (actions == NULL)
+        return -1;
+
+    a->pattern_actions = actions;
+
+    size_t len = strlen(pattern);
+    char *p = mem_alloc(MEM_SPAM, len + 1);
+
+    if (p == NULL)
+        return -1;
+
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        p[i] = lower(pattern[i]);
+
+    p[len] = '\0';
+
+    a->patterns[a->num_patterns] = p;
+    a->pattern_actions[a->num_patterns] = action;
+    ++a->num_patterns;
+    return 0;
+}
+
+/* Reads the blocklist at path into a pattern list */
+static struct Automaton *read_blocklist(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return NULL;
+
+    struct Automaton *a = mem_calloc(MEM_SPAM, 1, sizeof(struct Automaton));
+
+    if (a == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    char line[SPAM_MAX_PATTERN + 16];
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        SPAM_ACTION action = SPAM_LOG;
+        char *pattern = line;
+        int i;
+
+        for (i = SPAM_LOG; i <= SPAM_REPORT; ++i) {
+            size_t len = strlen(action_names[i]);
+
+            if (strncmp(line, action_names[i], len) == 0 && line[len] == ' ') {
+                action = i;
+                pattern = line + len + 1;
+                break;
+            }
+        }
+
+        if (pattern[0] == '\0')
+            continue;
+
+        if (add_pattern(a, pattern, action) == -1) {
+            free_automaton(a);
+            fclose(fp);
+            return NULL;
+        }
+    }
+
+    fclose(fp);
+    return a;
+}
+
+/* Builds the automaton for the patterns in a. Returns 0 on success, -1 on allocation failure. */
+static int compile(struct Automaton *a)
+{
+    uint32_t i, c;
+    size_t total_len = 0;
+
+    a->num_classes = 1;
+
+    for (i = 0; i < a->num_patterns; ++i) {
+        const uint8_t *p = (const uint8_t *) a->patterns[i];
+
+        for (; *p; ++p, ++total_len) {
+            if (a->classes[*p] == 0)
+                a->classes[*p] = a->num_classes++;
+        }
+    }
+
+    for (c = 'A'; c <= 'Z'; ++c)
+        a->classes[c] = a->classes[c + ('a' - 'A')];
+
+    /* a trie has at most one state per pattern byte plus the root */
+    uint32_t max_states = total_len + 1;
+    uint32_t nc = a->num_classes;
+
+    a->next = mem_calloc(MEM_SPAM, (size_t) max_states * nc, sizeof(uint32_t));
+    a->action = mem_calloc(MEM_SPAM, max_states, sizeof(uint8_t));
+    a->pattern = mem_calloc(MEM_SPAM, max_states, sizeof(uint32_t));
+    uint32_t *fail = mem_calloc(MEM_SPAM, max_states, sizeof(uint32_t));
+    uint32_t *queue = mem_alloc(MEM_SPAM, max_states * sizeof(uint32_t));
+
+    if (!a->next || !a->action || !a->pattern || !fail || !queue) {
+        mem_free(fail);
+        mem_free(queue);
+        return -1;
+    }
+
+    /* build the trie; 0 means no edge yet since nothing can lead back to the root */
+    a->num_states = 1;
+
+    for (i = 0; i < a->num_patterns; ++i) {
+        const uint8_t *p = (const uint8_t *) a->patterns[i];
+        uint32_t s = 0;
+
+        for (; *p; ++p) {
+            uint32_t *t = &a->next[(size_t) s * nc + a->classes[*p]];
+
+            if (*t == 0)
+                *t = a->num_states++;
+
+            s = *t;
+        }
+
+        if (a->pattern_actions[i] > a->action[s]) {
+            a->action[s] = a->pattern_actions[i];
+            a->pattern[s] = i;
+        }
+    }
+
+    /* resolve failure links breadth first, turning the trie into a DFA */
+    uint32_t head = 0, tail = 0;
+
+    for (c = 0; c < nc; ++c) {
+        if (a->next[c])
+            queue[tail++] = a->next[c];
+    }
+
+    while (head < tail) {
+        uint32_t s = queue[head++];
+
+        if (a->action[fail[s]] > a->action[s]) {
+            a->action[s] = a->action[fail[s]];
+            a->pattern[s] = a->pattern[fail[s]];
+        }
+
+        for (c = 0; c < nc; ++c) {
+            uint32_t *t = &a->next[(size_t) s * nc + c];
+            uint32_t f = a->next[(size_t) fail[s] * nc + c];
+
+            if (*t) {
+                fail[*t] = f;
+                queue[tail++] = *t;
+            } else {
+                *t = f;
+            }
+        }
+    }
+
+    mem_free(fail);
+    mem_free(queue);
+    return 0;
+}
+
+/* Returns the strongest action of the patterns found in msg and puts the index of its pattern in pattern */
+static SPAM_ACTION match(const struct Automaton *a, const char *msg, size_t len, uint32_t *pattern)
+{
+    const uint32_t *next = a->next;
+    uint32_t nc = a->num_classes;
+    uint32_t s = 0;
+    uint8_t best = SPAM_NONE;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        s = next[(size_t) s * nc + a->classes[(uint8_t) msg[i]]];
+
+        if (a->action[s] > best) {
+            best = a->action[s];
+            *pattern = a->pattern[s];
+
+            if (best == SPAM_REPORT)
+                break;
+        }
+    }
+
+    return best;
+}
+
+/* The straightforward way of doing the same as match(), to keep it honest */
+static SPAM_ACTION match_naive(const struct Automaton *a, const char *msg, size_t len)
+{
+    char text[TOX_MAX_MESSAGE_LENGTH + 1];
+    uint8_t best = SPAM_NONE;
+    size_t i;
+
+    len = len < TOX_MAX_MESSAGE_LENGTH ? len : TOX_MAX_MESSAGE_LENGTH;
+
+    for (i = 0; i < len; ++i)
+        text[i] = lower(msg[i]);
+
+    text[len] = '\0';
+
+    for (i = 0; i < a->num_patterns; ++i) {
+        if (a->pattern_actions[i] > best && strstr(text, a->patterns[i]))
+            best = a->pattern_actions[i];
+    }
+
+    return best;
+}
+
+static void load(void)
+{
+    struct stat st;
+
+    if (stat(Spam.path, &st) == -1) {
+        /* no blocklist, no filtering */
+        if (Spam.ac) {
+            free_automaton(Spam.ac);
+            Spam.ac = NULL;
+            log_event(LOG_INFO, EV_BLOCKLIST_LOADED, -1, -1, 0, Spam.path);
+        }
+
+        Spam.mtime = 0;
+        return;
+    }
+
+    if (st.st_mtime == Spam.mtime && st.st_size == Spam.size)
+        return;
+
+    Spam.mtime = st.st_mtime;
+    Spam.size = st.st_size;
+
+    struct Automaton *a = read_blocklist(Spam.path);
+
+    if (a == NULL || compile(a) == -1) {
+        log_event(LOG_ERROR, EV_BLOCKLIST_FAILED, -1, -1, 0, Spam.path);
+        free_automaton(a);
+        return;
+    }
+
+    free_automaton(Spam.ac);
+    Spam.ac = a;
+    ++Spam.reloads;
+    log_event(LOG_INFO, EV_BLOCKLIST_LOADED, -1, -1, a->num_patterns, Spam.path);
+}
+
+static void reload(Tox *m, void *data)
+{
+    load();
+    timer_set(&Spam.reload_timer, SPAM_RELOAD_INTERVAL * 1000);
+}
+
+static void on_group_message(Tox *m, const struct Event *ev)
+{
+    Spam.verdict = spam_check(m, ev->group_message.groupnum, ev->group_message.peernum, ev->group_message.name,
+                              ev->group_message.name_len, ev->group_message.text, ev->group_message.length,
+                              ev->time);
+}
+
+SPAM_ACTION spam_verdict(void)
+{
+    return Spam.verdict;
+}
+
+void spam_init(const char *path)
+{
+    Spam.path = path;
+    load();
+    timer_init(&Spam.reload_timer, "blocklist_reload", reload, NULL);
+    timer_set(&Spam.reload_timer, SPAM_RELOAD_INTERVAL * 1000);
+    event_subscribe(EVENT_GROUP_MESSAGE, "spam", on_group_message);
+}
+
+/* Returns the slot of groupnum. A new group takes a free slot, or else the slot with no pending report
+   that warned longest ago, so groups only share state when every slot has a report pending. */
+static struct Spam_Group *get_group(int groupnum)
+{
+    unsigned int start = (unsigned int) groupnum % SPAM_GROUP_SLOTS;
+    struct Spam_Group *victim = NULL;
+    unsigned int i;
+
+    for (i = 0; i < SPAM_GROUP_SLOTS; ++i) {
+        struct Spam_Group *g = &Spam.groups[(start + i) % SPAM_GROUP_SLOTS];
+
+        if (g->used && g->groupnum == groupnum)
+            return g;
+
+        if (!g->used) {
+            if (victim == NULL || victim->used)
+                victim = g;
+        } else if (g->pending == 0 && (victim == NULL || (victim->used && g->last_warn < victim->last_warn))) {
+            victim = g;
+        }
+    }
+
+    if (victim == NULL)
+        victim = &Spam.groups[start];
+
+    memset(victim, 0, sizeof(struct Spam_Group));
+    victim->used = true;
+    victim->groupnum = groupnum;
+    return victim;
+}
+
+SPAM_ACTION spam_check(Tox *m, int groupnum, int peernum, const char *name, size_t name_len, const char *msg,
+                       size_t msg_len, uint64_t cur_time)
+{
+    const struct Automaton *a = Spam.ac;
+
+    if (a == NULL || a->num_patterns == 0)
+        return SPAM_NONE;
+
+    if (tox_group_peernumber_is_ours(m, groupnum, peernum))
+        return SPAM_NONE;
+
+    uint32_t pattern = 0;
+    uint64_t start = clock_ns();
+    SPAM_ACTION action = match(a, msg, msg_len, &pattern);
+    uint64_t elapsed = clock_ns() - start;
+
+    Spam.scan_ns += elapsed;
+    Spam.bytes += msg_len;
+
+    if (++Spam.messages % SPAM_SAMPLE_RATE == 0) {
+        start = clock_ns();
+        SPAM_ACTION naive = match_naive(a, msg, msg_len);
+        Spam.sampled_naive_ns += clock_ns() - start;
+        Spam.sampled_ac_ns += elapsed;
+        ++Spam.sampled;
+
+        if (naive != action)
+            ++Spam.sample_mismatches;
+    }
+
+    if (action == SPAM_NONE)
+        return SPAM_NONE;
+
+    ++Spam.matches[action];
+
+    char sender[TOX_MAX_NAME_LENGTH + 1];
+    snprintf(sender, sizeof(sender), "%.*s", (int) name_len, name);
+    log_event(LOG_WARNING, EV_SPAM_MATCH, -1, groupnum, action, a->patterns[pattern]);
+
+    struct Spam_Group *g = get_group(groupnum);
+
+    if (action >= SPAM_WARN && cur_time - g->last_warn >= SPAM_WARN_INTERVAL) {
+        char warning[TOX_MAX_MESSAGE_LENGTH];
+        int len = snprintf(warning, sizeof(warning), "%s, that message is not allowed here.", sender);
+        tox_group_message_send(m, groupnum, (uint8_t *) warning, MIN(len, (int) sizeof(warning) - 1));
+        g->last_warn = cur_time;
+    }
+
+    if (action == SPAM_REPORT) {
+        ++g->pending;
+        snprintf(g->pattern, sizeof(g->pattern), "%s", a->patterns[pattern]);
+        memcpy(g->name, sender, sizeof(g->name));
+    }
+
+    return action;
+}
+
+static void send_report(Tox *m, struct Spam_Group *g)
+{
+    char report[TOX_MAX_MESSAGE_LENGTH];
+    int len = snprintf(report, sizeof(report), "Spam in group %d: %u message%s matching the blocklist, the "
+                       "last from %s matching \"%s\"", g->groupnum, g->pending, g->pending == 1 ? "" : "s",
+                       g->name, g->pattern);
+    len = MIN(len, (int) sizeof(report) - 1);
+
+    size_t num_friends = tox_self_get_friend_list_size(m);
+    uint32_t *friends = mem_alloc(MEM_SPAM, num_friends * sizeof(uint32_t));
+
+    if (friends == NULL)
+        return;
+
+    tox_self_get_friend_list(m, friends);
+    size_t i;
+
+    for (i = 0; i < num_friends; ++i) {
+        if (tox_friend_get_connection_status(m, friends[i], NULL) == TOX_CONNECTION_NONE)
+            continue;
+
+        /* the cached flag; friend_is_master() would read the masterkeys file for every friend */
+        const struct Friend_Info *f = friend_info(friends[i]);
+
+        if (f && f->master)
+            tox_friend_send_message(m, friends[i], TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) report, len, NULL);
+    }
+
+    mem_free(friends);
+}
+
+void spam_do(Tox *m, uint64_t cur_time)
+{
+    int i;
+
+    for (i = 0; i < SPAM_GROUP_SLOTS; ++i) {
+        struct Spam_Group *g = &Spam.groups[i];
+
+        if (!g->used || g->pending == 0 || cur_time - g->last_report < SPAM_REPORT_INTERVAL)
+            continue;
+
+        send_report(m, g);
+        g->pending = 0;
+        g->last_report = cur_time;
+    }
+}
+
+void spam_print_metrics(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "spam_patterns %u\n", Spam.ac ? Spam.ac->num_patterns : 0);
+    fprintf(fp, "spam_automaton_states %u\n", Spam.ac ? Spam.ac->num_states : 0);
+    fprintf(fp, "spam_blocklist_reloads %" PRIu64 "\n", Spam.reloads);
+    fprintf(fp, "spam_messages_scanned %" PRIu64 "\n", Spam.messages);
+    fprintf(fp, "spam_bytes_scanned %" PRIu64 "\n", Spam.bytes);
+    fprintf(fp, "spam_scan_seconds %.6f\n", Spam.scan_ns / 1e9);
+
+    for (i = SPAM_LOG; i <= SPAM_REPORT; ++i)
+        fprintf(fp, "spam_matches{action=\"%s\"} %" PRIu64 "\n", action_names[i], Spam.matches[i]);
+
+    /* compares the automaton against a strstr() loop over all patterns on a sample of the same messages */
+    fprintf(fp, "spam_sampled_messages %" PRIu64 "\n", Spam.sampled);
+    fprintf(fp, "spam_sampled_automaton_seconds %.6f\n", Spam.sampled_ac_ns / 1e9);
+    fprintf(fp, "spam_sampled_naive_seconds %.6f\n", Spam.sampled_naive_ns / 1e9);
+    fprintf(fp, "spam_sampled_mismatches %" PRIu64 "\n", Spam.sample_mismatches);
+}
@@ -0,0 +1,63 @@
+/*  spam.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SPAM_H
+#define SPAM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define SPAM_RELOAD_INTERVAL 5      /* seconds between checks for a changed blocklist */
+#define SPAM_WARN_INTERVAL 10       /* min seconds between warnings sent to the same group */
+#define SPAM_REPORT_INTERVAL 60     /* min seconds between reports to masters about the same group */
+#define SPAM_SAMPLE_RATE 64         /* one in this many messages is also checked the naive way, for comparison */
+
+typedef enum {
+    SPAM_NONE,
+    SPAM_LOG,       /* record the match in the event log */
+    SPAM_WARN,      /* also warn the group */
+    SPAM_REPORT,    /* also report the sender to online masters */
+} SPAM_ACTION;
+
+/* Loads the blocklist at path. Each line holds a pattern, optionally preceded by an action (log, warn or
+   report; log if omitted). Patterns match anywhere in a message, ignoring ASCII case. The file is reloaded
+   within SPAM_RELOAD_INTERVAL seconds whenever it changes. Group messages are checked as they are published. */
+void spam_init(const char *path);
+
+/* Checks a group message against the blocklist and takes the action of the strongest matching pattern.
+   Returns the action taken. */
+SPAM_ACTION spam_check(Tox *m, int groupnum, int peernum, const char *name, size_t name_len, const char *msg,
+                       size_t msg_len, uint64_t cur_time);
+
+/* Returns the action taken on the group message currently being published. Only meaningful to
+   EVENT_GROUP_MESSAGE subscribers that subscribed after spam_init(), which run after the check. */
+SPAM_ACTION spam_verdict(void);
+
+/* Sends pending reports. The blocklist is checked for changes by a timer. */
+void spam_do(Tox *m, uint64_t cur_time);
+
+/* Writes spam filter metrics to fp */
+void spam_print_metrics(FILE *fp);
+
+#endif /* SPAM_H */
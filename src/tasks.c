@@ -0,0 +1,151 @@
+/*  tasks.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "watchdog.h"
+#include "tasks.h"
+
+struct Task {
+    const char *name;
+    task_step_cb *step;
+    void *state;
+};
+
+static struct {
+    struct Task tasks[TASK_MAX];    /* scheduled tasks, in the order they were started */
+    int num_tasks;
+    int next;                       /* round-robin position carried over between calls */
+
+    uint64_t started;
+    uint64_t finished;
+    uint64_t steps;
+    uint64_t run_us;
+    uint64_t over_budget;           /* calls to tasks_run() that exceeded their budget */
+    uint64_t max_step_us;
+} Tasks;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int task_start(const char *name, task_step_cb *step, void *state)
+{
+    if (Tasks.num_tasks == TASK_MAX)
+        return -1;
+
+    struct Task *t = &Tasks.tasks[Tasks.num_tasks++];
+    t->name = name;
+    t->step = step;
+    t->state = state;
+    ++Tasks.started;
+
+    return 0;
+}
+
+bool task_pending(const void *state)
+{
+    int i;
+
+    for (i = 0; i < Tasks.num_tasks; ++i) {
+        if (Tasks.tasks[i].state == state)
+            return true;
+    }
+
+    return false;
+}
+
+static void remove_task(int idx)
+{
+    int i;
+
+    for (i = idx; i < Tasks.num_tasks - 1; ++i)
+        Tasks.tasks[i] = Tasks.tasks[i + 1];
+
+    --Tasks.num_tasks;
+    ++Tasks.finished;
+}
+
+void tasks_run(Tox *m, uint32_t budget_us)
+{
+    if (Tasks.num_tasks == 0)
+        return;
+
+    uint64_t start = now_us();
+    uint64_t now = start;
+    int stepped = 0;    /* steps taken this call, so that every task gets at least one */
+
+    struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_TASKS, NULL);
+
+    while (Tasks.num_tasks > 0 && (stepped < Tasks.num_tasks || now - start < budget_us)) {
+        if (Tasks.next >= Tasks.num_tasks)
+            Tasks.next = 0;
+
+        struct Task *t = &Tasks.tasks[Tasks.next];
+        watchdog_set_phase(PHASE_TASKS, t->name);
+
+        uint64_t step_start = now;
+        bool done = t->step(m, t->state);
+        now = now_us();
+
+        ++Tasks.steps;
+        ++stepped;
+
+        if (now - step_start > Tasks.max_step_us)
+            Tasks.max_step_us = now - step_start;
+
+        if (done)
+            remove_task(Tasks.next);
+        else
+            ++Tasks.next;
+    }
+
+    Tasks.run_us += now - start;
+
+    if (now - start > budget_us)
+        ++Tasks.over_budget;
+
+    watchdog_restore_phase(prev_phase);
+}
+
+void tasks_print_metrics(FILE *fp)
+{
+    fprintf(fp, "tasks_scheduled %d\n", Tasks.num_tasks);
+    fprintf(fp, "tasks_started %"PRIu64"\n", Tasks.started);
+    fprintf(fp, "tasks_finished %"PRIu64"\n", Tasks.finished);
+    fprintf(fp, "task_steps %"PRIu64"\n", Tasks.steps);
+    fprintf(fp, "task_run_seconds %.6f\n", Tasks.run_us / 1e6);
+    fprintf(fp, "task_ticks_over_budget %"PRIu64"\n", Tasks.over_budget);
+    fprintf(fp, "task_max_step_seconds %.6f\n", Tasks.max_step_us / 1e6);
+}
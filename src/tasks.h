@@ -0,0 +1,54 @@
+/*  tasks.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+#define TASK_MAX 16
+#define TASK_BUDGET_US 5000    /* time the main loop spends on tasks per iteration */
+
+/* Does a bounded amount of work, resuming from a cursor kept in state, and returns true once the task is
+   finished. A finished task must release anything it owns before returning; it is never called again. */
+typedef bool task_step_cb(Tox *m, void *state);
+
+/* Schedules step to be called with state until it returns true. name must be a static string and is
+   reported to the watchdog. Returns 0 on success, -1 if TASK_MAX tasks are already scheduled. */
+int task_start(const char *name, task_step_cb *step, void *state);
+
+/* Returns true if a task with the given state is scheduled */
+bool task_pending(const void *state);
+
+/* Calls the steps of scheduled tasks round-robin until all are finished or budget_us microseconds have
+   elapsed. Every scheduled task gets at least one step per call so that none starves.
+   Should be called once per main loop iteration. */
+void tasks_run(Tox *m, uint32_t budget_us);
+
+/* Writes task scheduler metrics to fp */
+void tasks_print_metrics(FILE *fp);
+
+#endif /* TASKS_H */
@@ -0,0 +1,278 @@
+/*  timers.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L    /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <tox/tox.h>
+
+#include "watchdog.h"
+#include "timers.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_DELTA ((1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+#define LEVEL_FIRING TIMER_LEVELS    /* the timer is on the list of expired timers being fired */
+
+static struct {
+    struct Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];    /* bit i is set if slots[level][i] is non-empty */
+    uint64_t now;                       /* next tick to process; 0 until the first timer is set */
+    uint32_t num_pending;
+    struct Timer *firing;               /* expired timers not yet fired, so callbacks can cancel them */
+
+    uint64_t fired;
+    uint64_t cascaded;
+    uint64_t max_late_ms;
+} Wheel;
+
+_Static_assert(TIMER_SLOTS == 64, "occupied bitmaps assume 64 slots per level");
+
+uint64_t timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_init(struct Timer *t, const char *name, timer_cb *cb, void *data)
+{
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->cb = cb;
+    t->data = data;
+    t->name = name;
+    t->level = -1;
+}
+
+static void enqueue(struct Timer *t)
+{
+    uint64_t expires = t->expires < Wheel.now ? Wheel.now : t->expires;
+    uint64_t delta = expires - Wheel.now;
+    int level = 0;
+
+    if (delta > MAX_DELTA)
+        expires = Wheel.now + MAX_DELTA;    /* re-queued with its real expiry when the top level cascades */
+
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << (TIMER_LEVEL_BITS * (level + 1)))
+        ++level;
+
+    uint8_t slot = (expires >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+    struct Timer **head = &Wheel.slots[level][slot];
+
+    t->level = level;
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *head;
+
+    if (*head)
+        (*head)->prev = t;
+
+    *head = t;
+    Wheel.occupied[level] |= 1ULL << slot;
+}
+
+static void unlink_timer(struct Timer *t)
+{
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else if (t->level == LEVEL_FIRING) {
+        Wheel.firing = t->next;
+    } else {
+        Wheel.slots[t->level][t->slot] = t->next;
+
+        if (t->next == NULL)
+            Wheel.occupied[t->level] &= ~(1ULL << t->slot);
+    }
+
+    if (t->next)
+        t->next->prev = t->prev;
+
+    t->next = t->prev = NULL;
+    t->level = -1;
+}
+
+/* Removes and returns the whole list in a slot */
+static struct Timer *take_slot(int level, int slot)
+{
+    struct Timer *list = Wheel.slots[level][slot];
+    Wheel.slots[level][slot] = NULL;
+    Wheel.occupied[level] &= ~(1ULL << slot);
+    return list;
+}
+
+void timer_set(struct Timer *t, uint64_t delay_ms)
+{
+    uint64_t now = timer_now();
+
+    if (timer_pending(t))
+        timer_cancel(t);
+
+    /* with nothing queued the wheel can jump straight to the present */
+    if (Wheel.num_pending == 0 && now > Wheel.now)
+        Wheel.now = now;
+
+    t->expires = now + delay_ms;
+    enqueue(t);
+    ++Wheel.num_pending;
+}
+
+void timer_set_earliest(struct Timer *t, uint64_t delay_ms)
+{
+    if (!timer_pending(t) || timer_now() + delay_ms < t->expires)
+        timer_set(t, delay_ms);
+}
+
+void timer_cancel(struct Timer *t)
+{
+    if (!timer_pending(t))
+        return;
+
+    unlink_timer(t);
+    --Wheel.num_pending;
+}
+
+/* Moves the timers of the current slot of level down to the levels below. Returns the slot index. */
+static int cascade(int level)
+{
+    int slot = (Wheel.now >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+    struct Timer *t = take_slot(level, slot);
+
+    while (t) {
+        struct Timer *next = t->next;
+        enqueue(t);
+        ++Wheel.cascaded;
+        t = next;
+    }
+
+    return slot;
+}
+
+void timers_run(Tox *m)
+{
+    if (Wheel.now == 0)
+        return;
+
+    uint64_t target = timer_now();
+    struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_TIMERS, NULL);
+
+    while (Wheel.now <= target) {
+        if (Wheel.num_pending == 0) {
+            Wheel.now = target + 1;
+            break;
+        }
+
+        int slot = Wheel.now & SLOT_MASK;
+
+        /* nothing due in level 0 before the next cascade; skip straight to it */
+        if (slot != 0 && (Wheel.occupied[0] >> slot) == 0) {
+            uint64_t boundary = (Wheel.now | SLOT_MASK) + 1;
+            Wheel.now = boundary <= target ? boundary : target + 1;
+            continue;
+        }
+
+        int level = 0;
+
+        while (slot == 0 && ++level < TIMER_LEVELS)
+            slot = cascade(level);
+
+        struct Timer *t;
+        Wheel.firing = take_slot(0, Wheel.now & SLOT_MASK);
+        ++Wheel.now;
+
+        for (t = Wheel.firing; t; t = t->next)
+            t->level = LEVEL_FIRING;
+
+        while ((t = Wheel.firing)) {
+            timer_cancel(t);
+
+            uint64_t late = target - t->expires;
+
+            if (late > Wheel.max_late_ms)
+                Wheel.max_late_ms = late;
+
+            ++Wheel.fired;
+            watchdog_set_phase(PHASE_TIMERS, t->name);
+            t->cb(m, t->data);
+        }
+    }
+
+    watchdog_restore_phase(prev_phase);
+}
+
+/* Returns the offset from index of the first set bit of occupied, rotating past 63 */
+static int next_slot(uint64_t occupied, int index)
+{
+    uint64_t rotated = index ? (occupied >> index) | (occupied << (TIMER_SLOTS - index)) : occupied;
+    return __builtin_ctzll(rotated);
+}
+
+int64_t timers_next_ms(void)
+{
+    if (Wheel.num_pending == 0)
+        return -1;
+
+    uint64_t next = UINT64_MAX;
+    int level;
+
+    for (level = 0; level < TIMER_LEVELS; ++level) {
+        if (Wheel.occupied[level] == 0)
+            continue;
+
+        int shift = TIMER_LEVEL_BITS * level;
+        uint64_t block = Wheel.now >> shift;
+        int index = block & SLOT_MASK;
+        uint64_t occupied = Wheel.occupied[level];
+        uint64_t when;
+
+        if (level > 0 && (Wheel.now & ((1ULL << shift) - 1)) == 0 && (occupied & (1ULL << index))) {
+            when = Wheel.now;    /* the current slot is about to cascade */
+        } else {
+            /* a slot's timers move down when the wheel enters its block, so those in the current slot of
+               a higher level are a full revolution away */
+            if (level > 0 && occupied != 1ULL << index)
+                occupied &= ~(1ULL << index);
+
+            int offset = next_slot(occupied, index);
+            when = (block + (offset || level == 0 ? offset : TIMER_SLOTS)) << shift;
+        }
+
+        if (when < next)
+            next = when;
+    }
+
+    uint64_t now = timer_now();
+    return next > now ? (int64_t) (next - now) : 0;
+}
+
+void timers_print_metrics(FILE *fp)
+{
+    fprintf(fp, "timers_pending %u\n", Wheel.num_pending);
+    fprintf(fp, "timers_fired %"PRIu64"\n", Wheel.fired);
+    fprintf(fp, "timers_cascaded %"PRIu64"\n", Wheel.cascaded);
+    fprintf(fp, "timers_max_late_seconds %.3f\n", Wheel.max_late_ms / 1e3);
+}
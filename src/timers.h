@@ -0,0 +1,86 @@
+/*  timers.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <tox/tox.h>
+
+/* A hierarchical timing wheel driven by CLOCK_MONOTONIC with 1 ms ticks. Each level has TIMER_SLOTS slots
+   and covers TIMER_SLOTS times the span of the one below; timers further out than the top level are parked
+   in it and re-queued when it comes around. Setting and cancelling a timer are O(1). */
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 5    /* about 12 days before timers need re-queueing */
+
+typedef void timer_cb(Tox *m, void *data);
+
+/* Embedded in the owner's state; the owner must not move or free it while it's pending */
+struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    uint64_t expires;    /* monotonic ms */
+    timer_cb *cb;
+    void *data;
+    const char *name;    /* reported to the watchdog; must be a static string */
+    int8_t level;        /* -1 if the timer isn't pending */
+    uint8_t slot;
+};
+
+/* Static initializer equivalent to timer_init() */
+#define TIMER_INITIALIZER(name_, cb_, data_) { .cb = (cb_), .data = (data_), .name = (name_), .level = -1 }
+
+/* Returns the current CLOCK_MONOTONIC time in ms */
+uint64_t timer_now(void);
+
+/* Prepares t to call cb(m, data) when it fires. Must be called before any other use of t. */
+void timer_init(struct Timer *t, const char *name, timer_cb *cb, void *data);
+
+/* (Re)schedules t to fire delay_ms from now, cancelling it first if it's pending. Timers fire on the first
+   timers_run() on or after their 1 ms tick has passed. */
+void timer_set(struct Timer *t, uint64_t delay_ms);
+
+/* Schedules t to fire at delay_ms from now unless it's already pending to fire sooner */
+void timer_set_earliest(struct Timer *t, uint64_t delay_ms);
+
+void timer_cancel(struct Timer *t);
+
+static inline bool timer_pending(const struct Timer *t)
+{
+    return t->level >= 0;
+}
+
+/* Fires all timers that have expired. Callbacks may set or cancel any timer, including their own. */
+void timers_run(Tox *m);
+
+/* Returns the number of ms until timers_run() may have work to do, or -1 if no timer is pending.
+   May return less than the time to the next expiry, never more. */
+int64_t timers_next_ms(void);
+
+/* Writes timer metrics to fp */
+void timers_print_metrics(FILE *fp);
+
+#endif /* TIMERS_H */
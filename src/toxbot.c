@@ -38,17 +38,43 @@
 #include <tox/toxav.h>
 
 #include "misc.h"
+#include "arena.h"
 #include "commands.h"
 #include "toxbot.h"
 #include "groupchats.h"
+#include "connection.h"
+#include "metrics.h"
+#include "friendreq.h"
+#include "log.h"
+#include "admin.h"
+#include "watchdog.h"
+#include "savefile.h"
+#include "playback.h"
+#include "recorder.h"
+#include "archive.h"
+#include "spam.h"
+#include "friends.h"
+#include "mem.h"
+#include "tasks.h"
+#include "timers.h"
+#include "bans.h"
+#include "pools.h"
+#include "events.h"
+#include "inbox.h"
+#include "bridges.h"
 #include "version.h"
 
 #define FRIEND_PURGE_INTERVAL 3600
-#define GROUP_PURGE_INTERVAL 3600
+#define SAVE_DELAY 2    /* seconds to coalesce savedata changes before writing them out */
 
 bool FLAG_EXIT = false;    /* set on SIGINT */
 char *DATA_FILE = "toxbot_save";
 char *MASTERLIST_FILE = "masterkeys";
+char *METRICS_FILE = "toxbot_metrics";
+char *LOG_FILE = "toxbot_log";
+char *BLOCKLIST_FILE = "blocklist";
+char *BANLIST_FILE = "banlist";
+char *POOLS_FILE = "pools";
 
 struct Tox_Bot Tox_Bot;
 
@@ -58,6 +84,7 @@ static void init_toxbot_state(void)
     Tox_Bot.default_groupnum = 0;
     Tox_Bot.chats_idx = 0;
     Tox_Bot.num_online_friends = 0;
+    Tox_Bot.admit_limit = DEFAULT_ADMIT_LIMIT;
 
     /* 1 year default; anything lower should be explicitly set until we have a config file */
     Tox_Bot.inactive_limit = 31536000;
@@ -68,27 +95,77 @@ static void catch_SIGINT(int sig)
     FLAG_EXIT = true;
 }
 
-static void exit_groupchats(Tox *m, uint32_t numchats)
+#define EXIT_GROUPS_STEP 8    /* groups left per task step */
+
+/* Leaves all groupchats a few at a time on shutdown, so that tox_iterate keeps running and gets the
+   part packets out. A snapshot of the chat list is taken when the task starts. */
+static struct {
+    int32_t *groups;
+    uint32_t num_groups;
+    uint32_t cursor;
+} Exit_Groups;
+
+static bool exit_groups_step(Tox *m, void *state)
 {
-    memset(Tox_Bot.g_chats, 0, Tox_Bot.chats_idx * sizeof(struct Group_Chat));
-    realloc_groupchats(0);
+    uint32_t end = MIN(Exit_Groups.cursor + EXIT_GROUPS_STEP, Exit_Groups.num_groups);
 
-    int32_t *groupchat_list = malloc(numchats * sizeof(int32_t));
+    for (; Exit_Groups.cursor < end; ++Exit_Groups.cursor) {
+        int32_t groupnum = Exit_Groups.groups[Exit_Groups.cursor];
+        tox_del_groupchat(m, groupnum);
+        group_leave(groupnum);
+    }
 
-    if (groupchat_list == NULL)
-        return;
+    if (Exit_Groups.cursor < Exit_Groups.num_groups)
+        return false;
+
+    mem_free(Exit_Groups.groups);
+    Exit_Groups.groups = NULL;
+    return true;
+}
+
+/* Returns 0 if the task was started, -1 if there's nothing to leave or it couldn't be started */
+static int exit_groups_start(Tox *m)
+{
+    uint32_t numchats = tox_count_chatlist(m);
+
+    if (numchats == 0)
+        return -1;
+
+    Exit_Groups.groups = mem_alloc(MEM_GROUPS, numchats * sizeof(int32_t));
+
+    if (Exit_Groups.groups == NULL)
+        return -1;
+
+    Exit_Groups.num_groups = tox_get_chatlist(m, Exit_Groups.groups, numchats);
+    Exit_Groups.cursor = 0;
+
+    if (task_start("exit_groupchats", exit_groups_step, &Exit_Groups) == -1) {
+        mem_free(Exit_Groups.groups);
+        Exit_Groups.groups = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Leaves whatever groups are left in one go; used after the exit task, or instead of it if it couldn't start */
+static void exit_groupchats(Tox *m, uint32_t numchats)
+{
+    int32_t *groupchat_list = arena_alloc(numchats * sizeof(int32_t));
 
     if (tox_get_chatlist(m, groupchat_list, numchats) == 0) {
-        free(groupchat_list);
+        arena_reset();
         return;
     }
 
     uint32_t i;
 
-    for (i = 0; i < numchats; ++i)
+    for (i = 0; i < numchats; ++i) {
         tox_del_groupchat(m, groupchat_list[i]);
+        group_leave(groupchat_list[i]);
+    }
 
-    free(groupchat_list);
+    arena_reset();
 }
 
 static void exit_toxbot(Tox *m)
@@ -98,84 +175,281 @@ static void exit_toxbot(Tox *m)
     if (numchats)
         exit_groupchats(m, numchats);
 
+    admin_close();
+    playback_close();
+    recorder_close();
+    archive_close();
     save_data(m, DATA_FILE);
     tox_kill(m);
     exit(EXIT_SUCCESS);
 }
 
-/* Returns true if friendnumber's Tox ID is in the masterkeys list, false otherwise.
-   Note that it only compares the public key portion of the IDs. */
-bool friend_is_master(Tox *m, uint32_t friendnumber)
+int master_keys_load(struct Master_Keys *mk)
 {
+    mk->keys = NULL;
+    mk->count = 0;
+
     if (!file_exists(MASTERLIST_FILE)) {
         FILE *fp = fopen(MASTERLIST_FILE, "w");
 
         if (fp == NULL) {
-            fprintf(stderr, "Warning: failed to create masterkeys file\n");
-            return false;
+            log_event(LOG_WARNING, EV_MASTERKEYS_ERROR, -1, -1, 0, "failed to create masterkeys file");
+            return -1;
         }
 
         fclose(fp);
-        fprintf(stderr, "Warning: creating new masterkeys file. Did you lose the old one?\n");
-        return false;
+        log_event(LOG_WARNING, EV_MASTERKEYS_ERROR, -1, -1, 0, "created new masterkeys file");
+        return -1;
     }
 
     FILE *fp = fopen(MASTERLIST_FILE, "r");
 
     if (fp == NULL) {
-        fprintf(stderr, "Warning: failed to read masterkeys file\n");
-        return false;
-    }
-
-    char friend_key[TOX_PUBLIC_KEY_SIZE];
-    if (tox_friend_get_public_key(m, friendnumber, (uint8_t *) friend_key, NULL) == 0) {
-        fclose(fp);
-        return false;
+        log_event(LOG_WARNING, EV_MASTERKEYS_ERROR, -1, -1, 0, "failed to read masterkeys file");
+        return -1;
     }
 
     char id[256];
+    size_t cap = 0;
 
     while (fgets(id, sizeof(id), fp)) {
         int len = strlen(id);
 
-        if (--len < TOX_PUBLIC_KEY_SIZE)
+        if (--len < TOX_PUBLIC_KEY_SIZE * 2)
             continue;
 
-        char *key_bin = hex_string_to_bin(id);
+        char key_bin[TOX_PUBLIC_KEY_SIZE];
 
-        if (memcmp(key_bin, friend_key, TOX_PUBLIC_KEY_SIZE) == 0) {
-            free(key_bin);
-            fclose(fp);
-            return true;
+        if (hex_string_to_bin(id, TOX_PUBLIC_KEY_SIZE * 2, key_bin, sizeof(key_bin)) == -1)
+            continue;
+
+        if (mk->count == cap) {
+            size_t new_cap = cap ? cap * 2 : 16;
+            uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE] = mem_realloc(MEM_FRIENDS, mk->keys, new_cap * TOX_PUBLIC_KEY_SIZE);
+
+            if (keys == NULL)
+                break;
+
+            mk->keys = keys;
+            cap = new_cap;
         }
 
-        free(key_bin);
+        memcpy(mk->keys[mk->count++], key_bin, TOX_PUBLIC_KEY_SIZE);
     }
 
     fclose(fp);
+    return 0;
+}
+
+void master_keys_free(struct Master_Keys *mk)
+{
+    mem_free(mk->keys);
+    mk->keys = NULL;
+    mk->count = 0;
+}
+
+bool master_keys_match(Tox *m, const struct Master_Keys *mk, uint32_t friendnumber)
+{
+    uint8_t friend_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (mk->count == 0 || tox_friend_get_public_key(m, friendnumber, friend_key, NULL) == 0)
+        return false;
+
+    size_t i;
+
+    for (i = 0; i < mk->count; ++i) {
+        if (memcmp(mk->keys[i], friend_key, TOX_PUBLIC_KEY_SIZE) == 0)
+            return true;
+    }
+
     return false;
 }
 
+/* Returns true if friendnumber's Tox ID is in the masterkeys list or friendnumber is ADMIN_FRIENDNUM, false otherwise.
+   Note that it only compares the public key portion of the IDs. */
+bool friend_is_master(Tox *m, uint32_t friendnumber)
+{
+    /* admin socket peers were authenticated by their credentials */
+    if (friendnumber == (uint32_t) ADMIN_FRIENDNUM)
+        return true;
+
+    struct Master_Keys mk;
+    master_keys_load(&mk);
+
+    bool master = master_keys_match(m, &mk, friendnumber);
+    master_keys_free(&mk);
+    return master;
+}
+
+/* Updates the cached role of the friend with Tox ID id, if there is one. Call after adding id to the
+   masterkeys list. */
+void friend_master_added(Tox *m, const char *id)
+{
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+    if (hex_string_to_bin(id, TOX_PUBLIC_KEY_SIZE * 2, (char *) key, sizeof(key)) == -1)
+        return;
+
+    TOX_ERR_FRIEND_BY_PUBLIC_KEY err;
+    uint32_t friendnum = tox_friend_by_public_key(m, key, &err);
+
+    if (err == TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK)
+        friend_track(friendnum, true);
+}
+
+struct Last_Online {
+    uint64_t time;
+    uint32_t friendnum;
+};
+
+static int last_online_cmp(const void *a, const void *b)
+{
+    const struct Last_Online *x = a, *y = b;
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+/* Registers every friend with the friends registry. Friends are tracked least recently online first, so
+   the eviction order starts out by last online time. */
+static void track_friends(Tox *m)
+{
+    size_t i, size = tox_self_get_friend_list_size(m);
+
+    if (size == 0)
+        return;
+
+    uint32_t *list = mem_alloc(MEM_FRIENDS, size * sizeof(uint32_t));
+    struct Last_Online *order = mem_alloc(MEM_FRIENDS, size * sizeof(struct Last_Online));
+
+    if (list == NULL || order == NULL)
+        exit(EXIT_FAILURE);
+
+    tox_self_get_friend_list(m, list);
+
+    for (i = 0; i < size; ++i) {
+        order[i].time = tox_friend_get_last_online(m, list[i], NULL);
+        order[i].friendnum = list[i];
+    }
+
+    qsort(order, size, sizeof(struct Last_Online), last_online_cmp);
+
+    struct Master_Keys masters;
+    master_keys_load(&masters);
+
+    for (i = 0; i < size; ++i)
+        friend_track(order[i].friendnum, master_keys_match(m, &masters, order[i].friendnum));
+
+    master_keys_free(&masters);
+
+    mem_free(order);
+    mem_free(list);
+}
+
 /* START CALLBACKS */
+/* The callbacks only decode their arguments into an event and publish it. The work is done by the
+   subscribers below and in the modules that subscribe themselves. */
 static void cb_self_connection_change(Tox *m, TOX_CONNECTION connection_status, void *userdata)
 {
-    switch (connection_status) {
-        case TOX_CONNECTION_NONE:
-            fprintf(stderr, "Connection to Tox network has been lost\n");
-            break;
+    struct Event ev = { .type = EVENT_SELF_CONNECTION, .time = (uint64_t) time(NULL) };
+    ev.self_connection.status = connection_status;
+    event_publish(m, &ev);
+}
 
-        case TOX_CONNECTION_TCP:
-            fprintf(stderr, "Connection to Tox network is weak (using TCP)\n");
-            break;
+static void cb_friend_connection_change(Tox *m, uint32_t friendnumber, TOX_CONNECTION connection_status, void *userdata)
+{
+    struct Event ev = { .type = EVENT_FRIEND_CONNECTION, .time = (uint64_t) time(NULL) };
+    ev.friend_connection.friendnum = friendnumber;
+    ev.friend_connection.status = connection_status;
+    event_publish(m, &ev);
+}
 
-        case TOX_CONNECTION_UDP:
-            fprintf(stderr, "Connection to Tox network is strong (using UDP)\n");
-            break;
+/* Requests from banned keys are dropped before anything else sees them */
+static void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length,
+                              void *userdata)
+{
+    if (ban_check(public_key)) {
+        log_event(LOG_DEBUG, EV_FRIEND_REQUEST_BANNED, -1, -1, 0, NULL);
+        return;
     }
+
+    struct Event ev = { .type = EVENT_FRIEND_REQUEST, .time = (uint64_t) time(NULL) };
+    ev.friend_request.public_key = public_key;
+    event_publish(m, &ev);
 }
 
-static void cb_friend_connection_change(Tox *m, uint32_t friendnumber, TOX_CONNECTION connection_status, void *userdata)
+static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t *string,
+                              size_t length, void *userdata)
+{
+    if (type != TOX_MESSAGE_TYPE_NORMAL || ban_check_friend(m, friendnumber))
+        return;
+
+    char message[TOX_MAX_MESSAGE_LENGTH];
+    length = copy_tox_str(message, sizeof(message), (const char *) string, length);
+    message[length] = '\0';
+
+    struct Event ev = { .type = EVENT_FRIEND_MESSAGE, .time = (uint64_t) time(NULL) };
+    ev.friend_message.friendnum = friendnumber;
+    ev.friend_message.text = message;
+    ev.friend_message.length = length;
+    event_publish(m, &ev);
+}
+
+static void cb_group_invite(Tox *m, int32_t friendnumber, uint8_t type, const uint8_t *group_pub_key, uint16_t length,
+                            void *userdata)
+{
+    struct Event ev = { .type = EVENT_GROUP_INVITE, .time = (uint64_t) time(NULL) };
+    ev.group_invite.friendnum = friendnumber;
+    ev.group_invite.type = type;
+    ev.group_invite.data = group_pub_key;
+    ev.group_invite.length = length;
+    event_publish(m, &ev);
+}
+
+static void cb_group_titlechange(Tox *m, int groupnumber, int peernumber, const uint8_t *title, uint8_t length,
+                                 void *userdata)
+{
+    char message[TOX_MAX_MESSAGE_LENGTH];
+
+    struct Event ev = { .type = EVENT_GROUP_TITLE, .time = (uint64_t) time(NULL) };
+    ev.group_title.groupnum = groupnumber;
+    ev.group_title.peernum = peernumber;
+    ev.group_title.title = message;
+    ev.group_title.length = copy_tox_str(message, sizeof(message), (const char *) title, length);
+    event_publish(m, &ev);
+}
+
+static void cb_group_message(Tox *m, int groupnumber, int peernumber, const uint8_t *message, uint16_t length,
+                             void *userdata)
+{
+    char name[TOX_MAX_NAME_LENGTH];
+
+    struct Event ev = { .type = EVENT_GROUP_MESSAGE, .time = (uint64_t) time(NULL) };
+    ev.group_message.groupnum = groupnumber;
+    ev.group_message.peernum = peernumber;
+    ev.group_message.name = name;
+    ev.group_message.name_len = MAX(tox_group_peername(m, groupnumber, peernumber, (uint8_t *) name), 0);
+    ev.group_message.text = (const char *) message;
+    ev.group_message.length = length;
+    event_publish(m, &ev);
+}
+
+static void cb_group_namelist_change(Tox *m, int groupnumber, int peernumber, uint8_t change, void *userdata)
 {
+    if (change == TOX_CHAT_CHANGE_PEER_NAME)
+        return;
+
+    struct Event ev = { .type = EVENT_GROUP_PEERS, .time = (uint64_t) time(NULL) };
+    ev.group_peers.groupnum = groupnumber;
+    ev.group_peers.peernum = peernumber;
+    ev.group_peers.change = change;
+    event_publish(m, &ev);
+}
+/* END CALLBACKS */
+
+/* START SUBSCRIBERS */
+static void on_friend_connection(Tox *m, const struct Event *ev)
+{
+    friend_set_online(ev->friend_connection.friendnum, ev->friend_connection.status != TOX_CONNECTION_NONE);
+
     /* Count the number of online friends.
      *
      * We have to do this the hard way because our convenient API function to get
@@ -198,122 +472,137 @@ static void cb_friend_connection_change(Tox *m, uint32_t friendnumber, TOX_CONNE
     }
 }
 
-static void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, size_t length,
-                              void *userdata)
+static void on_friend_request(Tox *m, const struct Event *ev)
 {
-    TOX_ERR_FRIEND_ADD err;
-    tox_friend_add_norequest(m, public_key, &err);
-
-    if (err != TOX_ERR_FRIEND_ADD_OK)
-        fprintf(stderr, "tox_friend_add_norequest failed (error %d)\n", err);
-
-    save_data(m, DATA_FILE);
+    if (friendreq_add(ev->friend_request.public_key) == -1)
+        log_event(LOG_WARNING, EV_FRIEND_REQUEST_DROPPED, -1, -1, 0, NULL);
 }
 
-static void cb_friend_message(Tox *m, uint32_t friendnumber, TOX_MESSAGE_TYPE type, const uint8_t *string,
-                              size_t length, void *userdata)
+/* Queues the message for execution by the sender's cached role, so masters skip ahead of public traffic */
+static void on_friend_message(Tox *m, const struct Event *ev)
 {
-    if (type != TOX_MESSAGE_TYPE_NORMAL)
+    uint32_t friendnumber = ev->friend_message.friendnum;
+    friend_touch(friendnumber);
+
+    if (ev->friend_message.length == 0)
         return;
 
-    const char *outmsg;
-    char message[TOX_MAX_MESSAGE_LENGTH];
-    length = copy_tox_str(message, sizeof(message), (const char *) string, length);
-    message[length] = '\0';
+    const struct Friend_Info *f = friend_info(friendnumber);
+    INBOX_CLASS cls = f && f->master ? INBOX_MASTER : INBOX_PUBLIC;
 
-    if (length && execute(m, friendnumber, message, length) == -1) {
-        outmsg = "Invalid command. Type help for a list of commands";
-        tox_friend_send_message(m, friendnumber, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *) outmsg, strlen(outmsg), NULL);
-    }
+    inbox_push(m, friendnumber, cls, ev->friend_message.text, ev->friend_message.length);
 }
 
-static void cb_group_invite(Tox *m, int32_t friendnumber, uint8_t type, const uint8_t *group_pub_key, uint16_t length,
-                            void *userdata)
+static void on_group_invite(Tox *m, const struct Event *ev)
 {
+    int32_t friendnumber = ev->group_invite.friendnum;
+    uint8_t type = ev->group_invite.type;
+
     if (!friend_is_master(m, friendnumber))
         return;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    tox_friend_get_name(m, friendnumber, (uint8_t *) name, NULL);
-    size_t len = tox_friend_get_name_size(m, friendnumber, NULL);
-    name[len] = '\0';
-
     int groupnum = -1;
 
     if (type == TOX_GROUPCHAT_TYPE_TEXT)
-        groupnum = tox_join_groupchat(m, friendnumber, group_pub_key, length);
+        groupnum = tox_join_groupchat(m, friendnumber, ev->group_invite.data, ev->group_invite.length);
     else if (type == TOX_GROUPCHAT_TYPE_AV)
-        groupnum = toxav_join_av_groupchat(m, friendnumber, group_pub_key, length, NULL, NULL);
+        groupnum = toxav_join_av_groupchat(m, friendnumber, ev->group_invite.data, ev->group_invite.length,
+                                           recorder_audio_cb, NULL);
 
     if (groupnum == -1) {
-        fprintf(stderr, "Invite from %s failed (core failure)\n", name);
+        log_event(LOG_WARNING, EV_GROUP_INVITE_FAILED, friendnumber, -1, 0, "core failure");
         return;
     }
 
     if (group_add(groupnum, type, NULL) == -1) {
-        fprintf(stderr, "Invite from %s failed (group_add failed)\n", name);
+        log_event(LOG_WARNING, EV_GROUP_INVITE_FAILED, friendnumber, groupnum, 0, "group_add failed");
         tox_del_groupchat(m, groupnum);
         return;
     }
 
-    printf("Accepted groupchat invite from %s [%d]\n", name, groupnum);
+    log_event(LOG_INFO, EV_GROUP_INVITE_ACCEPTED, friendnumber, groupnum, 0, NULL);
 }
 
-static void cb_group_titlechange(Tox *m, int groupnumber, int peernumber, const uint8_t *title, uint8_t length,
-                                 void *userdata)
+static void on_group_title(Tox *m, const struct Event *ev)
 {
-    char message[TOX_MAX_MESSAGE_LENGTH];
-    length = copy_tox_str(message, sizeof(message), (const char *) title, length);
-
-    int idx = group_index(groupnumber);
+    int idx = group_index(ev->group_title.groupnum);
 
     if (idx == -1)
         return;
 
-    memcpy(Tox_Bot.g_chats[idx].title, message, length + 1);
-    Tox_Bot.g_chats[idx].title_len = length;
+    memcpy(Tox_Bot.g_chats[idx].title, ev->group_title.title, ev->group_title.length + 1);
+    Tox_Bot.g_chats[idx].title_len = ev->group_title.length;
+    Tox_Bot.g_chats[idx].title_pending = false;
+    info_cache_invalidate();
+}
+
+static void on_group_message(Tox *m, const struct Event *ev)
+{
+    group_count(ev->group_message.groupnum, GROUP_RATE_MESSAGES, ev->time);
+}
+
+static void on_group_peers(Tox *m, const struct Event *ev)
+{
+    GROUP_RATE rate = ev->group_peers.change == TOX_CHAT_CHANGE_PEER_ADD ? GROUP_RATE_JOINS : GROUP_RATE_LEAVES;
+
+    group_count(ev->group_peers.groupnum, rate, ev->time);
+    group_peer_change(m, ev->group_peers.groupnum, ev->group_peers.peernum, ev->group_peers.change);
 }
-/* END CALLBACKS */
+
+static void subscribe_events(void)
+{
+    event_subscribe(EVENT_FRIEND_CONNECTION, "friends", on_friend_connection);
+    event_subscribe(EVENT_FRIEND_REQUEST, "friend_requests", on_friend_request);
+    event_subscribe(EVENT_FRIEND_MESSAGE, "commands", on_friend_message);
+    event_subscribe(EVENT_GROUP_INVITE, "group_invites", on_group_invite);
+    event_subscribe(EVENT_GROUP_TITLE, "group_titles", on_group_title);
+    event_subscribe(EVENT_GROUP_MESSAGE, "group_rates", on_group_message);
+    event_subscribe(EVENT_GROUP_PEERS, "group_peers", on_group_peers);
+}
+/* END SUBSCRIBERS */
+
+/* Reused across saves so that steady-state saving doesn't hit the allocator. Only ever grows. */
+static char *save_buf;
+static size_t save_buf_size;
 
 int save_data(Tox *m, const char *path)
 {
+    struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_SAVE, NULL);
+
     if (path == NULL)
         goto on_error;
 
-    FILE *fp = fopen(path, "wb");
+    size_t data_len = tox_get_savedata_size(m);
 
-    if (fp == NULL)
-        return -1;
+    if (data_len > save_buf_size) {
+        char *tmp = mem_realloc(MEM_PERSISTENCE, save_buf, data_len);
 
-    size_t data_len = tox_get_savedata_size(m);
-    char *data = malloc(data_len);
+        if (tmp == NULL)
+            goto on_error;
 
-    if (data == NULL)
-        goto on_error;
+        save_buf = tmp;
+        save_buf_size = data_len;
+    }
 
-    tox_get_savedata(m, (uint8_t *) data);
+    tox_get_savedata(m, (uint8_t *) save_buf);
 
-    if (fwrite(data, data_len, 1, fp) != 1) {
-        free(data);
-        fclose(fp);
+    if (savefile_write(path, save_buf, data_len) == -1)
         goto on_error;
-    }
 
-    free(data);
-    fclose(fp);
+    watchdog_restore_phase(prev_phase);
     return 0;
 
 on_error:
-    fprintf(stderr, "Warning: save_data failed\n");
+    log_event(LOG_ERROR, EV_SAVE_FAILED, -1, -1, 0, path);
+    watchdog_restore_phase(prev_phase);
     return -1;
 }
 
 static Tox *load_tox(struct Tox_Options *options, char *path)
 {
-    FILE *fp = fopen(path, "rb");
     Tox *m = NULL;
 
-    if (fp == NULL) {
+    if (!file_exists(path)) {
         TOX_ERR_NEW err;
         m = tox_new(options, &err);
 
@@ -326,19 +615,11 @@ static Tox *load_tox(struct Tox_Options *options, char *path)
         return m;
     }
 
-    off_t data_len = file_size(path);
-
-    if (data_len == 0) {
-        fclose(fp);
-        return NULL;
-    }
+    size_t data_len;
+    char *data = savefile_read(path, &data_len);
 
-    char data[data_len];
-
-    if (fread(data, sizeof(data), 1, fp) != 1) {
-        fclose(fp);
+    if (data == NULL)
         return NULL;
-    }
 
     TOX_ERR_NEW err;
     options->savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
@@ -346,13 +627,13 @@ static Tox *load_tox(struct Tox_Options *options, char *path)
     options->savedata_length = data_len;
 
     m = tox_new(options, &err);
+    mem_free(data);
 
     if (err != TOX_ERR_NEW_OK) {
         fprintf(stderr, "tox_new failed with error %d\n", err);
         return NULL;
     }
 
-    fclose(fp);
     return m;
 }
 
@@ -373,6 +654,8 @@ static Tox *init_tox(void)
     tox_callback_friend_message(m, cb_friend_message, NULL);
     tox_callback_group_invite(m, cb_group_invite, NULL);
     tox_callback_group_title(m, cb_group_titlechange, NULL);
+    tox_callback_group_message(m, cb_group_message, NULL);
+    tox_callback_group_namelist_change(m, cb_group_namelist_change, NULL);
 
     size_t s_len = tox_self_get_status_message_size(m);
 
@@ -389,36 +672,6 @@ static Tox *init_tox(void)
     return m;
 }
 
-/* TODO: hardcoding is bad stop being lazy */
-static struct toxNodes {
-    const char *ip;
-    uint16_t    port;
-    const char *key;
-} nodes[] = {
-    { "144.76.60.215",   33445, "04119E835DF3E78BACF0F84235B300546AF8B936F035185E2A8E9E0A67C8924F" },
-    { "192.210.149.121", 33445, "F404ABAA1C99A9D37D61AB54898F56793E1DEF8BD46B1038B9D822E8460FAB67" },
-    { "195.154.119.113", 33445, "E398A69646B8CEACA9F0B84F553726C1C49270558C57DF5F3C368F05A7D71354" },
-    { "46.38.239.179",   33445, "F5A1A38EFB6BD3C2C8AF8B10D85F0F89E931704D349F1D0720C3C4059AF2440A" },
-    { "76.191.23.96",    33445, "93574A3FAB7D612FEA29FD8D67D3DD10DFD07A075A5D62E8AF3DD9F5D0932E11" },
-    { NULL, 0, NULL },
-};
-
-static void bootstrap_DHT(Tox *m)
-{
-    int i;
-
-    for (i = 0; nodes[i].ip; ++i) {
-        char *key = hex_string_to_bin(nodes[i].key);
-
-        TOX_ERR_BOOTSTRAP err;
-        tox_bootstrap(m, nodes[i].ip, nodes[i].port, (uint8_t *) key, &err);
-        free(key);
-
-        if (err != TOX_ERR_BOOTSTRAP_OK)
-            fprintf(stderr, "Failed to bootstrap DHT via: %s %d (error %d)\n", nodes[i].ip, nodes[i].port, err);
-    }
-}
-
 static void print_profile_info(Tox *m)
 {
     printf("ToxBot version %s\n", VERSION);
@@ -447,20 +700,38 @@ static void print_profile_info(Tox *m)
     printf("Inactive contacts purged after %"PRIu64" days\n", Tox_Bot.inactive_limit / SECONDS_IN_DAY);
 }
 
-static void purge_inactive_friends(Tox *m)
+static void save_timeout(Tox *m, void *data)
 {
-    size_t numfriends = tox_self_get_friend_list_size(m);
+    save_data(m, DATA_FILE);
+}
 
-    if (numfriends == 0)
-        return;
+static struct Timer save_timer = TIMER_INITIALIZER("save_data", save_timeout, NULL);
 
-    uint32_t friend_list[numfriends];
-    tox_self_get_friend_list(m, friend_list);
+/* Saves within SAVE_DELAY seconds, coalescing changes made in the meantime */
+static void schedule_save(void)
+{
+    timer_set_earliest(&save_timer, SAVE_DELAY * 1000);
+}
 
-    size_t i;
+#define PURGE_STEP 64    /* friends checked per task step */
+
+/* Deletes friends that have been offline for longer than the inactive limit, PURGE_STEP at a time.
+   Works on a snapshot of the friend list taken when the task starts; friends deleted in the meantime
+   are skipped. */
+static struct {
+    uint32_t *friends;
+    size_t num_friends;
+    size_t cursor;
+    uint64_t cur_time;
+    uint32_t purged;
+} Purge;
+
+static bool purge_step(Tox *m, void *state)
+{
+    size_t end = MIN(Purge.cursor + PURGE_STEP, Purge.num_friends);
 
-    for (i = 0; i < numfriends; ++i) {
-        uint32_t friendnum = friend_list[i];
+    for (; Purge.cursor < end; ++Purge.cursor) {
+        uint32_t friendnum = Purge.friends[Purge.cursor];
 
         if (!tox_friend_exists(m, friendnum))
             continue;
@@ -471,29 +742,71 @@ static void purge_inactive_friends(Tox *m)
         if (err != TOX_ERR_FRIEND_GET_LAST_ONLINE_OK)
             continue;
 
-        if (((uint64_t) time(NULL)) - last_online > Tox_Bot.inactive_limit)
+        if (Purge.cur_time - last_online > Tox_Bot.inactive_limit) {
             tox_friend_delete(m, friendnum, NULL);
+            friend_info_remove(friendnum);
+            group_forget_friend(friendnum);
+            ++Purge.purged;
+        }
+    }
+
+    if (Purge.cursor < Purge.num_friends)
+        return false;
+
+    mem_free(Purge.friends);
+    Purge.friends = NULL;
+
+    if (Purge.purged > 0) {
+        log_event(LOG_INFO, EV_FRIENDS_PURGED, -1, -1, Purge.purged, NULL);
+        schedule_save();
     }
+
+    return true;
 }
 
-static void purge_empty_groups(Tox *m)
+static void purge_inactive_friends(Tox *m, uint64_t cur_time)
 {
-    uint32_t i;
+    if (task_pending(&Purge))
+        return;
 
-    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
-        if (!Tox_Bot.g_chats[i].active)
-            continue;
+    size_t numfriends = tox_self_get_friend_list_size(m);
 
-        int num_peers = tox_group_number_peers(m, Tox_Bot.g_chats[i].num);
+    if (numfriends == 0)
+        return;
 
-        if (num_peers <= 1) {
-            fprintf(stderr, "Deleting empty group %i\n", Tox_Bot.g_chats[i].num);
-            tox_del_groupchat(m, i);
-            group_leave(i);
-        }
+    Purge.friends = mem_alloc(MEM_FRIENDS, numfriends * sizeof(uint32_t));
+
+    if (Purge.friends == NULL)
+        return;
+
+    tox_self_get_friend_list(m, Purge.friends);
+    Purge.num_friends = numfriends;
+    Purge.cursor = 0;
+    Purge.cur_time = cur_time;
+    Purge.purged = 0;
+
+    if (task_start("purge_inactive_friends", purge_step, &Purge) == -1) {
+        mem_free(Purge.friends);
+        Purge.friends = NULL;
     }
 }
 
+static void purge_timeout(Tox *m, void *data)
+{
+    struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_PURGE_FRIENDS, NULL);
+    purge_inactive_friends(m, (uint64_t) time(NULL));
+    timer_set(data, FRIEND_PURGE_INTERVAL * 1000);
+    watchdog_restore_phase(prev_phase);
+}
+
+static void metrics_timeout(Tox *m, void *data)
+{
+    struct Watchdog_Phase prev_phase = watchdog_set_phase(PHASE_METRICS, NULL);
+    metrics_write(m, METRICS_FILE, (uint64_t) time(NULL));
+    timer_set(data, METRICS_INTERVAL * 1000);
+    watchdog_restore_phase(prev_phase);
+}
+
 #define REC_TOX_DO_LOOPS_PER_SEC 25
 
 /* Adjusts usleep value so that tox_do runs close to the recommended number of times per second */
@@ -513,44 +826,122 @@ static useconds_t optimal_msleepval(uint64_t *looptimer, uint64_t *loopcount, ui
     return new_sleep;
 }
 
+/* Sleeps for usec microseconds, waking up in between to send audio frames and fire timers as they become due */
+static void loop_sleep(Tox *m, useconds_t usec)
+{
+    while (true) {
+        watchdog_set_phase(PHASE_PLAYBACK, NULL);
+        int wait = playback_do(m);
+        timers_run(m);
+        watchdog_set_phase(PHASE_IDLE, NULL);
+
+        int64_t timer_wait = timers_next_ms();
+
+        if (timer_wait >= 0 && (wait < 0 || timer_wait < wait))
+            wait = timer_wait;
+
+        if (wait < 0 || (useconds_t) wait * 1000 >= usec) {
+            usleep(usec);
+            return;
+        }
+
+        usleep(wait * 1000);
+        usec -= wait * 1000;
+    }
+}
+
 int main(int argc, char **argv)
 {
     signal(SIGINT, catch_SIGINT);
     umask(S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 
+    if (log_init(LOG_FILE) == -1)
+        fprintf(stderr, "Warning: failed to map event log %s; logging to stderr\n", LOG_FILE);
+
     Tox *m = init_tox();
 
     if (m == NULL)
         exit(EXIT_FAILURE);
 
     init_toxbot_state();
+    track_friends(m);
+    subscribe_events();
     print_profile_info(m);
-    bootstrap_DHT(m);
+
+    if (admin_init(ADMIN_SOCKET_PATH) == -1)
+        fprintf(stderr, "Warning: failed to create admin socket %s\n", ADMIN_SOCKET_PATH);
+
+    if (watchdog_init() == -1)
+        fprintf(stderr, "Warning: failed to start watchdog\n");
+
+    if (playback_init() == -1)
+        fprintf(stderr, "Warning: failed to start audio decoder thread\n");
+
+    if (recorder_init() == -1)
+        fprintf(stderr, "Warning: failed to start audio writer thread\n");
+
+    if (archive_init() == -1)
+        fprintf(stderr, "Warning: failed to start message archive\n");
+
+    spam_init(BLOCKLIST_FILE);
+    bans_init(BANLIST_FILE);
+    pools_init(POOLS_FILE);
+    bridges_init();    /* after spam_init */
 
     uint64_t looptimer = (uint64_t) time(NULL);
-    uint64_t last_friend_purge = 0;
-    uint64_t last_group_purge = 0;
+
+    struct Timer purge_timer, metrics_timer;
+    timer_init(&purge_timer, "purge_inactive_friends", purge_timeout, &purge_timer);
+    timer_init(&metrics_timer, "metrics", metrics_timeout, &metrics_timer);
+    timer_set(&purge_timer, 0);
+    timer_set(&metrics_timer, 0);
+
+    conn_init(m, looptimer);
     useconds_t msleepval = 40000;
     uint64_t loopcount = 0;
 
-    while (!FLAG_EXIT) {
+    bool exiting = false;
+
+    /* On SIGINT keep looping until the groups have been left */
+    while (!FLAG_EXIT || task_pending(&Exit_Groups)) {
         uint64_t cur_time = (uint64_t) time(NULL);
 
-        if (timed_out(last_friend_purge, cur_time, FRIEND_PURGE_INTERVAL)) {
-            purge_inactive_friends(m);
-            save_data(m, DATA_FILE);
-            last_friend_purge = cur_time;
-        }
+        if (FLAG_EXIT && !exiting) {
+            exiting = true;
 
-        if (timed_out(last_group_purge, cur_time, GROUP_PURGE_INTERVAL)) {
-            purge_empty_groups(m);
-            last_group_purge = cur_time;
+            if (exit_groups_start(m) == -1)
+                break;
         }
 
+        timers_run(m);
+
+        watchdog_set_phase(PHASE_FRIEND_REQUESTS, NULL);
+
+        if (friendreq_do(m, cur_time) > 0)
+            schedule_save();
+
+        watchdog_set_phase(PHASE_SPAM_FILTER, NULL);
+        spam_do(m, cur_time);
+
+        watchdog_set_phase(PHASE_ADMIN, NULL);
+        admin_do(m);
+
+        tasks_run(m, TASK_BUDGET_US);
+
+        watchdog_set_phase(PHASE_BRIDGES, NULL);
+        bridges_do(m);
+
+        watchdog_set_phase(PHASE_TOX_ITERATE, NULL);
         tox_iterate(m);
 
+        watchdog_set_phase(PHASE_COMMAND, NULL);
+        inbox_run(m, INBOX_BUDGET_US);
+
+        watchdog_set_phase(PHASE_IDLE, NULL);
+        watchdog_heartbeat();
+
         msleepval = optimal_msleepval(&looptimer, &loopcount, cur_time, msleepval);
-        usleep(msleepval);
+        loop_sleep(m, msleepval);
     }
 
     exit_toxbot(m);
@@ -30,6 +30,8 @@
 struct Tox_Bot {
     uint64_t start_time;
     uint64_t inactive_limit;
+    uint32_t admit_limit;    /* max number of friend requests accepted per minute */
+    uint32_t friend_capacity;    /* max number of friends; 0 for no limit */
     int default_groupnum;
     bool title_lock;
     int num_online_friends;
@@ -41,4 +43,19 @@ int load_Masters(const char *path);
 int save_data(Tox *m, const char *path);
 bool friend_is_master(Tox *m, uint32_t friendnumber);
 
+/* Public keys of the masterkeys list, for checking many friends with a single read of the file */
+struct Master_Keys {
+    uint8_t (*keys)[TOX_PUBLIC_KEY_SIZE];
+    size_t count;
+};
+
+/* Reads the masterkeys list into mk, which must be released with master_keys_free().
+   Returns 0 on success, -1 if the list couldn't be read (mk is then empty). */
+int master_keys_load(struct Master_Keys *mk);
+void master_keys_free(struct Master_Keys *mk);
+
+/* Returns true if friendnumber's public key is in mk */
+bool master_keys_match(Tox *m, const struct Master_Keys *mk, uint32_t friendnumber);
+void friend_master_added(Tox *m, const char *id);
+
 #endif /* TOXBOT_H */
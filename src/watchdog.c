@@ -0,0 +1,245 @@
+/*  watchdog.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE    /* backtrace, pthread_kill */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "watchdog.h"
+
+#define WATCHDOG_SIGNAL SIGUSR2
+
+/* upper bounds in ms of the stall duration histogram buckets; the last bucket is unbounded */
+static const uint64_t stall_buckets[] = { 2500, 5000, 10000, 30000, 60000 };
+#define NUM_STALL_BUCKETS (sizeof(stall_buckets) / sizeof(stall_buckets[0]) + 1)
+
+static const char *phase_names[NUM_WATCHDOG_PHASES] = {
+    [PHASE_IDLE]            = "idle",
+    [PHASE_TOX_ITERATE]     = "tox_iterate",
+    [PHASE_COMMAND]         = "command",
+    [PHASE_SAVE]            = "save_data",
+    [PHASE_PURGE_FRIENDS]   = "purge_inactive_friends",
+    [PHASE_REAP_GROUPS]     = "reap_empty_groups",
+    [PHASE_FRIEND_REQUESTS] = "friend_requests",
+    [PHASE_ADMIN]           = "admin",
+    [PHASE_CONNECTION]      = "connection",
+    [PHASE_METRICS]         = "metrics",
+    [PHASE_PLAYBACK]        = "playback",
+    [PHASE_SPAM_FILTER]     = "spam_filter",
+    [PHASE_TASKS]           = "tasks",
+    [PHASE_TIMERS]          = "timers",
+    [PHASE_BRIDGES]         = "bridges",
+};
+
+static struct {
+    pthread_t main_thread;
+    pthread_t thread;
+
+    uint64_t last_beat;    /* written by the main thread */
+    WATCHDOG_PHASE phase;
+    const char *detail;
+
+    /* filled in by the signal handler on the main thread */
+    void *frames[WATCHDOG_MAX_FRAMES];
+    int num_frames;
+
+    uint64_t num_stalls;
+    uint64_t total_stall_ms;
+    uint64_t max_stall_ms;
+    uint64_t histogram[NUM_STALL_BUCKETS];
+} Watchdog;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void catch_watchdog_signal(int sig)
+{
+    int n = backtrace(Watchdog.frames, WATCHDOG_MAX_FRAMES);
+    __atomic_store_n(&Watchdog.num_frames, n, __ATOMIC_RELEASE);
+}
+
+static void log_backtrace(void)
+{
+    int i, n = 0;
+
+    /* give the main thread a moment to handle the signal */
+    for (i = 0; i < 10 && n == 0; ++i) {
+        usleep(10000);
+        n = __atomic_load_n(&Watchdog.num_frames, __ATOMIC_ACQUIRE);
+    }
+
+    if (n == 0)
+        return;
+
+    char **symbols = backtrace_symbols(Watchdog.frames, n);
+
+    /* skip the frames of the signal handler itself */
+    for (i = 2; i < n; ++i)
+        log_event(LOG_ERROR, EV_LOOP_STALL_FRAME, -1, -1, (intptr_t) Watchdog.frames[i], symbols ? symbols[i] : NULL);
+
+    free(symbols);
+}
+
+static void record_stall(uint64_t duration)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_STALL_BUCKETS - 1; ++i) {
+        if (duration <= stall_buckets[i])
+            break;
+    }
+
+    ++Watchdog.histogram[i];
+    ++Watchdog.num_stalls;
+    Watchdog.total_stall_ms += duration;
+
+    if (duration > Watchdog.max_stall_ms)
+        Watchdog.max_stall_ms = duration;
+}
+
+static void *watchdog_thread(void *arg)
+{
+    uint64_t stalled_beat = 0;    /* heartbeat timestamp of the stall being tracked; 0 if none */
+
+    while (true) {
+        usleep(WATCHDOG_INTERVAL * 1000);
+
+        uint64_t beat = __atomic_load_n(&Watchdog.last_beat, __ATOMIC_ACQUIRE);
+        uint64_t cur_time = now_ms();
+
+        if (stalled_beat) {
+            if (beat != stalled_beat) {
+                uint64_t duration = beat - stalled_beat;
+                record_stall(duration);
+                log_event(LOG_WARNING, EV_LOOP_STALL_END, -1, -1, duration, NULL);
+                stalled_beat = 0;
+            }
+
+            continue;
+        }
+
+        if (cur_time - beat < WATCHDOG_THRESHOLD)
+            continue;
+
+        stalled_beat = beat;
+
+        WATCHDOG_PHASE phase = __atomic_load_n(&Watchdog.phase, __ATOMIC_ACQUIRE);
+        const char *detail = __atomic_load_n(&Watchdog.detail, __ATOMIC_ACQUIRE);
+        char desc[LOG_PAYLOAD_SIZE];
+        snprintf(desc, sizeof(desc), "%s%s%s", phase_names[phase], detail ? " " : "", detail ? detail : "");
+        log_event(LOG_ERROR, EV_LOOP_STALL, -1, -1, cur_time - beat, desc);
+
+        __atomic_store_n(&Watchdog.num_frames, 0, __ATOMIC_RELEASE);
+
+        if (pthread_kill(Watchdog.main_thread, WATCHDOG_SIGNAL) == 0)
+            log_backtrace();
+    }
+
+    return NULL;
+}
+
+int watchdog_init(void)
+{
+    Watchdog.main_thread = pthread_self();
+    Watchdog.last_beat = now_ms();
+
+    /* backtrace() may allocate the first time it's called, which isn't safe from a signal handler */
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = catch_watchdog_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(WATCHDOG_SIGNAL, &sa, NULL) == -1)
+        return -1;
+
+    /* the watchdog thread must not receive signals meant for the main loop */
+    sigset_t set, old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int ret = pthread_create(&Watchdog.thread, NULL, watchdog_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0)
+        return -1;
+
+    pthread_detach(Watchdog.thread);
+    return 0;
+}
+
+void watchdog_heartbeat(void)
+{
+    __atomic_store_n(&Watchdog.last_beat, now_ms(), __ATOMIC_RELEASE);
+}
+
+struct Watchdog_Phase watchdog_set_phase(WATCHDOG_PHASE phase, const char *detail)
+{
+    struct Watchdog_Phase prev = { Watchdog.phase, Watchdog.detail };
+
+    __atomic_store_n(&Watchdog.detail, detail, __ATOMIC_RELEASE);
+    __atomic_store_n(&Watchdog.phase, phase, __ATOMIC_RELEASE);
+
+    return prev;
+}
+
+void watchdog_restore_phase(struct Watchdog_Phase prev)
+{
+    watchdog_set_phase(prev.phase, prev.detail);
+}
+
+void watchdog_print_metrics(FILE *fp)
+{
+    size_t i;
+    uint64_t cumulative = 0;
+
+    /* written by the watchdog thread; a slightly stale snapshot is fine here */
+    for (i = 0; i < NUM_STALL_BUCKETS; ++i) {
+        cumulative += Watchdog.histogram[i];
+
+        if (i < NUM_STALL_BUCKETS - 1)
+            fprintf(fp, "loop_stall_ms_bucket{le=\"%"PRIu64"\"} %"PRIu64"\n", stall_buckets[i], cumulative);
+        else
+            fprintf(fp, "loop_stall_ms_bucket{le=\"+Inf\"} %"PRIu64"\n", cumulative);
+    }
+
+    fprintf(fp, "loop_stall_ms_sum %"PRIu64"\n", Watchdog.total_stall_ms);
+    fprintf(fp, "loop_stall_ms_count %"PRIu64"\n", Watchdog.num_stalls);
+    fprintf(fp, "loop_stall_ms_max %"PRIu64"\n", Watchdog.max_stall_ms);
+}
@@ -0,0 +1,73 @@
+/*  watchdog.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define WATCHDOG_THRESHOLD 2000    /* ms the main loop may go without a heartbeat before we call it a stall */
+#define WATCHDOG_INTERVAL 100      /* ms between watchdog checks */
+#define WATCHDOG_MAX_FRAMES 32
+
+typedef enum {
+    PHASE_IDLE,
+    PHASE_TOX_ITERATE,
+    PHASE_COMMAND,
+    PHASE_SAVE,
+    PHASE_PURGE_FRIENDS,
+    PHASE_REAP_GROUPS,
+    PHASE_FRIEND_REQUESTS,
+    PHASE_ADMIN,
+    PHASE_CONNECTION,
+    PHASE_METRICS,
+    PHASE_PLAYBACK,
+    PHASE_SPAM_FILTER,
+    PHASE_TASKS,
+    PHASE_TIMERS,
+    PHASE_BRIDGES,
+    NUM_WATCHDOG_PHASES
+} WATCHDOG_PHASE;
+
+struct Watchdog_Phase {
+    WATCHDOG_PHASE phase;
+    const char *detail;    /* e.g. the name of the command being executed; must be a static string */
+};
+
+/* Starts the watchdog thread. Must be called from the main thread.
+   Returns 0 on success, -1 on failure. */
+int watchdog_init(void);
+
+/* Signals that the main loop has completed an iteration */
+void watchdog_heartbeat(void);
+
+/* Sets the phase the main thread is currently in and returns the previous one */
+struct Watchdog_Phase watchdog_set_phase(WATCHDOG_PHASE phase, const char *detail);
+
+/* Restores a phase returned by watchdog_set_phase() */
+void watchdog_restore_phase(struct Watchdog_Phase prev);
+
+/* Writes stall metrics to fp */
+void watchdog_print_metrics(FILE *fp);
+
+#endif /* WATCHDOG_H */